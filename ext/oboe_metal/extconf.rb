@@ -137,6 +137,13 @@ if success
     CONFIG["debugflags"] = "-ggdb3 "
     CONFIG["optflags"] = "-O0"
 
+    # Ruby 3.3+, lets the profiler sample threads other than the current one
+    have_func('rb_profile_thread_frames', 'ruby/debug.h')
+    # Ruby 3.3+, replaces the deprecated rb_postponed_job_register(_one)
+    have_func('rb_postponed_job_preregister', 'ruby/debug.h')
+    # dladdr() symbolizes the native stacks, in libc since glibc 2.34
+    have_library('dl', 'dladdr', 'dlfcn.h')
+
     create_makefile('libsolarwinds_apm', 'src')
   else
     $stderr.puts   '== ERROR ========================================================='
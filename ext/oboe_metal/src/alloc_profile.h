@@ -0,0 +1,67 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef ALLOC_PROFILE_H
+#define ALLOC_PROFILE_H
+
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// The allocation samples of a run, the weighted counts and bytes per
+// stack of frame ids, innermost frame first. Sent periodically and at the
+// end of the run, then cleared. Only used by the encoder thread.
+class AllocProfile {
+   public:
+    void add(const long *ids, int num, long count, long bytes, long ts) {
+        if (empty()) start = ts;
+        key.assign(ids, ids + num);
+        Totals &totals = stacks[key];
+        totals.count += count;
+        totals.bytes += bytes;
+        num_samples++;
+    }
+
+    bool empty() const { return stacks.empty(); }
+    size_t size() const { return stacks.size(); }
+    long samples() const { return num_samples; }
+    long first_ts() const { return start; }
+
+    // one column entry per stack, its frames are the next num_frames ids
+    void columns(vector<long> &num_frames, vector<long> &ids, vector<long> &counts,
+                 vector<long> &bytes) const {
+        for (const auto &stack : stacks) {
+            num_frames.push_back((long)stack.first.size());
+            ids.insert(ids.end(), stack.first.begin(), stack.first.end());
+            counts.push_back(stack.second.count);
+            bytes.push_back(stack.second.bytes);
+        }
+    }
+
+    void clear() {
+        stacks.clear();
+        num_samples = 0;
+    }
+
+   private:
+    struct Totals {
+        long count = 0;
+        long bytes = 0;
+    };
+
+    struct Hash {
+        size_t operator()(const vector<long> &ids) const {
+            size_t h = ids.size();
+            for (long id : ids) h = h * 31 + (size_t)id;
+            return h;
+        }
+    };
+
+    unordered_map<vector<long>, Totals, Hash> stacks;
+    vector<long> key;  // reused, no allocation per sample for known stacks
+    long num_samples = 0;
+    long start = 0;
+};
+
+#endif  // ALLOC_PROFILE_H
@@ -0,0 +1,91 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef ALLOC_SAMPLER_H
+#define ALLOC_SAMPLER_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <climits>
+
+// Picks the allocations to sample, on average one in interval().
+//
+// The gaps between samples are geometrically distributed, allocations
+// that repeat with a fixed period don't line up with the sampling. A
+// sample stands for all allocations of its gap, its weight, so the
+// weighted counts are unbiased whatever the interval is.
+//
+// With a budget the sampler measures the time spent on samples, see
+// spent(), in windows of WINDOW_NS. The interval doubles while a window
+// is over the budget and halves back towards the configured one when a
+// window uses less than a quarter of it.
+//
+// Only used under the GVL.
+class AllocSampler {
+   public:
+    enum { WINDOW_NS = 200000000, MAX_INTERVAL = 1 << 30 };
+
+    // 0 turns sampling off
+    void configure(long interval, long budget_ppm) {
+        configured = current = std::min(interval, (long)MAX_INTERVAL);
+        budget = budget_ppm;
+        window_start = 0;
+        window_ns = 0;
+        gap = countdown = next_gap();
+    }
+
+    long interval() const { return current; }
+
+    // for each allocation, returns the weight if it is sampled, else 0
+    long sample() {
+        if (--countdown > 0) return 0;
+        long weight = gap;
+        gap = countdown = next_gap();
+        return weight;
+    }
+
+    // the time a sample took, now in monotonic ns
+    void spent(long ns, long now) {
+        if (budget == 0 || configured == 0) return;
+        if (window_start == 0) window_start = now;
+        window_ns += ns;
+        long elapsed = now - window_start;
+        if (elapsed < WINDOW_NS) return;
+
+        long ppm = window_ns * 1000000 / elapsed;
+        window_start = now;
+        window_ns = 0;
+        if (ppm > budget)
+            current = std::min(current * 2, (long)MAX_INTERVAL);
+        else if (ppm * 4 < budget && current > configured)
+            current = std::max(current / 2, configured);
+    }
+
+   private:
+    long next_gap() {
+        if (current == 0) return LONG_MAX;
+        if (current == 1) return 1;
+
+        // xorshift64*, u is uniform in (0, 1]
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        double u = (double)(((rng * 0x2545F4914F6CDD1DULL) >> 11) + 1) / 9007199254740992.0;
+
+        // geometric with a mean of current, the discrete exponential
+        return std::max(1L, (long)ceil(log(u) / log1p(-1.0 / current)));
+    }
+
+    long configured = 0;
+    long current = 0;
+    long budget = 0;  // in ppm of one core, 0 is no limit
+    long countdown = LONG_MAX;
+    long gap = 0;  // of the sample the countdown is running for
+    long window_start = 0;
+    long window_ns = 0;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+};
+
+#endif  // ALLOC_SAMPLER_H
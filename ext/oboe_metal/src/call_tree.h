@@ -0,0 +1,140 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef CALL_TREE_H
+#define CALL_TREE_H
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "oboe_api.h"
+
+// Sample counts per unique stack, as a tree of frame ids
+//
+// Each node is a frame called from its parent, the root is the empty
+// stack. A sample increments the count of the node of its innermost frame.
+// Consecutive samples mostly share the outer frames, the path of the
+// previous sample is kept, so adding a sample only walks the frames that
+// changed. The children of a node are a linked list, in a tree of Ruby
+// stacks most nodes have one or two.
+//
+// The output is the collapsed stack format of flamegraph.pl, one line per
+// stack with samples, "outer;...;inner count".
+class CallTree {
+   public:
+    CallTree() { clear(); }
+
+    // frame ids, innermost first, like the frames of a snapshot
+    void add(const long *ids, int num, long ts) {
+        if (empty()) start = ts;
+
+        // the outer frames shared with the previous sample
+        int match = 0;
+        int max = std::min(num, (int)path.size());
+        while (match < max && nodes[path[match]].id == ids[num - 1 - match]) match++;
+        path.resize(match);
+
+        int node = match > 0 ? path[match - 1] : ROOT;
+        for (int i = match; i < num; i++) {
+            node = child(node, ids[num - 1 - i]);
+            path.push_back(node);
+        }
+        nodes[node].count++;
+        num_samples++;
+    }
+
+    // the same stack as the previous sample
+    void add_repeat(long ts) {
+        if (empty()) start = ts;
+        nodes[path.empty() ? ROOT : path.back()].count++;
+        num_samples++;
+    }
+
+    bool has_name(long id) const { return names.count(id) > 0; }
+    // in line mode the id is a key of LineKeys and the name gets the line
+    void set_name(long id, const FrameData &frame, int line = 0) {
+        std::string &name = names[id];
+        name = frame.klass.empty() ? frame.method : frame.klass + "#" + frame.method;
+        if (line > 0) name += ":" + std::to_string(line);
+    }
+
+    bool empty() const { return num_samples == 0; }
+    long samples() const { return num_samples; }
+    size_t size() const { return nodes.size() - 1; }  // not counting the root
+    // timestamp of the first sample, only valid if not empty
+    long first_ts() const { return start; }
+
+    // appends the stacks with samples, in no particular order
+    // samples of the empty stack are left out
+    void collapse(std::string &out) const {
+        std::string stack;
+        std::vector<std::pair<int, size_t> > todo;  // node and the length of the stack of its parent
+        for (int c = nodes[ROOT].first_child; c != NONE; c = nodes[c].next_sibling)
+            todo.push_back(std::make_pair(c, 0));
+
+        while (!todo.empty()) {
+            int node = todo.back().first;
+            stack.resize(todo.back().second);
+            todo.pop_back();
+
+            if (!stack.empty()) stack.push_back(';');
+            auto it = names.find(nodes[node].id);
+            stack.append(it == names.end() ? std::to_string(nodes[node].id) : it->second);
+
+            if (nodes[node].count > 0) {
+                out.append(stack);
+                out.push_back(' ');
+                out.append(std::to_string(nodes[node].count));
+                out.push_back('\n');
+            }
+            for (int c = nodes[node].first_child; c != NONE; c = nodes[c].next_sibling)
+                todo.push_back(std::make_pair(c, stack.size()));
+        }
+    }
+
+    // the counts only, the names stay for the rest of the run
+    void clear_counts() {
+        nodes.clear();
+        nodes.push_back(Node(-1));
+        path.clear();
+        num_samples = 0;
+        start = 0;
+    }
+
+    void clear() {
+        clear_counts();
+        names.clear();
+    }
+
+   private:
+    enum { ROOT = 0, NONE = -1 };
+
+    struct Node {
+        explicit Node(long frame_id) : id(frame_id), count(0), first_child(NONE), next_sibling(NONE) {}
+        long id;
+        long count;  // samples with this as the innermost frame
+        int first_child;
+        int next_sibling;
+    };
+
+    int child(int parent, long id) {
+        for (int c = nodes[parent].first_child; c != NONE; c = nodes[c].next_sibling)
+            if (nodes[c].id == id) return c;
+
+        nodes.push_back(Node(id));
+        int c = (int)nodes.size() - 1;
+        nodes[c].next_sibling = nodes[parent].first_child;
+        nodes[parent].first_child = c;
+        return c;
+    }
+
+    std::vector<Node> nodes;
+    std::vector<int> path;  // nodes of the previous sample, outermost first
+    std::unordered_map<long, std::string> names;
+    long num_samples;
+    long start;
+};
+
+#endif  // CALL_TREE_H
@@ -0,0 +1,157 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef FRAME_TABLE_H
+#define FRAME_TABLE_H
+
+#include <ruby/ruby.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Open-addressing hash table for the frame cache, keyed by the frame VALUE
+//
+// The keys are stored in one contiguous array with linear probing, so a
+// lookup is a single probe sequence through adjacent memory. The flags used
+// when filtering snapshots are kept in their own small array next to the
+// ids, so the filter loop does not have to touch the frame info at all.
+// The ref is the index of the frame info in the frame cache.
+//
+// Slots are only valid until the next insert or erase, entries may move.
+// VALUE 0 (Qfalse) is never a frame and marks an empty slot.
+class FrameTable {
+   public:
+    // flags looked at for every frame of every snapshot
+    enum Flags {
+        NO_LINENO = 1,  // line number is 0
+        BLOCK = 2,      // "block in ..." frame
+        CFUNC = 4,      // method implemented in C, file is "<cfunc>"
+    };
+
+    // memory used by one slot, for keeping track of the size of the cache
+    enum { SLOT_BYTES = sizeof(VALUE) + 2 * sizeof(long) + sizeof(uint8_t) };
+
+    explicit FrameTable(size_t capacity = MIN_CAPACITY) : num(0) {
+        resize(capacity);
+    }
+
+    // returns the slot of the frame or -1
+    long find(VALUE frame) const {
+        size_t i = hash(frame) & mask;
+        while (true) {
+            VALUE key = keys[i];
+            // before the match, an empty slot also "matches" frame 0
+            if (key == EMPTY) return -1;
+            if (key == frame) return (long)i;
+            i = (i + 1) & mask;
+        }
+    }
+
+    // the frame must not be in the table yet, returns its slot
+    // or -1 for frame 0, which can't be told from an empty slot
+    long insert(VALUE frame, long id, uint8_t flags, long ref = 0) {
+        if (frame == EMPTY) return -1;
+
+        // keep the load factor at 1/2 or below, probe sequences stay short
+        if ((num + 1) * 2 > keys.size()) resize(keys.size() * 2);
+
+        size_t i = hash(frame) & mask;
+        while (keys[i] != EMPTY) i = (i + 1) & mask;
+
+        keys[i] = frame;
+        ids[i] = id;
+        refs[i] = ref;
+        hot[i] = flags;
+        num++;
+        return (long)i;
+    }
+
+    // backward shift deletion, entries further down the probe sequence
+    // move up into the hole, so lookups never need tombstones
+    void erase(long slot) {
+        size_t i = (size_t)slot;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (keys[j] == EMPTY) break;
+            // move the entry unless its home slot lies between the hole and j
+            size_t home = hash(keys[j]) & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                keys[i] = keys[j];
+                ids[i] = ids[j];
+                refs[i] = refs[j];
+                hot[i] = hot[j];
+                i = j;
+            }
+        }
+        keys[i] = EMPTY;
+        num--;
+    }
+
+    long id(long slot) const { return ids[slot]; }
+    long ref(long slot) const { return refs[slot]; }
+    uint8_t flags(long slot) const { return hot[slot]; }
+
+    size_t count(VALUE frame) const { return find(frame) < 0 ? 0 : 1; }
+    size_t size() const { return num; }
+    size_t capacity() const { return keys.size(); }
+
+    // make room for n frames without growing
+    void reserve(size_t n) {
+        if (n * 2 > keys.size()) resize(n * 2);
+    }
+
+    void clear() {
+        keys.assign(keys.size(), (VALUE)EMPTY);
+        num = 0;
+    }
+
+    // for iterating over all slots, empty ones have key 0
+    VALUE key(size_t slot) const { return keys[slot]; }
+
+    // frames are pointers, the low bits are always the same,
+    // multiply with the golden ratio to spread them over the table
+    static size_t hash(VALUE frame) {
+        return (size_t)(((uint64_t)frame >> 3) * 0x9E3779B97F4A7C15ULL >> 16);
+    }
+
+   private:
+    static const VALUE EMPTY = 0;
+    static const size_t MIN_CAPACITY = 16;
+
+    // capacity is rounded up to a power of 2
+    void resize(size_t capacity) {
+        size_t cap = MIN_CAPACITY;
+        while (cap < capacity) cap *= 2;
+
+        std::vector<VALUE> old_keys(cap, (VALUE)EMPTY);
+        std::vector<long> old_ids(cap);
+        std::vector<long> old_refs(cap);
+        std::vector<uint8_t> old_hot(cap);
+        old_keys.swap(keys);
+        old_ids.swap(ids);
+        old_refs.swap(refs);
+        old_hot.swap(hot);
+        mask = cap - 1;
+
+        for (size_t j = 0; j < old_keys.size(); j++) {
+            if (old_keys[j] == EMPTY) continue;
+            size_t i = hash(old_keys[j]) & mask;
+            while (keys[i] != EMPTY) i = (i + 1) & mask;
+            keys[i] = old_keys[j];
+            ids[i] = old_ids[j];
+            refs[i] = old_refs[j];
+            hot[i] = old_hot[j];
+        }
+    }
+
+    std::vector<VALUE> keys;
+    std::vector<long> ids;
+    std::vector<long> refs;
+    std::vector<uint8_t> hot;
+    size_t mask;
+    size_t num;
+};
+
+#endif  // FRAME_TABLE_H
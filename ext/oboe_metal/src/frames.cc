@@ -3,104 +3,486 @@
 
 #include "frames.h"
 
+#include <string.h>
+
+#include <iostream>
+
 using namespace std;
 
-unordered_map<VALUE, FrameData> cached_frames;
+// every distinct frame gets a small integer id, its info is sent once per
+// run in the frame dictionary, see collect_frame_dict(), the events only
+// carry the ids
+FrameTable cached_frames;     // frame -> id, flags and ref into frame_pool
+
+// The cache is bounded by a memory budget, when it is exceeded frames are
+// evicted with the CLOCK algorithm: the hand sweeps over the pool and
+// evicts the first frame that hasn't been hit since the last sweep.
+// Ids are never reused, a frame that comes back gets a new id and is
+// sent again.
+//
+// Cached frames are marked during GC, so Ruby neither frees nor moves
+// them while the raw VALUE is used as a key. Evicted frames are released.
+//
+// The names are interned in frame_names, an entry only has their refs.
+struct CachedFrame {
+    VALUE frame = 0;          // 0 if the entry is free
+    long id = -1;
+    StringArena::Ref method = StringArena::EMPTY;
+    StringArena::Ref klass = StringArena::EMPTY;
+    StringArena::Ref file = StringArena::EMPTY;
+    int lineno = 0;
+    size_t name_bytes = 0;    // length of the names
+    size_t bytes = 0;         // memory accounted for the entry
+    bool referenced = false;  // hit since the last sweep, only used by Ruby threads
+};
+
+static vector<CachedFrame> frame_pool;
+static vector<long> free_refs;
+static size_t clock_hand = 0;
+static size_t cache_bytes = 0;
+static size_t cache_limit = FRAME_CACHE_LIMIT;
+static long cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+
+// the arena only grows, it is rebuilt when less than half of it is used
+// by cached frames, live_name_bytes counts shared names once per frame
+#define FRAME_NAMES_MIN_SIZE (64 * 1024)
+static StringArena frame_names;
+static size_t live_name_bytes = 0;
+
+// the pseudo frames PR_OTHER_THREAD, PR_IN_GC, PR_GVL_WAIT and PR_OFF_CPU
+// have fixed ids,
+// the ids of cached frames come after them
+static long frame_id_seq = 0;
+
+static VALUE frame_cache_marker = Qnil;
+
+// Native frames, see native_stack.h and cache_native_frame()
+// Their keys are tagged addresses the Ruby threads never look up, they are
+// added by the encoder thread, so they get their own table and pool, the
+// frame cache itself is only changed by Ruby threads. There is one per
+// symbol, they stay until the cache is cleared. Their dictionary entries
+// have a ref of -2 - the index in native_pool.
+static FrameTable native_frames;
+static vector<FrameData> native_pool;
+
+// the table of the frame, native frames have Fixnum-tagged keys
+static inline const FrameTable &table_of(VALUE frame) {
+    return FIXNUM_P(frame) ? native_frames : cached_frames;
+}
 
-// in theory the mutex is not needed, because Ruby does not context switch
-// while executing a foreign function, but will this always hold true?
+// frames are only added by Ruby threads holding the GVL, but the encoder
+// thread reads them, the encoder holds the mutex while reading,
+// the Ruby threads while adding or evicting
 mutex cached_frames_mutex;
 
+unique_lock<mutex> Frames::lock_cached_frames() {
+    return unique_lock<mutex>(cached_frames_mutex);
+}
+
+// for the fork handlers, the mutex was locked with lock_cached_frames().release()
+void Frames::unlock_cached_frames() {
+    cached_frames_mutex.unlock();
+}
+
+static FrameData to_frame_data(const CachedFrame &entry) {
+    FrameData data;
+    data.method = frame_names.str(entry.method);
+    data.klass = frame_names.str(entry.klass);
+    data.file = frame_names.str(entry.file);
+    data.lineno = entry.lineno;
+    return data;
+}
+
+static FrameData pseudo_frame(long id) {
+    static const char *names[] = {"OTHER THREADS", "GARBAGE COLLECTION", "GVL WAIT", "OFF CPU"};
+    FrameData data;
+    data.method = names[id];
+    return data;
+}
+
+// the fixed id if the frame is a pseudo frame, else -1
+static long pseudo_frame_id(VALUE frame) {
+    switch (frame) {
+        case PR_OTHER_THREAD: return FRAME_ID_OTHER_THREAD;
+        case PR_IN_GC: return FRAME_ID_IN_GC;
+        case PR_GVL_WAIT: return FRAME_ID_GVL_WAIT;
+        case PR_OFF_CPU: return FRAME_ID_OFF_CPU;
+        default: return -1;
+    }
+}
+
+static void init_frame_dict() {
+    frame_id_seq = FRAME_ID_OFF_CPU + 1;
+}
+
 void Frames::reserve_cached_frames() {
     lock_guard<mutex> guard(cached_frames_mutex);
-    // unordered_maps grow automatically, but it starts at 1 and then
-    // doubles when it is full, so lets avoid the warmup
-    cached_frames.reserve(500);  // it will round to a prime number: 503
+    // the table grows automatically, but it starts small and then
+    // doubles when it is half full, so lets avoid the warmup
+    cached_frames.reserve(500);  // it will round up to a power of 2: 1024 slots
+    frame_pool.reserve(500);
+    if (frame_id_seq == 0) init_frame_dict();
 }
 
 void Frames::clear_cached_frames() {
     lock_guard<mutex> guard(cached_frames_mutex);
-        // unordered_maps grow automatically, but it starts at 1 and then
-        // doubles when it is full, so lets avoid the warmup
     cached_frames.clear();
+    frame_pool.clear();
+    free_refs.clear();
+    clock_hand = 0;
+    cache_bytes = 0;
+    frame_names.clear();  // one free for all the names
+    live_name_bytes = 0;
+    cache_hits = cache_misses = cache_evictions = 0;
+    native_frames.clear();
+    native_pool.clear();
+    init_frame_dict();
+}
+
+// GC callbacks of the marker object, they run in a Ruby thread holding the
+// GVL, so the pool can't change underneath them
+static void frame_cache_mark(void *ptr) {
+    for (size_t i = 0; i < frame_pool.size(); i++)
+        if (frame_pool[i].frame) rb_gc_mark(frame_pool[i].frame);  // pins the frame
+}
+
+static size_t frame_cache_memsize(const void *ptr) {
+    return frame_pool.capacity() * sizeof(CachedFrame) +
+           cached_frames.capacity() * FrameTable::SLOT_BYTES +
+           frame_names.memsize();
+}
+
+static const rb_data_type_t frame_cache_type = {
+    "SolarWindsAPM::FrameCache",
+    {frame_cache_mark, NULL, frame_cache_memsize},
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// keeps the cached frames alive and in place, call once from Init_profiling()
+void Frames::register_gc_marker() {
+    if (frame_cache_marker != Qnil) return;
+    frame_cache_marker = TypedData_Wrap_Struct(rb_cObject, &frame_cache_type, NULL);
+    rb_global_variable(&frame_cache_marker);
+}
+
+FrameCacheStats Frames::cache_stats() {
+    lock_guard<mutex> guard(cached_frames_mutex);
+    FrameCacheStats stats;
+    stats.size = cached_frames.size();
+    stats.bytes = cache_bytes;
+    stats.limit = cache_limit;
+    stats.names_bytes = frame_names.memsize();
+    stats.hits = cache_hits;
+    stats.misses = cache_misses;
+    stats.evictions = cache_evictions;
+    return stats;
 }
 
-// this is a private function
+// needs the GVL, returns the limit in effect
+size_t Frames::set_cache_limit(size_t bytes) {
+    lock_guard<mutex> guard(cached_frames_mutex);
+    cache_limit = max(bytes, (size_t)FRAME_CACHE_MIN_LIMIT);
+    evict_frames();
+    return cache_limit;
+}
+
+// compares the start of a Ruby string without copying it
+static bool starts_with(VALUE str, const char *prefix, long len) {
+    return RSTRING_LEN(str) >= len && strncmp(RSTRING_PTR(str), prefix, len) == 0;
+}
+
+// needs the lock, nil for a missing name
+static StringArena::Ref intern_name(VALUE str) {
+    if (NIL_P(str)) return StringArena::EMPTY;
+    return frame_names.intern(RSTRING_PTR(str), (size_t)RSTRING_LEN(str));
+}
+
+// this is a private function, returns 1 if the frame wasn't cached yet
+// the frame is classified here once, so that filtering snapshots only
+// has to look at the flags, no strings involved
 int Frames::cache_frame(VALUE frame) {
     VALUE val;
-    FrameData data;
+    VALUE method = Qnil, klass = Qnil, file = Qnil;
+    int lineno = 0;
+    uint8_t flags = 0;
 
     // only cache it if it does not exist
-    if (cached_frames.count(frame) == 0) {
-        val = rb_profile_frame_label(frame);  // returns method or block
-        if (RB_TYPE_P(val, T_STRING))
-            data.method = RSTRING_PTR(val);
-
-        if (data.method.rfind("block ", 0) == 0) {
-            // we don't need more info if it is a block
-            // we ignore block level info because they make things messy
-            lock_guard<mutex> guard(cached_frames_mutex);
-            cached_frames.insert({frame, data});
-            return 0;
-        }
+    long slot = cached_frames.find(frame);
+    if (slot >= 0) {
+        cache_hits++;
+        frame_pool[cached_frames.ref(slot)].referenced = true;
+        return 0;
+    }
+    cache_misses++;
 
+    val = rb_profile_frame_label(frame);  // returns method or block
+    if (RB_TYPE_P(val, T_STRING)) {
+        if (starts_with(val, "block ", 6)) flags |= FrameTable::BLOCK;
+        method = val;
+    }
+
+    if (flags & FrameTable::BLOCK) {
+        // we don't need more info if it is a block
+        // we ignore block level info because they make things messy
+        flags |= FrameTable::NO_LINENO;
+    } else {
         val = rb_profile_frame_classpath(frame);  // returns class or nil
-        if (RB_TYPE_P(val, T_STRING)) data.klass = RSTRING_PTR(val);
+        if (RB_TYPE_P(val, T_STRING)) klass = val;
 
         val = rb_profile_frame_absolute_path(frame);  // returns file, use rb_profile_frame_path() if nil
         if (!RB_TYPE_P(val, T_STRING)) val = rb_profile_frame_path(frame);
-        if (RB_TYPE_P(val, T_STRING)) data.file = RSTRING_PTR(val);
+        if (RB_TYPE_P(val, T_STRING)) {
+            if (starts_with(val, "<cfunc>", 7)) flags |= FrameTable::CFUNC;
+            file = val;
+        }
 
         // Ruby 3 reports <cfunc>, but the linenumbers are bogus
         // the default line number is 0
-        if (!data.file.compare("<cfunc>") == 0) {
+        if (!(flags & FrameTable::CFUNC)) {
             val = rb_profile_frame_first_lineno(frame);  // returns line number
             if (RB_TYPE_P(val, T_FIXNUM)) {
-                data.lineno = NUM2INT(val);
+                lineno = NUM2INT(val);
             }
         }
-        lock_guard<mutex> guard(cached_frames_mutex);
-        cached_frames.insert({frame, data});
+        if (lineno == 0) flags |= FrameTable::NO_LINENO;
     }
-    return 0;
+
+    // the strings are copied straight from Ruby into the arena
+    lock_guard<mutex> guard(cached_frames_mutex);
+    add_frame(frame, intern_name(method), intern_name(klass), intern_name(file), lineno, flags);
+    return 1;
+}
+
+// needs the lock
+void Frames::add_frame(VALUE frame, const FrameData &data, uint8_t flags) {
+    add_frame(frame,
+              frame_names.intern(data.method),
+              frame_names.intern(data.klass),
+              frame_names.intern(data.file),
+              data.lineno,
+              flags);
+}
+
+// needs the lock
+void Frames::add_frame(VALUE frame, StringArena::Ref method, StringArena::Ref klass,
+                       StringArena::Ref file, int lineno, uint8_t flags) {
+    long ref;
+    if (free_refs.empty()) {
+        ref = (long)frame_pool.size();
+        frame_pool.push_back(CachedFrame());
+    } else {
+        ref = free_refs.back();
+        free_refs.pop_back();
+    }
+
+    CachedFrame &entry = frame_pool[ref];
+    entry.frame = frame;
+    entry.id = frame_id_seq++;
+    entry.method = method;
+    entry.klass = klass;
+    entry.file = file;
+    entry.lineno = lineno;
+    entry.name_bytes = strlen(frame_names.str(method)) + strlen(frame_names.str(klass)) +
+                       strlen(frame_names.str(file));
+    // the table keeps the load factor below 1/2, count 2 slots per frame
+    entry.bytes = sizeof(CachedFrame) + 2 * FrameTable::SLOT_BYTES + entry.name_bytes;
+    // new frames get a full sweep before they can be evicted
+    entry.referenced = true;
+
+    cached_frames.insert(frame, entry.id, flags, ref);
+    cache_bytes += entry.bytes;
+    live_name_bytes += entry.name_bytes;
+
+    if (cache_bytes > cache_limit) evict_frames();
+}
+
+// adds a native frame if it isn't cached yet, needs the lock
+void Frames::cache_native_frame(VALUE key, const FrameData &data) {
+    if (native_frames.find(key) >= 0) return;
+
+    long ref = (long)native_pool.size();
+    native_pool.push_back(data);
+    long id = frame_id_seq++;
+    native_frames.insert(key, id, FrameTable::NO_LINENO, ref);
+}
+
+// Inserts the native frames, leaf first, under the innermost <cfunc> frame,
+// or under the leaf if there is none, their lines are 0. Keeps at most max
+// frames, the native ones go first. Needs the lock.
+int Frames::splice_native(VALUE *frames_buffer, int num, const VALUE *native, int native_num,
+                          int *lines, int max) {
+    int at = 0;
+    for (int i = 0; i < num; i++) {
+        long slot = cached_frames.find(frames_buffer[i]);
+        if (slot >= 0 && (cached_frames.flags(slot) & FrameTable::CFUNC)) {
+            at = i;
+            break;
+        }
+    }
+
+    native_num = std::min(native_num, max - at);
+    if (native_num <= 0) return num;
+    int moved = std::min(num - at, max - at - native_num);
+    memmove(frames_buffer + at + native_num, frames_buffer + at, moved * sizeof(VALUE));
+    memcpy(frames_buffer + at, native, native_num * sizeof(VALUE));
+    if (lines) {
+        memmove(lines + at + native_num, lines + at, moved * sizeof(int));
+        memset(lines + at, 0, native_num * sizeof(int));
+    }
+    return at + native_num + moved;
+}
+
+// needs the lock
+void Frames::remove_frame(long ref) {
+    CachedFrame &entry = frame_pool[ref];
+    long slot = cached_frames.find(entry.frame);
+    if (slot >= 0 && cached_frames.ref(slot) == ref) cached_frames.erase(slot);
+
+    cache_bytes -= entry.bytes;
+    live_name_bytes -= entry.name_bytes;
+    entry = CachedFrame();
+    free_refs.push_back(ref);
+    cache_evictions++;
+}
+
+// needs the lock
+// at most two sweeps, the first one may only clear the referenced flags
+void Frames::evict_frames() {
+    size_t steps = 2 * frame_pool.size();
+
+    while (cache_bytes > cache_limit && steps-- > 0) {
+        if (clock_hand >= frame_pool.size()) clock_hand = 0;
+        CachedFrame &entry = frame_pool[clock_hand];
+        if (entry.frame) {
+            if (entry.referenced)
+                entry.referenced = false;
+            else
+                remove_frame((long)clock_hand);
+        }
+        clock_hand++;
+    }
+
+    if (frame_names.size() > max((size_t)FRAME_NAMES_MIN_SIZE, 2 * live_name_bytes))
+        compact_frame_names();
+}
+
+// needs the lock
+// rebuilds the arena with only the names of the cached frames
+void Frames::compact_frame_names() {
+    StringArena names;
+    auto move = [&names](StringArena::Ref ref) {
+        const char *str = frame_names.str(ref);
+        return names.intern(str, strlen(str));
+    };
+
+    for (size_t i = 0; i < frame_pool.size(); i++) {
+        CachedFrame &entry = frame_pool[i];
+        if (!entry.frame) continue;
+        entry.method = move(entry.method);
+        entry.klass = move(entry.klass);
+        entry.file = move(entry.file);
+    }
+    frame_names.swap(names);  // the old arena is freed here
+}
+
+// needs the GVL, looking up new frames calls into Ruby
+// returns the number of frames that weren't cached yet
+int Frames::cache_frames(VALUE *frames_buffer, int num) {
+    int misses = 0;
+    for (int i = 0; i < num; i++)
+        misses += cache_frame(frames_buffer[i]);
+    return misses;
 }
 
 // all frames in frames_buffer must be in cached_frames
 // before calling this function
 // we are saving the check for better performance
 int Frames::collect_frame_data(VALUE *frames_buffer, int num, vector<FrameData> &frame_data) {
-    if (num == 1) {
-        if (frames_buffer[0] == PR_IN_GC) {
-            FrameData data;
-            data.method = "GARBAGE COLLECTION";
-            frame_data.push_back(data);
-            return 0;
-        } else if (frames_buffer[0] == PR_OTHER_THREAD) {
-            FrameData data;
-            data.method = "OTHER THREADS";
-            frame_data.push_back(data);
-            return 0;
-        }
+    if (num == 1 && pseudo_frame_id(frames_buffer[0]) >= 0) {
+        frame_data.push_back(pseudo_frame(pseudo_frame_id(frames_buffer[0])));
+        return 0;
     }
 
     for (int i = 0; i < num; i++) {
-        VALUE frame = frames_buffer[i];
-        frame_data.push_back(cached_frames[frame]);
+        const FrameTable &table = table_of(frames_buffer[i]);
+        long slot = table.find(frames_buffer[i]);
+        if (slot < 0)
+            frame_data.push_back(FrameData());
+        else if (&table == &native_frames)
+            frame_data.push_back(native_pool[table.ref(slot)]);
+        else
+            frame_data.push_back(to_frame_data(frame_pool[table.ref(slot)]));
     }
     return 0;
 }
 
+// same as collect_frame_data() but only the ids,
+// returns the highest id
+long Frames::collect_frame_ids(VALUE *frames_buffer, int num, vector<long> &ids) {
+    long max_id = -1;
+
+    if (num == 1 && pseudo_frame_id(frames_buffer[0]) >= 0) {
+        ids.push_back(pseudo_frame_id(frames_buffer[0]));
+        return ids.back();
+    }
+
+    for (int i = 0; i < num; i++) {
+        const FrameTable &table = table_of(frames_buffer[i]);
+        long slot = table.find(frames_buffer[i]);
+        long id = slot < 0 ? FRAME_ID_OTHER_THREAD : table.id(slot);
+        ids.push_back(id);
+        if (id > max_id) max_id = id;
+    }
+    return max_id;
+}
+
+// the id the next cached frame will get
+long Frames::next_frame_id() {
+    return frame_id_seq;
+}
+
+// the dictionary entries of the frames whose ids aren't in sent yet, in
+// the order of the frames, and adds the ids to sent, needs the lock
+// sent is per run, so every trace has the info for the ids it uses
+void Frames::collect_frame_dict(VALUE *frames_buffer, int num, unordered_set<long> &sent,
+                                vector<long> &ids, vector<FrameData> &frame_data) {
+    if (num == 1 && pseudo_frame_id(frames_buffer[0]) >= 0) {
+        long id = pseudo_frame_id(frames_buffer[0]);
+        if (sent.insert(id).second) {
+            ids.push_back(id);
+            frame_data.push_back(pseudo_frame(id));
+        }
+        return;
+    }
+
+    for (int i = 0; i < num; i++) {
+        const FrameTable &table = table_of(frames_buffer[i]);
+        long slot = table.find(frames_buffer[i]);
+        long id = slot < 0 ? FRAME_ID_OTHER_THREAD : table.id(slot);
+        if (!sent.insert(id).second) continue;
+        ids.push_back(id);
+        if (slot < 0)
+            frame_data.push_back(pseudo_frame(id));
+        else if (&table == &native_frames)
+            frame_data.push_back(native_pool[table.ref(slot)]);
+        else
+            frame_data.push_back(to_frame_data(frame_pool[table.ref(slot)]));
+    }
+}
+
 /////
-// For the sake of efficiency this function filters uninteresting frames and
-// does the caching of frames at the same time
+// For the sake of efficiency this function filters uninteresting frames
+// in place, looking only at the flags in the frame cache
 //
 // in-place removal of
 // - frames with line number == 0
 // - all but last of repeated frames
 // - "block" frames (they are confusing) <- revisit
-// and cache uncached frames
-int Frames::remove_garbage(VALUE *frames_buffer, int num) {
-    if (num == 1 && (frames_buffer[0] == PR_OTHER_THREAD || frames_buffer[0] == PR_IN_GC))
+//
+// all frames in frames_buffer must have been cached with cache_frames(),
+// this runs in the encoder thread and can't call into Ruby
+int Frames::remove_garbage(VALUE *frames_buffer, int num, int *lines) {
+    if (num == 1 && pseudo_frame_id(frames_buffer[0]) >= 0)
         return 1;
 
     // TODO decide what to do with <cfunc> frames in Ruby 3
@@ -111,64 +493,30 @@ int Frames::remove_garbage(VALUE *frames_buffer, int num) {
     bool found = true;
 
     while (found && num > 0) {
-        if (cached_frames.count(frames_buffer[num - 1]) == 1) {
-            found = (cached_frames[frames_buffer[num - 1]].lineno == 0);
-            if (found) num--;
-        } else {
-            VALUE val = rb_profile_frame_first_lineno(frames_buffer[num - 1]);
-            found = (!RB_TYPE_P(val, T_FIXNUM) || !NUM2INT(val));
-            if (found) {
-                lock_guard<mutex> guard(cached_frames_mutex);
-                cached_frames[frames_buffer[num - 1]].lineno = 0;
-                num--;
-            }
-        }
+        const FrameTable &table = table_of(frames_buffer[num - 1]);
+        long slot = table.find(frames_buffer[num - 1]);
+        found = (slot < 0 || (table.flags(slot) & FrameTable::NO_LINENO));
+        if (found) num--;
     }
 
     // 2) remove all repeated frames, keep the last one
-    int count = 0;
-    int k = 0;
-    found = false;
-    while (count < num - k) {
-        // is this frame repeated ahead?
-        // if so we will replace it with the next one in line
-        for (int j = count + k + 1; j < num; j++) {
-            if (frames_buffer[count] == frames_buffer[j]) {
-                found = true;
-                break;
-            }
-        }
-
-        if (found) {
-            // if we found this frame again later in the snapshot
-            // we are going to override this one
-            // but not if this is going beyond the boundary
-            k++;
-            if (count + k < num - 1) frames_buffer[count] = frames_buffer[count + k];
-        } else {
-            count++;
-            frames_buffer[count] = frames_buffer[count + k];
-        }
-        found = false;
-    }
+    num = remove_repeated(frames_buffer, num, lines);
 
     // 3) remove "block" frames, they are reported inconsistently and mess up
-    //    the profile in the dashboard
-    // 4)  while we are at it we also cache all the frames
-    // these 2 are combined so we don't have to run this loop twice
-    num = count;
-    count = 0, k = 0;
-    string method;
+    //    the profile in the dashboard, also frames that have been evicted
+    //    from the cache before the encoder got to them
+    int count = 0, k = 0;
 
     while (count < num - k) {
         frames_buffer[count] = frames_buffer[count + k];
-        cache_frame(frames_buffer[count]);
-        method = cached_frames[frames_buffer[count]].method;
+        if (lines) lines[count] = lines[count + k];
+        const FrameTable &table = table_of(frames_buffer[count]);
+        long slot = table.find(frames_buffer[count]);
 
         // TODO revisit need to remove block frames, they only appear when the Ruby
         // ____ script is not started with a method and has blocks outside of the
         // ____ methods called and sometimes inside of rack
-        if (method.rfind("block ", 0) == 0) {
+        if (slot < 0 || (table.flags(slot) & FrameTable::BLOCK)) {
             k++;
         } else {
             count++;
@@ -177,9 +525,56 @@ int Frames::remove_garbage(VALUE *frames_buffer, int num) {
     return count;
 }
 
+// Set of the frames seen in the current snapshot for remove_repeated()
+// Entries are stamped with the epoch of the snapshot, so the set never has
+// to be cleared. Open addressing, a full frames buffer fills it up to 1/2.
+// Only used by the encoder thread.
+#define SEEN_SIZE (2 * BUF_SIZE)
+static VALUE seen_frames[SEEN_SIZE];
+static unsigned int seen_epoch[SEEN_SIZE];
+static unsigned int epoch = 0;
+
+// returns true if the frame was seen before in this snapshot, adds it otherwise
+static bool seen_before(VALUE frame) {
+    size_t i = FrameTable::hash(frame) & (SEEN_SIZE - 1);
+    while (seen_epoch[i] == epoch) {
+        if (seen_frames[i] == frame) return true;
+        i = (i + 1) & (SEEN_SIZE - 1);
+    }
+    seen_frames[i] = frame;
+    seen_epoch[i] = epoch;
+    return false;
+}
+
+// in-place removal of all but the last of repeated frames, keeps the order,
+// O(num), recursive code can have thousands of repeated frames
+int Frames::remove_repeated(VALUE *frames_buffer, int num, int *lines) {
+    if (num > BUF_SIZE) num = BUF_SIZE;
+    if (++epoch == 0) {
+        // wrapped around, old stamps could look current
+        memset(seen_epoch, 0, sizeof(seen_epoch));
+        epoch = 1;
+    }
+
+    // walk from the end, the first one seen is the last one in the snapshot
+    // kept frames are collected at the end of the buffer
+    int k = num;
+    for (int i = num - 1; i >= 0; i--) {
+        if (seen_before(frames_buffer[i])) continue;
+        frames_buffer[--k] = frames_buffer[i];
+        if (lines) lines[k] = lines[i];
+    }
+
+    int count = num - k;
+    memmove(frames_buffer, frames_buffer + k, count * sizeof(VALUE));
+    if (lines) memmove(lines, lines + k, count * sizeof(int));
+    return count;
+}
+
 // returns the number of the matching frames
 int Frames::num_matching(VALUE *frames_buffer, int num,
-                         VALUE *prev_frames_buffer, int prev_num) {
+                         VALUE *prev_frames_buffer, int prev_num,
+                         const int *lines, const int *prev_lines) {
     int i;
     int min = std::min(num, prev_num);
 
@@ -188,6 +583,10 @@ int Frames::num_matching(VALUE *frames_buffer, int num,
         if (frames_buffer[num - 1 - i] != prev_frames_buffer[prev_num - 1 - i]) {
             return i;
         }
+        // a frame that moved on to another line is a new frame
+        if (lines && lines[num - 1 - i] != prev_lines[prev_num - 1 - i]) {
+            return i;
+        }
     }
     return i;
 }
@@ -195,7 +594,7 @@ int Frames::num_matching(VALUE *frames_buffer, int num,
 /////////////////////// DEBUGGING HELPER FUNCTIONS /////////////////////////////
 // helper function to print frame from ruby pointers to frame
 void Frames::print_raw_frame_info(VALUE frame) {
-    if (frame == PR_IN_GC || frame == PR_OTHER_THREAD) {
+    if (pseudo_frame_id(frame) >= 0) {
         return;
     }
 
@@ -231,17 +630,25 @@ void Frames::print_all_raw_frames(VALUE *frames_buffer, int num) {
 
 // helper function to print frame info
 void Frames::print_frame_info(VALUE frame) {
-    if (cached_frames.find(frame) != cached_frames.end())
-        std::cout << cached_frames[frame].lineno << " "
-                  << cached_frames[frame].file << " "
-                  << cached_frames[frame].klass << " "
-                  << cached_frames[frame].method << std::endl;
+    long slot = cached_frames.find(frame);
+    if (slot >= 0) {
+        FrameData data = to_frame_data(frame_pool[cached_frames.ref(slot)]);
+        std::cout << cached_frames.id(slot) << " "
+                  << data.lineno << " "
+                  << data.file << " "
+                  << data.klass << " "
+                  << data.method << std::endl;
+    }
 }
 
 // helper function for printing the cached frames
 void Frames::print_cached_frames() {
     std::cout << "cached_frames contains:" << endl;
-    for (auto it = cached_frames.cbegin(); it != cached_frames.cend(); ++it)
-        std::cout << "           " << it->first << " - " << it->second.method << ":" << it->second.lineno << endl;  // cannot modify *it
+    for (size_t slot = 0; slot < cached_frames.capacity(); slot++) {
+        if (!cached_frames.key(slot)) continue;
+        FrameData data = to_frame_data(frame_pool[cached_frames.ref(slot)]);
+        std::cout << "           " << cached_frames.key(slot) << " - " << cached_frames.id(slot) << " - "
+                  << data.method << ":" << data.lineno << endl;
+    }
     std::cout << std::endl;
 }
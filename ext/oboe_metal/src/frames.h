@@ -8,26 +8,73 @@
 
 #include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <ruby/ruby.h>
 #include <ruby/debug.h>
 
+#include "frame_table.h"
+#include "string_arena.h"
 #include "profiling.h"
 #include "oboe_api.h"
 
 using namespace std;
 
+// fixed ids of the pseudo frames in the frame dictionary
+#define FRAME_ID_OTHER_THREAD 0
+#define FRAME_ID_IN_GC 1
+#define FRAME_ID_GVL_WAIT 2
+#define FRAME_ID_OFF_CPU 3
+
+// default and lower bound of the memory budget of the frame cache in bytes
+#define FRAME_CACHE_LIMIT (4 * 1024 * 1024)
+#define FRAME_CACHE_MIN_LIMIT (64 * 1024)
+
+struct FrameCacheStats {
+    size_t size;       // number of cached frames
+    size_t bytes;      // memory used by them
+    size_t limit;      // budget, frames are evicted when it is exceeded
+    size_t names_bytes;  // memory of the interned names
+    long hits;
+    long misses;
+    long evictions;
+};
+
 class Frames {
    public:
     static void clear_cached_frames();
     static void reserve_cached_frames();
+    static void register_gc_marker();
+    static FrameCacheStats cache_stats();
+    static size_t set_cache_limit(size_t bytes);
+    static unique_lock<mutex> lock_cached_frames();
+    static void unlock_cached_frames();
+    static int cache_frames(VALUE *frames_buffer, int num);
+    static void add_frame(VALUE frame, const FrameData &data, uint8_t flags);
+    // native frames, only added by the encoder thread, see native_stack.h
+    static void cache_native_frame(VALUE key, const FrameData &data);
+    static int splice_native(VALUE *frames_buffer, int num, const VALUE *native, int native_num,
+                             int *lines, int max);
     static int collect_frame_data(VALUE *frames_buffer, int num, vector<FrameData> &frame_data);
-    static int remove_garbage(VALUE *frames_buffer, int num);
+    static long collect_frame_ids(VALUE *frames_buffer, int num, vector<long> &ids);
+    static long next_frame_id();
+    static void collect_frame_dict(VALUE *frames_buffer, int num, unordered_set<long> &sent,
+                                   vector<long> &ids, vector<FrameData> &frame_data);
+    // with lines, the line of each frame moves along with it
+    static int remove_garbage(VALUE *frames_buffer, int num, int *lines = NULL);
+    static int remove_repeated(VALUE *frames_buffer, int num, int *lines = NULL);
+    // with lines, frames only match if they are at the same line
     static int num_matching(VALUE *frames_buffer, int num,
-                            VALUE *prev_frames_buffer, int prev_num);
+                            VALUE *prev_frames_buffer, int prev_num,
+                            const int *lines = NULL, const int *prev_lines = NULL);
 
    private:
     static int cache_frame(VALUE frame);
+    static void add_frame(VALUE frame, StringArena::Ref method, StringArena::Ref klass,
+                          StringArena::Ref file, int lineno, uint8_t flags);
+    static void compact_frame_names();
+    static void remove_frame(long ref);
+    static void evict_frames();
 
     // Debugging helper functions
    public:
@@ -0,0 +1,82 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef GC_PHASES_H
+#define GC_PHASES_H
+
+// flags of a GcPause
+#define GC_PAUSE_MAJOR 1  // part of a major GC
+#define GC_PAUSE_START 2  // started the GC
+#define GC_PAUSE_END 4    // finished sweeping, the GC is done
+
+// One GC step, from GC_ENTER to GC_EXIT, in the thread that ran it.
+// With incremental marking and lazy sweeping a GC is spread over several
+// steps, each one a pause of the thread that happened to allocate.
+struct GcPause {
+    long ts;        // start, in microseconds like the snapshots
+    long mark_ns;
+    long sweep_ns;  // also the time outside of marking, e.g. after the sweep
+    int flags;
+};
+
+// Follows the internal GC events and splits the steps into marking and
+// sweeping. Only called from the GC event hook, under the GVL, and with
+// one GC at a time, so no locking. Durations in monotonic nanoseconds.
+class GcPhases {
+   public:
+    void enter(long ns, long ts) {
+        pause = {ts, 0, 0, 0};
+        phase_start = ns;
+    }
+
+    // GC_START, marking begins
+    void start(long ns, bool is_major) {
+        close_phase(ns);
+        phase = MARK;
+        major = is_major;
+        pause.flags |= GC_PAUSE_START;
+    }
+
+    void end_mark(long ns) {
+        close_phase(ns);
+        phase = SWEEP;
+    }
+
+    void end_sweep(long ns) {
+        close_phase(ns);
+        phase = NONE;
+        pause.flags |= GC_PAUSE_END;
+    }
+
+    GcPause exit(long ns) {
+        close_phase(ns);
+        if (major) pause.flags |= GC_PAUSE_MAJOR;
+        if (pause.flags & GC_PAUSE_END) major = false;
+        return pause;
+    }
+
+    // the events were off, a GC may be half way through incremental
+    // marking or lazy sweeping, with :state of GC.latest_gc_info
+    void resume(bool marking, bool sweeping, bool is_major) {
+        phase = marking ? MARK : (sweeping ? SWEEP : NONE);
+        major = phase != NONE && is_major;
+    }
+
+   private:
+    enum Phase { NONE, MARK, SWEEP };
+
+    void close_phase(long ns) {
+        if (phase == MARK)
+            pause.mark_ns += ns - phase_start;
+        else
+            pause.sweep_ns += ns - phase_start;
+        phase_start = ns;
+    }
+
+    Phase phase = NONE;
+    bool major = false;  // of the GC in progress, lazy sweep steps belong to it
+    long phase_start = 0;
+    GcPause pause = {0, 0, 0, 0};
+};
+
+#endif  // GC_PHASES_H
@@ -0,0 +1,188 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef GVL_TRACKER_H
+#define GVL_TRACKER_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// states of a thread between two thread events
+#define GVL_STATE_RUNNING 0  // holds the GVL
+#define GVL_STATE_WAIT 1     // READY to RESUMED, waiting for the GVL
+#define GVL_STATE_OFF_CPU 2  // SUSPENDED to READY, sleeping, in IO, waiting for a lock
+
+// An interval a thread spent without the GVL. Intervals shorter than the
+// minimum of the tracker aren't reported one by one, they are added up in
+// wait_us and off_cpu_us of the next interval instead. A record with state
+// GVL_STATE_RUNNING only carries these totals. In microseconds like the
+// snapshots.
+struct GvlInterval {
+    long run;  // the run of the thread, set when pushed
+    int state;
+    long ts;
+    long us;
+    long wait_us;     // short GVL waits since the previous record
+    long off_cpu_us;  // short off-CPU intervals since the previous record
+};
+
+// Follows the thread events READY, RESUMED and SUSPENDED of one thread.
+// Only called by the thread itself, from the thread event hook, which runs
+// with and without the GVL, so no locking and no allocations.
+class GvlTracker {
+   public:
+    GvlTracker(long min_us, long flush_us) : min_us(min_us), flush_us(flush_us) {}
+
+    // the thread holds the GVL from now on, the totals start over
+    void reset(long ts) {
+        state = GVL_STATE_RUNNING;
+        state_ts = ts;
+        short_wait_us = short_off_cpu_us = 0;
+        short_ts = 0;
+    }
+
+    // each returns true if there is a record in out
+    bool suspended(long ts, GvlInterval &out) {
+        bool done = flush_due(ts, out);
+        state = GVL_STATE_OFF_CPU;
+        state_ts = ts;
+        return done;
+    }
+
+    bool ready(long ts, GvlInterval &out) {
+        bool done = state == GVL_STATE_OFF_CPU && close(ts, out);
+        state = GVL_STATE_WAIT;
+        state_ts = ts;
+        return done;
+    }
+
+    bool resumed(long ts, GvlInterval &out) {
+        bool done = state == GVL_STATE_WAIT && close(ts, out);
+        state = GVL_STATE_RUNNING;
+        state_ts = ts;
+        return done;
+    }
+
+    // the totals of the short intervals, at the end of a run
+    bool flush(GvlInterval &out) {
+        if (short_ts == 0) return false;
+        out = {0, GVL_STATE_RUNNING, short_ts, 0, short_wait_us, short_off_cpu_us};
+        short_wait_us = short_off_cpu_us = 0;
+        short_ts = 0;
+        return true;
+    }
+
+    int current() const { return state; }
+    long since() const { return state_ts; }
+
+   private:
+    bool close(long ts, GvlInterval &out) {
+        long us = ts - state_ts;
+        if (us >= min_us) {
+            out = {0, state, state_ts, us, short_wait_us, short_off_cpu_us};
+            short_wait_us = short_off_cpu_us = 0;
+            short_ts = 0;
+            return true;
+        }
+        if (short_ts == 0) short_ts = state_ts;
+        if (state == GVL_STATE_WAIT)
+            short_wait_us += us;
+        else
+            short_off_cpu_us += us;
+        return false;
+    }
+
+    // a thread that only ever waits briefly still reports now and then
+    bool flush_due(long ts, GvlInterval &out) {
+        return short_ts != 0 && ts - short_ts >= flush_us && flush(out);
+    }
+
+    long min_us;
+    long flush_us;
+    int state = GVL_STATE_RUNNING;
+    long state_ts = 0;
+    long short_wait_us = 0;
+    long short_off_cpu_us = 0;
+    long short_ts = 0;  // start of the first short interval not reported yet
+};
+
+// Single-producer/single-consumer queue of the intervals of a thread, the
+// thread event hook pushes, the encoder thread pops. Fixed size, pushing
+// never allocates and fails when the encoder has fallen behind.
+class GvlRing {
+   public:
+    static const size_t CAPACITY = 1024;  // power of 2
+
+    bool push(const GvlInterval &interval) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == CAPACITY) return false;
+        buf[h & (CAPACITY - 1)] = interval;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool peek(GvlInterval &interval) const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        interval = buf[t & (CAPACITY - 1)];
+        return true;
+    }
+
+    void pop() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // only when neither side is using it, e.g. in a forked child
+    void clear() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+   private:
+    // zeroed, a ring on the stack would otherwise look uninitialized to peek()
+    GvlInterval buf[CAPACITY] = {};
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+};
+
+// The intervals of a run not sent yet, as the columns of the gvl event,
+// and the totals of all GVL waits and off-CPU time. Only used by the
+// encoder thread.
+class GvlBatch {
+   public:
+    void add(const GvlInterval &interval) {
+        if (first == 0) first = interval.ts;
+        wait_us += interval.wait_us;
+        off_cpu_us += interval.off_cpu_us;
+        if (interval.state == GVL_STATE_RUNNING) return;
+
+        states.push_back(interval.state);
+        timestamps.push_back(interval.ts);
+        durations.push_back(interval.us);
+        if (interval.state == GVL_STATE_WAIT)
+            wait_us += interval.us;
+        else
+            off_cpu_us += interval.us;
+    }
+
+    bool empty() const { return first == 0; }
+    long first_ts() const { return first; }
+
+    void clear() {
+        states.clear();
+        timestamps.clear();
+        durations.clear();
+        wait_us = off_cpu_us = 0;
+        first = 0;
+    }
+
+    std::vector<long> states;
+    std::vector<long> timestamps;
+    std::vector<long> durations;
+    long wait_us = 0;
+    long off_cpu_us = 0;
+
+   private:
+    long first = 0;
+};
+
+#endif  // GVL_TRACKER_H
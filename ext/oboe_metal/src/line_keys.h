@@ -0,0 +1,40 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef LINE_KEYS_H
+#define LINE_KEYS_H
+
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+// Keys for the (frame id, line) pairs of a run in line mode
+//
+// The frame cache and the frame dictionary stay one entry per frame, the
+// line is a property of the sample. The pprof profile and the call tree
+// aggregate by location though, in line mode their stacks use these keys
+// instead of the frame ids, so that the samples of different lines of a
+// method are counted apart. Dense, starting at 0, cleared with the profile
+// or tree at the start of a run. Only used by the encoder thread.
+class LineKeys {
+   public:
+    long key(long frame_id, int line) {
+        auto it = keys.emplace(std::make_pair(frame_id, line), (long)keys.size());
+        return it.first->second;
+    }
+
+    size_t size() const { return keys.size(); }
+    void clear() { keys.clear(); }
+
+   private:
+    struct Hash {
+        size_t operator()(const std::pair<long, int> &key) const {
+            return std::hash<long>()(key.first) * 31 + (size_t)key.second;
+        }
+    };
+
+    std::unordered_map<std::pair<long, int>, long, Hash> keys;
+};
+
+#endif  // LINE_KEYS_H
@@ -3,6 +3,10 @@
 
 #include "logging.h"
 
+#include <sys/time.h>
+
+#include <cstring>
+
 using namespace std;
 
 const string Logging::profiling = "profiling";
@@ -10,11 +14,122 @@ const string Logging::ruby = "ruby";
 const string Logging::entry = "entry";
 const string Logging::info = "info";
 const string Logging::exit = "exit";
+const string Logging::missed = "missed";
+const string Logging::gc = "gc";
+const string Logging::alloc = "alloc";
+const string Logging::gvl = "gvl";
+const string Logging::dictionary = "dictionary";
+const string Logging::batch = "batch";
+const string Logging::profile = "profile";
+const string Logging::pprof = "pprof";
+const string Logging::collapsed = "collapsed";
+const string Logging::wall = "wall";
+const string Logging::cpu = "cpu";
+
+// Copy of the events in a ring file, for reading them without the reporter
+// Every event becomes one record with its KVs, each one:
+//   uint8_t type, uint8_t key length, key,
+//   RECORD_LONG    int64_t
+//   RECORD_STRING  uint32_t length, bytes
+//   RECORD_LONGS   uint32_t n, n int64_t
+//   RECORD_FRAMES  uint32_t n, n times method, klass and file as
+//                  strings and the lineno as int64_t
+// bin/solarwinds_apm_profile_dump prints them.
+// Only the encoder thread logs events, the record is reused.
+#define RECORD_LONG 1
+#define RECORD_STRING 2
+#define RECORD_LONGS 3
+#define RECORD_FRAMES 4
+
+RingFile Logging::ring_file;
+StatHistogram *Logging::timing = NULL;
+static long event_start = 0;
+static string ring_dir;
+static size_t ring_size = 0;
+static string record;
+
+static void put_key(uint8_t type, const char *key) {
+    uint8_t len = (uint8_t)strlen(key);
+    record.push_back((char)type);
+    record.push_back((char)len);
+    record.append(key, len);
+}
+
+static void put_long(long val) {
+    int64_t v = val;
+    record.append((const char *)&v, sizeof(v));
+}
+
+static void put_string(const string &val) {
+    uint32_t len = (uint32_t)val.size();
+    record.append((const char *)&len, sizeof(len));
+    record.append(val);
+}
+
+static void add(Event *event, const char *key, long val) {
+    event->addInfo((char *)key, val);
+    if (!Logging::ring_file.is_open()) return;
+    put_key(RECORD_LONG, key);
+    put_long(val);
+}
+
+static void add(Event *event, const char *key, const string &val) {
+    event->addInfo((char *)key, val);
+    if (!Logging::ring_file.is_open()) return;
+    put_key(RECORD_STRING, key);
+    put_string(val);
+}
+
+static void add(Event *event, const char *key, long *vals, int num) {
+    event->addInfo((char *)key, vals, num);
+    if (!Logging::ring_file.is_open()) return;
+    put_key(RECORD_LONGS, key);
+    uint32_t n = (uint32_t)num;
+    record.append((const char *)&n, sizeof(n));
+    for (int i = 0; i < num; i++) put_long(vals[i]);
+}
+
+static void add(Event *event, const char *key, const vector<FrameData> &frames) {
+    event->addInfo((char *)key, frames);
+    if (!Logging::ring_file.is_open()) return;
+    put_key(RECORD_FRAMES, key);
+    uint32_t n = (uint32_t)frames.size();
+    record.append((const char *)&n, sizeof(n));
+    for (const FrameData &frame : frames) {
+        put_string(frame.method);
+        put_string(frame.klass);
+        put_string(frame.file);
+        put_long(frame.lineno);
+    }
+}
+
+// one file per process in dir, an empty dir closes it
+bool Logging::open_ring_file(const string &dir, size_t size) {
+    ring_dir = dir;
+    ring_size = size;
+    if (dir.empty()) {
+        ring_file.close();
+        return true;
+    }
+
+    string path = dir + "/solarwinds_apm_profile." + to_string((long)AO_GETPID()) + ".ring";
+    if (ring_file.is_open() && ring_file.path() == path) return true;
+    return ring_file.open(path, size);
+}
+
+// a forked child must not write into the file of its parent
+void Logging::reopen_ring_file() {
+    if (!ring_file.is_open()) return;
+    ring_file.close();
+    if (!open_ring_file(ring_dir, ring_size))
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "can't open the profiling ring file in %s", ring_dir.c_str());
+}
 
 Event *Logging::createEvent(Metadata &md, string &prof_op_id, bool entry_event) {
     // startTrace does not add "Edge", for profiling we need to keep track of edges
     // separately from the main trace metadata
 
+    if (timing) event_start = monotonic_ns();
     oboe_metadata_t *md_t = md.metadata();
     Event *event = Event::startTrace(md_t);
 
@@ -25,36 +140,51 @@ Event *Logging::createEvent(Metadata &md, string &prof_op_id, bool entry_event)
         event->addContextOpId(md_t);
     }
     prof_op_id.assign(event->opIdString());
+    record.clear();
 
     return event;
 }
 
-bool Logging::log_profile_entry(Metadata &md, string &prof_op_id, pid_t tid, long interval) {
+bool Logging::log_profile_entry(Metadata &md, string &prof_op_id, pid_t tid, long interval,
+                                const string &mode) {
     Event *event = Logging::createEvent(md, prof_op_id, true);
-    event->addInfo((char *)"Label", Logging::entry);
-    event->addInfo((char *)"Language", Logging::ruby);
-    event->addInfo((char *)"TID", (long)tid);
-    event->addInfo((char *)"Interval", interval);
+    add(event, "Label", Logging::entry);
+    add(event, "Language", Logging::ruby);
+    add(event, "TID", (long)tid);
+    add(event, "Interval", interval);
+    add(event, "Mode", mode);
 
     struct timeval tv;
     struct timezone *tz = NULL;
     gettimeofday(&tv, tz);
-    event->addInfo((char *)"Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
+    add(event, "Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
 
     return Logging::log_profile_event(event);
 }
 
-bool Logging::log_profile_exit(Metadata &md, string &prof_op_id, pid_t tid,
-                               long *omitted, int num_omitted) {
+bool Logging::log_profile_exit(Metadata &md, string &prof_op_id, pid_t tid, long interval,
+                               long *omitted, int num_omitted, const RunStats *stats) {
     Event *event = Logging::createEvent(md, prof_op_id);
-    event->addInfo((char *)"Label", Logging::exit);
-    event->addInfo((char *)"TID", (long)tid);
-    event->addInfo((char *)"SnapshotsOmitted", omitted, num_omitted);
+    add(event, "Label", Logging::exit);
+    add(event, "TID", (long)tid);
+    add(event, "Interval", interval);  // may differ from the entry with an overhead budget
+    add(event, "SnapshotsOmitted", omitted, num_omitted);
+
+    // the cost of profiling the run, see CProfiler.set_exit_stats
+    if (stats) {
+        add(event, "StatsSamples", stats->samples);
+        add(event, "StatsSamplesDropped", stats->samples_dropped);
+        add(event, "StatsCacheMisses", stats->cache_misses);
+        add(event, "StatsSnapshots", stats->snapshots);
+        add(event, "StatsSnapshotsOmitted", stats->omitted);
+        add(event, "StatsRemoveGarbageNs", stats->remove_garbage_ns);
+        add(event, "StatsLoggingNs", stats->logging_ns);
+    }
 
     struct timeval tv;
     struct timezone *tz = NULL;
     gettimeofday(&tv, tz);
-    event->addInfo((char *)"Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
+    add(event, "Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
 
     return Logging::log_profile_event(event);
 }
@@ -62,36 +192,256 @@ bool Logging::log_profile_exit(Metadata &md, string &prof_op_id, pid_t tid,
 bool Logging::log_profile_snapshot(Metadata &md,
                                    string &prof_op_id,
                                    long timestamp,
-                                   std::vector<FrameData> const &new_frames,
+                                   long *new_frame_ids,
+                                   int num_new,
                                    long exited_frames,
                                    long total_frames,
                                    long *omitted,
                                    int num_omitted,
-                                   pid_t tid) {
+                                   pid_t tid,
+                                   long *new_frame_lines,
+                                   std::vector<FrameData> const *new_frames) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Timestamp_u", timestamp);
+    add(event, "Label", Logging::info);
+
+    add(event, "SnapshotsOmitted", omitted, num_omitted);
+    // the frames themselves for collectors without the frame dictionary
+    if (new_frames)
+        add(event, "NewFrames", *new_frames);
+    else
+        add(event, "NewFrameIds", new_frame_ids, num_new);
+    // line mode, the current line of each new frame
+    if (new_frame_lines) add(event, "NewFrameLines", new_frame_lines, num_new);
+    add(event, "FramesExited", exited_frames);
+    add(event, "FramesCount", total_frames);
+    add(event, "TID", (long)tid);
+
+    return Logging::log_profile_event(event);
+}
+
+// ticks the thread went without a sample, the stack of the previous
+// snapshot stands for them, timestamps has the oldest ones if there were
+// more than fit into an event
+bool Logging::log_profile_missed(Metadata &md,
+                                 string &prof_op_id,
+                                 long *timestamps,
+                                 int num_timestamps,
+                                 long num_missed,
+                                 long blocked_us,
+                                 long total_frames,
+                                 pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Timestamp_u", timestamps[0]);
+    add(event, "Label", Logging::missed);
+
+    add(event, "SnapshotsMissed", timestamps, num_timestamps);
+    add(event, "MissedCount", num_missed);
+    add(event, "BlockedUs", blocked_us);
+    add(event, "FramesCount", total_frames);
+    add(event, "TID", (long)tid);
+
+    return Logging::log_profile_event(event);
+}
+
+// GC pauses of a thread in columns, see GcPause, with the stack that
+// allocated, innermost frame first
+bool Logging::log_profile_gc(Metadata &md,
+                             string &prof_op_id,
+                             vector<long> const &timestamps,
+                             vector<long> const &mark_ns,
+                             vector<long> const &sweep_ns,
+                             vector<long> const &flags,
+                             vector<long> const &frame_ids,
+                             pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Timestamp_u", timestamps[0]);
+    add(event, "Label", Logging::gc);
+
+    add(event, "Timestamps", (long *)timestamps.data(), (int)timestamps.size());
+    add(event, "MarkNs", (long *)mark_ns.data(), (int)mark_ns.size());
+    add(event, "SweepNs", (long *)sweep_ns.data(), (int)sweep_ns.size());
+    add(event, "GcFlags", (long *)flags.data(), (int)flags.size());
+    add(event, "FrameIds", (long *)frame_ids.data(), (int)frame_ids.size());
+    add(event, "TID", (long)tid);
+
+    return Logging::log_profile_event(event);
+}
+
+// sampled allocations per stack, in columns, the counts and bytes are
+// weighted, estimates of all allocations, see AllocSampler
+bool Logging::log_profile_alloc(Metadata &md,
+                                string &prof_op_id,
+                                const AllocProfile &allocs,
+                                long interval,
+                                pid_t tid) {
+
+    vector<long> num_frames, frame_ids, counts, bytes;
+    allocs.columns(num_frames, frame_ids, counts, bytes);
 
     Event *event = Logging::createEvent(md, prof_op_id);
-    event->addInfo((char *)"Timestamp_u", timestamp);
-    event->addInfo((char *)"Label", Logging::info);
+    add(event, "Timestamp_u", allocs.first_ts());
+    add(event, "Label", Logging::alloc);
 
-    event->addInfo((char *)"SnapshotsOmitted", omitted, num_omitted);
-    event->addInfo((char *)"NewFrames", new_frames);
-    event->addInfo((char *)"FramesExited", exited_frames);
-    event->addInfo((char *)"FramesCount", total_frames);
-    event->addInfo((char *)"TID", (long)tid);
+    add(event, "StackFrameCounts", num_frames.data(), (int)num_frames.size());
+    add(event, "FrameIds", frame_ids.data(), (int)frame_ids.size());
+    add(event, "Allocations", counts.data(), (int)counts.size());
+    add(event, "Bytes", bytes.data(), (int)bytes.size());
+    add(event, "Samples", allocs.samples());
+    add(event, "SampleInterval", interval);
+    add(event, "TID", (long)tid);
+
+    return Logging::log_profile_event(event);
+}
+
+// the time a thread spent waiting for the GVL and off CPU, the longer
+// intervals in columns, see GvlTracker, the totals include the short ones
+bool Logging::log_profile_gvl(Metadata &md,
+                              string &prof_op_id,
+                              const GvlBatch &gvl,
+                              pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Timestamp_u", gvl.first_ts());
+    add(event, "Label", Logging::gvl);
+
+    add(event, "States", (long *)gvl.states.data(), (int)gvl.states.size());
+    add(event, "Timestamps", (long *)gvl.timestamps.data(), (int)gvl.timestamps.size());
+    add(event, "DurationsUs", (long *)gvl.durations.data(), (int)gvl.durations.size());
+    add(event, "GvlWaitUs", gvl.wait_us);
+    add(event, "OffCpuUs", gvl.off_cpu_us);
+    add(event, "TID", (long)tid);
+
+    return Logging::log_profile_event(event);
+}
+
+// the snapshots of a thread in columns, see SnapshotBatch
+bool Logging::log_profile_batch(Metadata &md,
+                                string &prof_op_id,
+                                SnapshotBatch &batch,
+                                pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Timestamp_u", batch.first_ts());
+    add(event, "Label", Logging::batch);
+
+    add(event, "Timestamps", batch.timestamps.data(), (int)batch.timestamps.size());
+    add(event, "FramesExited", batch.exited.data(), (int)batch.exited.size());
+    add(event, "FramesCount", batch.counts.data(), (int)batch.counts.size());
+    add(event, "NewFrameCounts", batch.new_counts.data(), (int)batch.new_counts.size());
+    add(event, "NewFrameIds", batch.new_ids.data(), (int)batch.new_ids.size());
+    if (!batch.new_lines.empty())
+        add(event, "NewFrameLines", batch.new_lines.data(), (int)batch.new_lines.size());
+    add(event, "SnapshotsOmitted", batch.omitted.data(), (int)batch.omitted.size());
+    add(event, "TID", (long)tid);
+
+    return Logging::log_profile_event(event);
+}
+
+static void base64(const string &in, string &out) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    out.clear();
+    out.reserve((in.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3) {
+        uint32_t n = (uint8_t)in[i] << 16 | (uint8_t)in[i + 1] << 8 | (uint8_t)in[i + 2];
+        out.push_back(chars[n >> 18 & 63]);
+        out.push_back(chars[n >> 12 & 63]);
+        out.push_back(chars[n >> 6 & 63]);
+        out.push_back(chars[n & 63]);
+    }
+    if (i < in.size()) {
+        uint32_t n = (uint8_t)in[i] << 16;
+        if (i + 1 < in.size()) n |= (uint8_t)in[i + 1] << 8;
+        out.push_back(chars[n >> 18 & 63]);
+        out.push_back(chars[n >> 12 & 63]);
+        out.push_back(i + 1 < in.size() ? chars[n >> 6 & 63] : '=');
+        out.push_back('=');
+    }
+}
+
+// the whole run as one serialized pprof profile, base64 encoded
+bool Logging::log_profile_pprof(Metadata &md,
+                                string &prof_op_id,
+                                const string &profile,
+                                pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Label", Logging::profile);
+    add(event, "Format", Logging::pprof);
+
+    string encoded;
+    base64(profile, encoded);
+    add(event, "Profile", encoded);
+    add(event, "TID", (long)tid);
+
+    struct timeval tv;
+    struct timezone *tz = NULL;
+    gettimeofday(&tv, tz);
+    add(event, "Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
+
+    return Logging::log_profile_event(event);
+}
+
+// sample counts per stack since the last one, as flamegraph.pl input
+bool Logging::log_profile_collapsed(Metadata &md,
+                                    string &prof_op_id,
+                                    const string &stacks,
+                                    long samples,
+                                    pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Label", Logging::profile);
+    add(event, "Format", Logging::collapsed);
+    add(event, "Profile", stacks);
+    add(event, "Samples", samples);
+    add(event, "TID", (long)tid);
+
+    struct timeval tv;
+    struct timezone *tz = NULL;
+    gettimeofday(&tv, tz);
+    add(event, "Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
+
+    return Logging::log_profile_event(event);
+}
+
+// the frame info for the ids used in the events, sent once per frame and run
+bool Logging::log_profile_frame_dict(Metadata &md,
+                                     string &prof_op_id,
+                                     long *frame_ids,
+                                     std::vector<FrameData> const &frames,
+                                     pid_t tid) {
+
+    Event *event = Logging::createEvent(md, prof_op_id);
+    add(event, "Label", Logging::dictionary);
+    add(event, "FrameIds", frame_ids, (int)frames.size());
+    add(event, "Frames", frames);
+    add(event, "TID", (long)tid);
+
+    struct timeval tv;
+    struct timezone *tz = NULL;
+    gettimeofday(&tv, tz);
+    add(event, "Timestamp_u", (long)tv.tv_sec * 1000000 + (long)tv.tv_usec);
 
     return Logging::log_profile_event(event);
 }
 
 bool Logging::log_profile_event(Event *event) {
-        event->addInfo((char *)"Spec", Logging::profiling);
+        add(event, "Spec", Logging::profiling);
         event->addHostname();
-        event->addInfo((char *)"PID", (long)AO_GETPID());
-        event->addInfo((char *)"X-Trace", event->metadataString());
+        add(event, "PID", (long)AO_GETPID());
+        add(event, "X-Trace", event->metadataString());
         event->sendProfiling();
+        if (ring_file.is_open()) ring_file.append(record.data(), record.size());
 
         // see comment in oboe_api.cpp:
         // "event needs to be deleted, it is managed by swig %newobject"
         // !!! It needs to be deleted, I tested it !!!
         delete event;
+        if (timing) timing->add(monotonic_ns() - event_start);
         return true;
 }
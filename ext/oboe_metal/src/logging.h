@@ -4,7 +4,13 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include "alloc_profile.h"
+#include "gvl_tracker.h"
 #include "oboe_api.h"
+#include "pprof.h"
+#include "profiler_stats.h"
+#include "ring_file.h"
+#include "snapshot_batch.h"
 
 using namespace std;
 
@@ -12,19 +18,73 @@ using namespace std;
 
 class Logging {
    public:
-    static const string profiling, ruby, entry, info, exit;
-    static bool log_profile_entry(Metadata &md, string &prof_op_id, pid_t tid, long interval);
-    static bool log_profile_exit(Metadata &md, string &prof_op_id, pid_t tid,
-                                 long *omitted, int num_omitted);
+    static const string profiling, ruby, entry, info, exit, missed, gc, alloc, gvl, dictionary, batch, profile, pprof, collapsed, wall, cpu;
+    static bool log_profile_entry(Metadata &md, string &prof_op_id, pid_t tid, long interval,
+                                  const string &mode);
+    static bool log_profile_exit(Metadata &md, string &prof_op_id, pid_t tid, long interval,
+                                 long *omitted, int num_omitted, const RunStats *stats = NULL);
     static bool log_profile_snapshot(Metadata &md,
                                      string &prof_op_id,
                                      long timestamp,
-                                     std::vector<FrameData> const &new_frames,
+                                     long *new_frame_ids,
+                                     int num_new,
                                      long exited_frames,
                                      long total_frames,
                                      long *omitted,
                                      int num_omitted,
-                                     pid_t tid);
+                                     pid_t tid,
+                                     long *new_frame_lines = NULL,
+                                     std::vector<FrameData> const *new_frames = NULL);
+    static bool log_profile_missed(Metadata &md,
+                                   string &prof_op_id,
+                                   long *timestamps,
+                                   int num_timestamps,
+                                   long num_missed,
+                                   long blocked_us,
+                                   long total_frames,
+                                   pid_t tid);
+    static bool log_profile_gc(Metadata &md,
+                               string &prof_op_id,
+                               vector<long> const &timestamps,
+                               vector<long> const &mark_ns,
+                               vector<long> const &sweep_ns,
+                               vector<long> const &flags,
+                               vector<long> const &frame_ids,
+                               pid_t tid);
+    static bool log_profile_alloc(Metadata &md,
+                                  string &prof_op_id,
+                                  const AllocProfile &allocs,
+                                  long interval,
+                                  pid_t tid);
+    static bool log_profile_gvl(Metadata &md,
+                                string &prof_op_id,
+                                const GvlBatch &gvl,
+                                pid_t tid);
+    static bool log_profile_batch(Metadata &md,
+                                  string &prof_op_id,
+                                  SnapshotBatch &batch,
+                                  pid_t tid);
+    static bool log_profile_pprof(Metadata &md,
+                                  string &prof_op_id,
+                                  const string &profile,
+                                  pid_t tid);
+    static bool log_profile_collapsed(Metadata &md,
+                                      string &prof_op_id,
+                                      const string &stacks,
+                                      long samples,
+                                      pid_t tid);
+    static bool log_profile_frame_dict(Metadata &md,
+                                       string &prof_op_id,
+                                       long *frame_ids,
+                                       std::vector<FrameData> const &frames,
+                                       pid_t tid);
+
+    static RingFile ring_file;
+    // where the time spent building and sending events goes, set by the
+    // encoder to the stats of the thread it works on, NULL for nowhere
+    static StatHistogram *timing;
+    static bool open_ring_file(const string &dir, size_t size);
+    static void reopen_ring_file();
 
    private:
     static Event *createEvent(Metadata &md, string &prof_op_id, bool entry_event = false);
@@ -0,0 +1,217 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef NATIVE_STACK_H
+#define NATIVE_STACK_H
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <ruby/ruby.h>
+
+#include "oboe_api.h"
+
+// Native stacks, the C frames below a <cfunc> frame, e.g. the functions of
+// a C extension like pg or nokogiri that rb_profile_frames() can't see.
+//
+// The signal handler walks the frame pointer chain of the interrupted
+// context. That is async-signal-safe, it only reads the registers and the
+// stack of the thread, no unwind tables and no locks, and needs no special
+// privileges. Frames of code compiled without frame pointers are skipped:
+// the walk continues at the next frame that has one, or ends early.
+//
+// The addresses are symbolized later by the encoder thread with dladdr(),
+// which only knows the exported symbols, static functions show up as the
+// nearest exported one before them.
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define NATIVE_STACK_SUPPORTED 1
+#include <link.h>
+#include <ucontext.h>
+#include <unistd.h>
+#else
+#define NATIVE_STACK_SUPPORTED 0
+#endif
+
+#define NATIVE_MAX_FRAMES 64
+
+// the stack of the calling thread, for the walk to stay within,
+// not async-signal-safe, call it once per thread beforehand
+static inline bool native_stack_bounds(uintptr_t &lo, uintptr_t &hi) {
+#if NATIVE_STACK_SUPPORTED
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return false;
+    bool ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) return false;
+    lo = (uintptr_t)addr;
+    hi = lo + size;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Follows the chain of frame records [previous fp][return address] from
+// pc and fp, innermost first. A record must lie within [lo, hi) and each
+// one further out than the one before, anything else ends the walk.
+// Return addresses are stored minus 1, inside the call instruction.
+static inline int native_walk_from(uintptr_t pc, uintptr_t fp, uintptr_t lo, uintptr_t hi,
+                                   uintptr_t *pcs, int max) {
+    int num = 0;
+    if (pc == 0 || max <= 0) return 0;
+    pcs[num++] = pc;
+
+    while (num < max) {
+        if (fp < lo || fp > hi - 2 * sizeof(uintptr_t) || (fp & (sizeof(uintptr_t) - 1))) break;
+        const uintptr_t *record = (const uintptr_t *)fp;
+        uintptr_t next = record[0];
+        uintptr_t ret = record[1];
+        if (ret == 0) break;
+        pcs[num++] = ret - 1;
+        if (next <= fp) break;
+        fp = next;
+    }
+    return num;
+}
+
+// the native stack at the point the signal interrupted the thread,
+// async-signal-safe, 0 frames on other platforms
+// Only the part of the stack above the stack pointer is read, below it
+// the pages of the main thread's stack may not be mapped yet. On another
+// stack, e.g. of a fiber, there is only the pc.
+static inline int native_walk(const void *ucontext, uintptr_t lo, uintptr_t hi, uintptr_t *pcs, int max) {
+#if NATIVE_STACK_SUPPORTED
+    const mcontext_t &mc = ((const ucontext_t *)ucontext)->uc_mcontext;
+#if defined(__x86_64__)
+    uintptr_t pc = mc.gregs[REG_RIP], sp = mc.gregs[REG_RSP], fp = mc.gregs[REG_RBP];
+#else
+    uintptr_t pc = mc.pc, sp = mc.sp, fp = mc.regs[29];
+#endif
+    if (sp < lo || sp >= hi) return native_walk_from(pc, 0, 1, 0, pcs, max);
+    return native_walk_from(pc, fp, sp, hi, pcs, max);
+#else
+    return 0;
+#endif
+}
+
+// Address to symbol cache of the encoder thread
+//
+// Every symbol gets a key for the frame cache, the address of the symbol
+// tagged like a Fixnum, so it can't be mistaken for a Ruby frame and GC
+// marking ignores it. Addresses without a symbol share one key per library,
+// addresses outside of any library (e.g. JIT code) share UNKNOWN_KEY.
+// Frames in the Ruby VM itself (libruby or the ruby executable) are
+// flagged, the part of a native stack worth showing ends before them, the
+// unknown ones count as VM frames. dladdr() names the main program by the
+// path it was started with, which may be relative, its frames get the path
+// of /proc/self/exe instead.
+class NativeSymbols {
+   public:
+    struct Symbol {
+        VALUE key;
+        bool vm;
+        FrameData data;  // method is the symbol, file the library
+    };
+
+    // vm_addr is any address in the Ruby VM
+    explicit NativeSymbols(const void *vm_addr) {
+        Dl_info info;
+        vm_base = dladdr(vm_addr, &info) ? info.dli_fbase : NULL;
+        exe_base = main_program_base();
+#if NATIVE_STACK_SUPPORTED
+        char path[4096];
+        ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (len > 0) exe_file.assign(path, len);
+#endif
+    }
+
+    const Symbol &lookup(uintptr_t pc) {
+        auto it = by_pc.find(pc);
+        if (it != by_pc.end()) return symbols[it->second];
+
+        // the symbols stay, the addresses start over when there are too many
+        if (by_pc.size() >= MAX_ADDRESSES) by_pc.clear();
+        size_t index = symbol_index(pc);
+        by_pc.emplace(pc, index);
+        return symbols[index];
+    }
+
+    size_t size() const { return symbols.size(); }
+
+    static const VALUE UNKNOWN_KEY = ~(VALUE)0;
+
+   private:
+    static const size_t MAX_ADDRESSES = 64 * 1024;
+
+    size_t symbol_index(uintptr_t pc) {
+        Dl_info info;
+        bool found = dladdr((void *)pc, &info) != 0;
+        uintptr_t addr = 0;
+        if (found && info.dli_saddr)
+            addr = (uintptr_t)info.dli_saddr;
+        else if (found)
+            addr = (uintptr_t)info.dli_fbase;
+
+        auto it = by_symbol.find(addr);
+        if (it != by_symbol.end()) return it->second;
+
+        Symbol symbol;
+        symbol.key = found ? (VALUE)(addr | 1) : UNKNOWN_KEY;
+        symbol.vm = !found || (vm_base && info.dli_fbase == vm_base);
+        if (found && exe_base && info.dli_fbase == exe_base && !exe_file.empty())
+            symbol.data.file = exe_file;
+        else if (found && info.dli_fname)
+            symbol.data.file = info.dli_fname;
+        if (found && info.dli_sname) {
+            symbol.data.method = info.dli_sname;
+        } else if (!symbol.data.file.empty()) {
+            const std::string &file = symbol.data.file;
+            symbol.data.method = "[" + file.substr(file.rfind('/') + 1) + "]";
+        } else {
+            symbol.data.method = "[unknown]";
+        }
+
+        symbols.push_back(symbol);
+        by_symbol.emplace(addr, symbols.size() - 1);
+        return symbols.size() - 1;
+    }
+
+    // where dladdr() has the main program start, its first loaded page,
+    // the first object dl_iterate_phdr() reports is the main program
+    static const void *main_program_base() {
+#if NATIVE_STACK_SUPPORTED
+        const void *base = NULL;
+        dl_iterate_phdr(
+            [](struct dl_phdr_info *info, size_t, void *arg) -> int {
+                uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+                for (int i = 0; i < info->dlpi_phnum; i++) {
+                    if (info->dlpi_phdr[i].p_type != PT_LOAD) continue;
+                    uintptr_t start = info->dlpi_addr + (info->dlpi_phdr[i].p_vaddr & ~(page - 1));
+                    *(const void **)arg = (const void *)start;
+                    break;
+                }
+                return 1;
+            },
+            &base);
+        return base;
+#else
+        return NULL;
+#endif
+    }
+
+    const void *vm_base;
+    const void *exe_base;
+    std::string exe_file;  // of the main program, empty if unknown
+    std::vector<Symbol> symbols;
+    std::unordered_map<uintptr_t, size_t> by_symbol;
+    std::unordered_map<uintptr_t, size_t> by_pc;
+};
+
+#endif  // NATIVE_STACK_H
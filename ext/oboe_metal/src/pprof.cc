@@ -0,0 +1,215 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#include "pprof.h"
+
+using namespace std;
+
+// protobuf wire format, only what profile.proto needs
+// https://protobuf.dev/programming-guides/encoding/
+#define WIRE_VARINT 0
+#define WIRE_LEN 2
+
+// field numbers of profile.proto
+#define PROFILE_SAMPLE_TYPE 1
+#define PROFILE_SAMPLE 2
+#define PROFILE_LOCATION 4
+#define PROFILE_FUNCTION 5
+#define PROFILE_STRING_TABLE 6
+#define PROFILE_TIME_NANOS 9
+#define PROFILE_DURATION_NANOS 10
+#define PROFILE_PERIOD_TYPE 11
+#define PROFILE_PERIOD 12
+#define VALUE_TYPE_TYPE 1
+#define VALUE_TYPE_UNIT 2
+#define SAMPLE_LOCATION_ID 1
+#define SAMPLE_VALUE 2
+#define SAMPLE_LABEL 3
+#define LABEL_KEY 1
+#define LABEL_NUM 3
+#define LOCATION_ID 1
+#define LOCATION_LINE 4
+#define LINE_FUNCTION_ID 1
+#define LINE_LINE 2
+#define FUNCTION_ID 1
+#define FUNCTION_NAME 2
+#define FUNCTION_SYSTEM_NAME 3
+#define FUNCTION_FILENAME 4
+#define FUNCTION_START_LINE 5
+
+static void put_varint(string &out, uint64_t val) {
+    while (val >= 0x80) {
+        out.push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+    out.push_back((char)val);
+}
+
+static void put_key(string &out, int field, int wire_type) {
+    put_varint(out, ((uint64_t)field << 3) | wire_type);
+}
+
+// int64 and uint64 fields, 0 is the default and is left out
+static void put_int(string &out, int field, uint64_t val) {
+    if (val == 0) return;
+    put_key(out, field, WIRE_VARINT);
+    put_varint(out, val);
+}
+
+static void put_bytes(string &out, int field, const string &bytes) {
+    put_key(out, field, WIRE_LEN);
+    put_varint(out, bytes.size());
+    out.append(bytes);
+}
+
+// repeated scalars are packed into one length delimited field
+static void put_packed(string &out, int field, const uint64_t *vals, int num) {
+    if (num == 0) return;
+    string packed;
+    for (int i = 0; i < num; i++) put_varint(packed, vals[i]);
+    put_bytes(out, field, packed);
+}
+
+static string value_type(int64_t type, int64_t unit) {
+    string msg;
+    put_int(msg, VALUE_TYPE_TYPE, type);
+    put_int(msg, VALUE_TYPE_UNIT, unit);
+    return msg;
+}
+
+void PprofProfile::clear() {
+    strings.clear();
+    string_index.clear();
+    functions.clear();
+    function_ids.clear();
+    locations.clear();
+    location_ids.clear();
+    samples.clear();
+    sample_locations.clear();
+    start_ts = last_ts = 0;
+    period_ns = interval_ns = 0;
+
+    intern("");  // string_table[0] must be ""
+    intern("samples");
+    intern("count");
+    intern("nanoseconds");
+    type = 0;
+    label_key = intern("delta_us");
+}
+
+void PprofProfile::start(long ts, long interval_ms, const string &sample_type) {
+    clear();
+    start_ts = last_ts = ts;
+    period_ns = interval_ns = interval_ms * 1000000;
+    type = intern(sample_type);
+}
+
+int64_t PprofProfile::intern(const string &str) {
+    auto it = string_index.find(str);
+    if (it != string_index.end()) return it->second;
+
+    int64_t index = (int64_t)strings.size();
+    strings.push_back(str);
+    string_index.emplace(str, index);
+    return index;
+}
+
+void PprofProfile::add_location(long frame_id, const FrameData &frame, int line) {
+    string name = frame.klass.empty() ? frame.method : frame.klass + "#" + frame.method;
+
+    // frames of the same method differ by their line, they share the function
+    string key = frame.file;
+    key.push_back('\0');
+    key.append(name);
+    uint64_t function_id;
+    auto it = function_ids.find(key);
+    if (it != function_ids.end()) {
+        function_id = it->second;
+    } else {
+        functions.push_back({intern(name), intern(frame.file), frame.lineno});
+        function_id = functions.size();
+        function_ids.emplace(key, function_id);
+    }
+
+    locations.push_back({function_id, line > 0 ? line : frame.lineno});
+    location_ids.emplace(frame_id, locations.size());
+}
+
+void PprofProfile::add_sample(const long *frame_ids, int num, long ts) {
+    if (!samples.empty()) {
+        Sample &last = samples.back();
+        if (last.num == num) {
+            int i = 0;
+            while (i < num && sample_locations[last.offset + i] == location_ids[frame_ids[i]]) i++;
+            if (i == num) {
+                last.count++;
+                last.ns += interval_ns;
+                return;
+            }
+        }
+    }
+
+    samples.push_back({sample_locations.size(), num, 1, interval_ns, ts - last_ts});
+    last_ts = ts;
+    for (int i = 0; i < num; i++) sample_locations.push_back(location_ids[frame_ids[i]]);
+}
+
+void PprofProfile::add_repeat(long ts) {
+    if (samples.empty()) {
+        add_sample(NULL, 0, ts);
+        return;
+    }
+    samples.back().count++;
+    samples.back().ns += interval_ns;
+}
+
+void PprofProfile::encode(string &out, long end_ts) const {
+    out.clear();
+
+    // samples/count and wall/nanoseconds or cpu/nanoseconds
+    int64_t samples_type = string_index.at("samples");
+    int64_t count_unit = string_index.at("count");
+    int64_t ns_unit = string_index.at("nanoseconds");
+    put_bytes(out, PROFILE_SAMPLE_TYPE, value_type(samples_type, count_unit));
+    put_bytes(out, PROFILE_SAMPLE_TYPE, value_type(type, ns_unit));
+
+    string msg, sub;
+    for (const Sample &sample : samples) {
+        msg.clear();
+        put_packed(msg, SAMPLE_LOCATION_ID, &sample_locations[sample.offset], sample.num);
+        uint64_t values[2] = {(uint64_t)sample.count, (uint64_t)sample.ns};
+        put_packed(msg, SAMPLE_VALUE, values, 2);
+        sub.clear();
+        put_int(sub, LABEL_KEY, label_key);
+        put_int(sub, LABEL_NUM, (uint64_t)sample.delta_us);
+        put_bytes(msg, SAMPLE_LABEL, sub);
+        put_bytes(out, PROFILE_SAMPLE, msg);
+    }
+
+    for (size_t i = 0; i < locations.size(); i++) {
+        msg.clear();
+        put_int(msg, LOCATION_ID, i + 1);
+        sub.clear();
+        put_int(sub, LINE_FUNCTION_ID, locations[i].function_id);
+        put_int(sub, LINE_LINE, (uint64_t)locations[i].line);
+        put_bytes(msg, LOCATION_LINE, sub);
+        put_bytes(out, PROFILE_LOCATION, msg);
+    }
+
+    for (size_t i = 0; i < functions.size(); i++) {
+        msg.clear();
+        put_int(msg, FUNCTION_ID, i + 1);
+        put_int(msg, FUNCTION_NAME, functions[i].name);
+        put_int(msg, FUNCTION_SYSTEM_NAME, functions[i].name);
+        put_int(msg, FUNCTION_FILENAME, functions[i].file);
+        put_int(msg, FUNCTION_START_LINE, (uint64_t)functions[i].start_line);
+        put_bytes(out, PROFILE_FUNCTION, msg);
+    }
+
+    for (const string &str : strings) put_bytes(out, PROFILE_STRING_TABLE, str);
+
+    put_int(out, PROFILE_TIME_NANOS, (uint64_t)start_ts * 1000);
+    put_int(out, PROFILE_DURATION_NANOS, (uint64_t)(end_ts - start_ts) * 1000);
+    put_bytes(out, PROFILE_PERIOD_TYPE, value_type(type, ns_unit));
+    put_int(out, PROFILE_PERIOD, (uint64_t)period_ns);
+}
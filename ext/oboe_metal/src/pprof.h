@@ -0,0 +1,95 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef PPROF_H
+#define PPROF_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "oboe_api.h"
+
+using namespace std;
+
+// Profile of one run in the pprof format (profile.proto of
+// github.com/google/pprof), written without the protobuf library
+//
+// The samples are the stacks of the snapshots, leaf first, as frame ids of
+// the frame cache. Every frame id becomes a location with one line and a
+// function, the names go into the string table once. Consecutive snapshots
+// with the same stack are merged into one sample with their count, like
+// the omitted snapshots of the events. The nanoseconds of a sample add up
+// the interval in effect for each of its snapshots, the adaptive interval
+// can change it during a run. Each sample has a numeric label
+// "delta_us", its start relative to the previous sample, or to time_nanos
+// for the first one.
+//
+// The encoder keeps one per thread and reuses it for every run.
+class PprofProfile {
+   public:
+    PprofProfile() { clear(); }
+
+    // type is the sample type of the second value, "wall" or "cpu"
+    void start(long ts, long interval_ms, const string &type);
+    // the interval of the snapshots added from now on
+    void set_interval(long interval_ms) { interval_ns = interval_ms * 1000000; }
+
+    // in line mode the id is a key of LineKeys and line the current line
+    // of the frame, otherwise the location is at the first line
+    bool has_location(long frame_id) const { return location_ids.count(frame_id) > 0; }
+    void add_location(long frame_id, const FrameData &frame, int line = 0);
+
+    // frame_ids must all have a location
+    void add_sample(const long *frame_ids, int num, long ts);
+    // a snapshot with the same stack as the previous one
+    void add_repeat(long ts);
+
+    size_t num_samples() const { return samples.size(); }
+
+    // the serialized profile.proto message, not gzipped
+    void encode(string &out, long end_ts) const;
+
+    void clear();
+
+   private:
+    struct Sample {
+        size_t offset;  // of the location ids in sample_locations
+        int num;
+        long count;
+        long ns;  // count times the intervals
+        long delta_us;
+    };
+
+    struct Function {
+        int64_t name;  // string table index
+        int64_t file;
+        int64_t start_line;
+    };
+
+    struct Location {
+        uint64_t function_id;
+        int64_t line;
+    };
+
+    int64_t intern(const string &str);
+
+    vector<string> strings;
+    unordered_map<string, int64_t> string_index;
+    vector<Function> functions;  // id is the index + 1
+    unordered_map<string, uint64_t> function_ids;  // by "file\0name"
+    vector<Location> locations;  // id is the index + 1
+    unordered_map<long, uint64_t> location_ids;    // by frame id
+
+    vector<Sample> samples;
+    vector<uint64_t> sample_locations;
+    long start_ts;    // microseconds
+    long last_ts;
+    long period_ns;    // of the start, the nominal one
+    long interval_ns;  // in effect now
+    int64_t type;     // string table indexes
+    int64_t label_key;
+};
+
+#endif  // PPROF_H
@@ -0,0 +1,112 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef PROFILER_STATS_H
+#define PROFILER_STATS_H
+
+#include <time.h>
+
+#include <atomic>
+
+// the clock of the durations, also async-signal-safe
+inline long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Counters and histograms of the work the profiler does itself
+//
+// Each one has a single writer, either the profiled thread or the encoder
+// thread, so an update is a relaxed load and store, no locked instruction.
+// Readers on other threads, CProfiler.stats, may see a value that is a
+// little behind.
+class StatCounter {
+   public:
+    void add(long n = 1) { val.store(val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    long get() const { return val.load(std::memory_order_relaxed); }
+    void set(long n) { val.store(n, std::memory_order_relaxed); }
+
+   private:
+    std::atomic<long> val{0};
+};
+
+// durations in nanoseconds, bucket i counts the ones below 2^i and at
+// least 2^(i-1), bucket 0 the ones of 0
+class StatHistogram {
+   public:
+    enum { BUCKETS = 40 };  // the last one takes everything from ~4.5 minutes
+
+    void add(long ns) {
+        if (ns < 0) ns = 0;
+        int i = ns == 0 ? 0 : 64 - __builtin_clzl((unsigned long)ns);
+        if (i >= BUCKETS) i = BUCKETS - 1;
+        buckets[i].add();
+        num.add();
+        total.add(ns);
+        if (ns > largest.get()) largest.set(ns);
+    }
+
+    long count() const { return num.get(); }
+    long sum() const { return total.get(); }
+    long max() const { return largest.get(); }
+    long bucket(int i) const { return buckets[i].get(); }
+
+    // upper bound of the bucket the q-quantile falls into, 0 if empty
+    long quantile(double q) const {
+        long n = count();
+        if (n == 0) return 0;
+        long rank = (long)(q * n);
+        long seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += bucket(i);
+            if (seen > rank) return i == 0 ? 0 : (1L << i) - 1;
+        }
+        return max();
+    }
+
+   private:
+    StatCounter buckets[BUCKETS];
+    StatCounter num;
+    StatCounter total;
+    StatCounter largest;
+};
+
+// what a run added to the stats of its thread, for the exit event
+struct RunStats {
+    long samples;
+    long samples_dropped;
+    long cache_misses;
+    long snapshots;
+    long omitted;
+    long remove_garbage_ns;
+    long logging_ns;
+};
+
+// per profiled thread, see prof_data
+struct ThreadStats {
+    // written by the thread in the postponed job
+    StatCounter samples;          // pushed into the sample ring
+    StatCounter samples_dropped;  // the ring was full
+    StatCounter samples_missed;   // ticks without a job while the thread held the GVL
+    StatCounter control_dropped;  // ENTRY or EXIT records that didn't fit in the ring
+    StatCounter cache_misses;     // frames the thread added to the frame cache
+    StatHistogram gc_pauses;      // GC steps that ran in the thread while profiled
+    StatCounter alloc_samples;    // sampled allocations, some share a stack
+    // written by the thread in the thread event hook
+    StatHistogram gvl_waits;      // from READY to RESUMED, also the short ones
+    StatCounter gvl_dropped;      // GVL intervals lost, the ring was full
+
+    // written by the encoder
+    StatCounter snapshots;  // processed, including OTHER THREADS
+    StatCounter omitted;    // same stack as the previous snapshot
+    StatHistogram remove_garbage;
+    StatHistogram logging;  // building and sending the events of the thread
+
+    RunStats totals() const {
+        return {samples.get(), samples_dropped.get(), cache_misses.get(), snapshots.get(),
+                omitted.get(), remove_garbage.sum(), logging.sum()};
+    }
+};
+
+#endif  // PROFILER_STATS_H
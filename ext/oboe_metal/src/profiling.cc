@@ -7,7 +7,11 @@
 #include <signal.h>
 #include <time.h>
 
+#include <pthread.h>
+#include <string.h>
+
 #include <atomic>
+#include <iostream>
 #include <unordered_map>
 #include <vector>
 
@@ -17,46 +21,254 @@
 
 
 #define TIMER_SIG SIGRTMAX        // the timer notification signal
+#define ENCODER_PAUSE_NS 2000000  // how long the encoder sleeps when there is nothing to do
+
+// older glibc headers don't name the field for SIGEV_THREAD_ID
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 using namespace std;
 
-static atomic_bool running;
+static atomic_int running_threads;  // number of threads inside CProfiler.run in wall clock mode
 atomic_bool profiling_shut_down;  // !! can't be static because of tests
 
 // need to initialize here, hangs if it is done inside the signal handler
 // these are reused for every snapshot
-static VALUE frames_buffer[BUF_SIZE];
+// in line mode a sample is the frames followed by their lines
+static VALUE frames_buffer[2 * BUF_SIZE];
 static int lines_buffer[BUF_SIZE];
+// only used by the encoder thread
+static VALUE drain_buffer[2 * BUF_SIZE];
+static int drain_lines[BUF_SIZE];
+static vector<long> new_frames;   // reused, no allocation per snapshot
+static vector<long> new_lines;    // the lines of the new frames in line mode
+static vector<FrameData> new_frame_data;  // the new frames themselves without frame ids
+static vector<FrameData> profile_frames;
+static string profile_buffer;
+static vector<long> dict_ids;  // the dictionary entries taken from the cache, not sent yet
+static vector<FrameData> dict_frames;
 
 
 static long configured_interval = 10;  // in milliseconds, initializing in case Ruby forgets to
 static long current_interval = 10;
+static long min_interval = 10;         // from oboe, the interval never goes below
+static int configured_mode = PROF_MODE_WALL;  // used by runs starting from now on
+static bool configured_lines = false;          // likewise, see CProfiler.set_lines
+static atomic_bool configured_native{false};   // likewise, see CProfiler.set_native
 timer_t timerid;
 
-typedef struct prof_data {
-    bool running_p = false;
-    Metadata md = Metadata(Context::get());
-    string prof_op_id;
-
-    VALUE prev_frames_buffer[BUF_SIZE];
-    int prev_num = 0;
-    long omitted[BUF_SIZE];
-    int omitted_num = 0;
-} prof_data_t;
+// the data of the postponed job tells which timer fired
+#define CPU_TICK ((void *)0)
+#define WALL_TICK ((void *)1)
+
+// In wall clock mode the job also samples up to this many of the other
+// profiled threads per tick, 0 leaves them to the OTHER THREADS catch-up.
+// Changed and read under the GVL, like the counters.
+static long threads_per_tick = 0;
+#ifdef HAVE_RB_PROFILE_THREAD_FRAMES
+static int other_threads_cursor = 0;  // round robin start
+#endif
+static long wall_ticks = 0;
+static long other_threads_sampled = 0;
+static long other_threads_ns = 0;     // time spent sampling them
+
+// Adaptive interval
+// With an overhead budget the job handlers measure their own time and
+// retune the interval at most every ADAPT_WINDOW_NS, so that the time spent
+// in them stays within the budget, as a share of the wall time of one core.
+// Only used under the GVL.
+#define ADAPT_WINDOW_NS 200000000L
+#define ADAPT_MAX_INTERVAL 100        // ms, same as the maximum of the config
+#define ADAPT_MIN_BUDGET_PPM 4        // below, 3/4 of the budget rounds down to 0
+static long overhead_budget_ppm = 0;  // 0 keeps the interval fixed
+static long adapt_window_start = 0;   // monotonic ns
+static long adapt_window_ns = 0;      // time in the job handlers in the window
+static long overhead_ppm = 0;         // measured in the last window
+static long job_ns = 0;               // total time in the job handlers
+
+// Batch mode
+// With a batch size the encoder sends the snapshots of a thread as one
+// event per batch_size snapshots or batch_us microseconds, 0 sends one
+// event per snapshot. batch_us is also how often the call tree of the
+// collapsed format is sent. Set from Ruby, picked up by the encoder on ENTRY.
+static atomic_long batch_size{0};
+static atomic_long batch_us{1000000};
+
+static atomic_int configured_format{PROF_FORMAT_EVENTS};  // picked up on ENTRY
+static atomic_bool configured_frame_ids{false};           // likewise, see CProfiler.set_frame_ids
+
+// Self-overhead, see CProfiler.stats, the per-thread part is in prof_data
+// The signal handler can run in several threads at once, its counters are
+// incremented atomically. The job handlers run under the GVL.
+static atomic_long ticks_received{0};
+static atomic_long ticks_dropped_signal{0};  // the signal handler was busy
+static atomic_long ticks_dropped_job{0};     // the job handler was busy
+static atomic_long ticks_missed{0};          // no job ran for them, see the signal log
+static atomic_long pending_signal_ns{0};     // oldest signal not handled by a job yet
+static StatHistogram job_latency;            // from the signal to the job handler
+static StatHistogram job_time;
+static atomic_bool exit_stats{false};        // add the stats of the run to the exit event
+
+// the metadata of a run travels with its entry record to the encoder thread
+// payload of an ENTRY record: [interval][tid][mode][run][lines][oboe_metadata_t ...]
+#define ENTRY_MD_OFFSET 5
+#define ENTRY_NUM (ENTRY_MD_OFFSET + (int)((sizeof(oboe_metadata_t) + sizeof(VALUE) - 1) / sizeof(VALUE)))
+// an ENTRY and an EXIT with their headers, each may need padding in front of it
+static_assert(2 * ((ENTRY_NUM + 3) + (4 + 3)) <= (int)SampleRing::CONTROL_RESERVE,
+              "the ring reserve must fit the control records");
+
+// Postponed jobs
+// Ruby 3.3 deprecates rb_postponed_job_register(_one), the jobs are
+// preregistered once in Init_profiling and triggered by their handle.
+// A handle always runs its function with the data it was registered with,
+// so CPU and wall clock ticks get a function each.
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t cpu_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static rb_postponed_job_handle_t wall_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static rb_postponed_job_handle_t cpu_gc_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static rb_postponed_job_handle_t wall_gc_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static rb_postponed_job_handle_t hooks_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static rb_postponed_job_handle_t gc_stack_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static rb_postponed_job_handle_t alloc_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+
+static void cpu_job(void *arg) { Profiling::profiler_job_handler(CPU_TICK); }
+static void wall_job(void *arg) { Profiling::profiler_job_handler(WALL_TICK); }
+static void cpu_gc_job(void *arg) { Profiling::profiler_gc_handler(CPU_TICK); }
+static void wall_gc_job(void *arg) { Profiling::profiler_gc_handler(WALL_TICK); }
+
+// false if the job table of Ruby is full
+static bool preregister_jobs() {
+    cpu_job_handle = rb_postponed_job_preregister(0, cpu_job, NULL);
+    wall_job_handle = rb_postponed_job_preregister(0, wall_job, NULL);
+    cpu_gc_job_handle = rb_postponed_job_preregister(0, cpu_gc_job, NULL);
+    wall_gc_job_handle = rb_postponed_job_preregister(0, wall_gc_job, NULL);
+    hooks_job_handle = rb_postponed_job_preregister(0, Profiling::hooks_job, NULL);
+    gc_stack_job_handle = rb_postponed_job_preregister(0, Profiling::gc_stack_job, NULL);
+    alloc_job_handle = rb_postponed_job_preregister(0, Profiling::alloc_job, NULL);
+
+    // once the table is full it stays full, the last one tells for all
+    return alloc_job_handle != POSTPONED_JOB_HANDLE_INVALID;
+}
+#endif
+
+// Registry of per-thread profiling data
+// A thread gets its slot on the first call to CProfiler.run and keeps it
+// until it exits, then the slot is up for grabs by a new thread.
+// Slots are never freed, so the pointers stay valid for readers.
+//
+// Fibers: the diffs of the snapshots only make sense for one stack. Under
+// a fiber scheduler (e.g. async/Falcon) one thread runs the requests of
+// many fibers interleaved, so a run in a fiber other than the one of the
+// thread's running slot gets a slot of its own, for the time of the run.
+// Each slot keeps its own previous snapshot in the encoder, switching
+// fibers only switches the slot the thread's samples go to, see
+// fiber_switch_hook(). Fibers without a run of their own don't get
+// samples, the suspended ones get OTHER THREADS like idle threads.
+static prof_data_t *prof_threads[MAX_PROF_THREADS];
+static atomic_int prof_threads_num;
+static pthread_key_t prof_data_key;     // the slot of the thread
+static pthread_key_t prof_current_key;  // the slot of the running fiber, if it is profiled
+static atomic_int running_slots{0};     // slots in CProfiler.run, until their exit record is out
+static VALUE fiber_tracepoint = Qnil;   // on while there are slots running
+static atomic_bool hooks_stale{false};  // runs ended without the GVL, see prof_data_release()
+
+// in the hooks, a stale hook fires at most once more
+static inline void queue_hooks_job() {
+    if (hooks_stale.load(memory_order_relaxed) && hooks_stale.exchange(false))
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+        rb_postponed_job_trigger(hooks_job_handle);
+#else
+        rb_postponed_job_register_one(0, Profiling::hooks_job, NULL);
+#endif
+}
 
-unordered_map<pid_t, prof_data_t> prof_data_map;
+// Timestamps of all ticks
+// Only the thread that runs the postponed job gets a real snapshot. Instead
+// of visiting every other profiled thread on each tick, the other threads
+// catch up from this log when their samples are drained and record
+// "OTHER THREADS" snapshots for the ticks they missed.
+static atomic_long tick_log[TICK_LOG_SIZE];
+static atomic_ulong tick_seq;
+
+// Signal log
+// The signal handler logs the time of each wall clock tick it passes on to
+// a job. While a thread holds the GVL in C code or GC the job has to wait,
+// the postponed job coalesces the jobs of the following ticks
+// (Ruby 3.3+) or queues them up to run back to back. Either way the
+// thread gets one sample for many ticks. The job handlers compare the log
+// with the ticks they got and report the difference as missed samples.
+static atomic_long signal_log[TICK_LOG_SIZE];
+static atomic_ulong signal_seq;        // written by one signal handler at a time
+static unsigned long signal_cursor;    // first tick no job has seen yet, under the GVL
+static VALUE missed_buffer[BUF_SIZE];  // [ticks][blocked us][timestamps ...], under the GVL
+
+// GC events
+// A tracepoint on the internal GC events measures each GC step in the
+// thread that ran it, see GcPhases. The hook runs inside the GC and must
+// not allocate, the stack that allocated is taken by gc_stack_job() after.
+// The tracepoint is on while slots are running and set_gc_events allows it.
+static VALUE gc_tracepoint = Qnil;
+static bool gc_events = true;  // under the GVL
+static VALUE sym_major_by = Qnil, sym_state = Qnil, sym_marking = Qnil, sym_sweeping = Qnil;
+static GcPhases gc_phases;  // under the GVL
+// [number of pauses][ts, mark ns, sweep ns, flags per pause][frames ...]
+static VALUE gc_buffer[BUF_SIZE];
+// only used by the encoder thread
+static vector<long> gc_timestamps, gc_mark_ns, gc_sweep_ns, gc_flags, gc_frame_ids;
+
+// Allocation samples
+// A tracepoint on NEWOBJ picks allocations with AllocSampler and takes the
+// stack of the picked ones, alloc_job() measures the object once it is set
+// up and caches the frames. FREEOBJ forgets objects freed before that.
+// NEWOBJ is a hot path, the tracepoint is only on while threads are
+// profiled with an allocation interval. Used under the GVL.
+#define ALLOC_BUDGET_PPM 10000               // 1% of one core for the samples, above the interval goes up
+#define ALLOC_MIN_BYTES (5 * sizeof(VALUE))  // the smallest heap slot
+static VALUE alloc_tracepoint = Qnil;
+static AllocSampler alloc_sampler;
+static long alloc_interval = 0;       // allocations per sample on average, 0 is off
+static atomic_int alloc_pending{0};   // threads with a sample waiting for alloc_job()
+static bool in_profiler_job = false;  // the profiler's own allocations are not sampled
+static VALUE alloc_buffer[BUF_SIZE];  // [weight][bytes][frames ...]
+static vector<long> alloc_ids;        // only used by the encoder thread
+
+// exported for ObjectSpace.memsize_of, but not declared in the Ruby headers
+extern "C" size_t rb_obj_memsize_of(VALUE obj);
+
+// GVL waits and off-CPU time (Ruby 3.2+)
+// The thread event hook follows READY, RESUMED and SUSPENDED of the
+// profiled threads with their GvlTracker and pushes the intervals into
+// their GvlRing. The encoder sends them as gvl events and uses them for
+// the ticks a thread catches up on instead of OTHER THREADS. The hook is
+// added while slots are running and set_gvl_events allows it.
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+static bool gvl_events = true;  // under the GVL
+static rb_internal_thread_event_hook_t *gvl_hook = NULL;  // under the GVL
+#endif
+
+// The encoder thread drains the sample rings of all threads and does the
+// diffing, frame lookups and logging, so that the postponed job only has
+// to copy the frames. It is started on first use, also in forked children.
+static atomic_bool encoder_started;
+static atomic_bool encoder_done{false};  // stopped draining the rings after a shutdown
+static pthread_t encoder_thread;
 
 const string Profiling::string_job_handler = "Profiling::profiler_job_handler()";
 const string Profiling::string_gc_handler = "Profiling::profiler_gc_handler()";
 const string Profiling::string_signal_handler = "Profiling::profiler_signal_handler()";
 const string Profiling::string_stop = "Profiling::profiling_stop()";
+const string Profiling::string_encoder = "Profiling::encoder_loop()";
+const string Profiling::string_gc_stack_job = "Profiling::gc_stack_job()";
+const string Profiling::string_alloc_job = "Profiling::alloc_job()";
 
 // for debugging only
-void print_prof_data_map() {
-    pid_t tid = AO_GETTID;
-    Metadata md_str(prof_data_map[tid].md);
-    cout << tid << ", " << prof_data_map[tid].running_p << ", " << prof_data_map[tid].prof_op_id << ", ";
-    cout << md_str.toString() << ", " << prof_data_map[tid].prev_num << ", " << prof_data_map[tid].omitted_num << endl;
+void print_prof_data() {
+    prof_data_t *data = (prof_data_t *)pthread_getspecific(prof_current_key);
+    if (!data) return;
+    Metadata md_str(data->md);
+    cout << data->run_tid << ", " << data->running_p << ", " << data->prof_op_id << ", ";
+    cout << md_str.toString() << ", " << data->prev_num << ", " << data->omitted_num << endl;
 }
 
 long ts_now() {
@@ -85,120 +297,941 @@ int Profiling::try_catch_shutdown(std::function<int()> f, const string& fun_name
     }
 }
 
-void Profiling::profiler_record_frames() {
+// returns the profiling data of the running fiber, nullptr if it has none
+// with create == true a slot is assigned to it if it has none yet, the
+// slot of the thread if that is free, one of its own otherwise
+prof_data_t *Profiling::get_prof_data(bool create) {
+    prof_data_t *data = (prof_data_t *)pthread_getspecific(prof_current_key);
+    if (data || !create) return data;
+
+    prof_data_t *home = (prof_data_t *)pthread_getspecific(prof_data_key);
+    if (home && !home->running_p) data = home;
+
+    // reuse the slot of a thread that has exited or of a fiber that is done
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; !data && i < num; i++) {
+        bool in_use = false;
+        if (prof_threads[i]->in_use.compare_exchange_strong(in_use, true)) data = prof_threads[i];
+    }
+
+    if (!data) {
+        if (num >= MAX_PROF_THREADS) {
+            OBOE_DEBUG_LOG_HIGH(OBOE_MODULE_RUBY, "too many threads, thread can't be profiled");
+            return nullptr;
+        }
+        data = new prof_data_t();
+        data->in_use = true;
+        rb_gc_register_address(&data->fiber);
+        prof_threads[num] = data;
+        prof_threads_num.store(num + 1, memory_order_release);
+    }
+
     pid_t tid = AO_GETTID;
+    if (data->tid != tid) data->stack_lo = data->stack_hi = 0;  // looked up again
+    data->tid = tid;
+    data->home = !home || data == home;
+    if (!home) pthread_setspecific(prof_data_key, data);
+    data->fiber = rb_fiber_current();
+    data->current = true;
+    pthread_setspecific(prof_current_key, data);
+    return data;
+}
+
+// the running slot of the fiber, nullptr if it has none, under the GVL
+prof_data_t *Profiling::fiber_prof_data(VALUE fiber) {
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++) {
+        prof_data_t *data = prof_threads[i];
+        if (data->fiber == fiber && data->running_p) return data;
+    }
+    return nullptr;
+}
+
+// Runs in the fiber the thread switched to, its slot becomes the one the
+// samples, GC pauses and GVL intervals of the thread go to. The slot of
+// the fiber the thread left keeps its previous snapshot for when the
+// fiber comes back.
+void Profiling::fiber_switch_hook(VALUE tpval, void *arg) {
+    queue_hooks_job();
+    prof_data_t *prev = (prof_data_t *)pthread_getspecific(prof_current_key);
+    VALUE fiber = rb_fiber_current();
+    if (prev && prev->fiber == fiber) return;
+
+    prof_data_t *next = fiber_prof_data(fiber);
+    if (prev) prev->current = false;
+    if (next) next->current = true;
+    pthread_setspecific(prof_current_key, next);
+}
+
+// the fiber tracepoint is on while there are slots running, under the GVL
+void Profiling::update_fiber_tracepoint() {
+    if (NIL_P(fiber_tracepoint)) return;
+
+    bool on = running_slots > 0;
+    if (on == RTEST(rb_tracepoint_enabled_p(fiber_tracepoint))) return;
+    if (on)
+        rb_tracepoint_enable(fiber_tracepoint);
+    else
+        rb_tracepoint_disable(fiber_tracepoint);
+}
+
+// called by pthread when a thread with profiling data exits
+// the encoder may still be busy with what is left in the ring, the
+// slot can be reused anyway, a new run starts with an ENTRY record
+// The slots of fibers that never finished their run go with it, their
+// runs end here like in profiling_stop(), without the GVL.
+void Profiling::prof_data_release(void *ptr) {
+    prof_data_t *home = (prof_data_t *)ptr;
+    bool released = false;
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++) {
+        prof_data_t *data = prof_threads[i];
+        if (data != home && (data->home || !data->in_use || data->tid != home->tid)) continue;
+
+        data->current = false;
+        if (data->running_p.exchange(false)) {
+            if (data->alloc_num > 0) {
+                data->alloc_num = 0;
+                alloc_pending--;
+            }
+            if (data->mode != PROF_MODE_CPU && running_threads.fetch_sub(1) == 1) stop_timer();
+            running_slots--;
+            released = true;
+        }
+        // the fibers of the thread share its timer, nobody to hand it to
+        if (data->cpu_timer_p) {
+            timer_delete(data->cpu_timer);
+            data->cpu_timer_p = false;
+        }
+        data->in_use = false;
+    }
+
+    // the hooks are changed under the GVL, the job would go to this
+    // thread, the next hook that fires in another one queues it
+    if (released) hooks_stale = true;
+}
+
+// see prof_data_release()
+void Profiling::hooks_job(void *arg) {
+    update_hooks();
+}
+
+// returns the sequence number of the tick
+unsigned long Profiling::record_tick(long ts) {
+    unsigned long seq = tick_seq.load(memory_order_relaxed);
+    tick_log[seq % TICK_LOG_SIZE].store(ts, memory_order_relaxed);
+    tick_seq.store(seq + 1, memory_order_release);
+    return seq;
+}
+
+// add "OTHER THREADS" snapshots for the ticks before upto that were handled
+// by other threads, or "GVL WAIT" and "OFF CPU" if the thread events say so
+// in CPU mode the thread only gets signals while it is running, the ticks
+// of other threads don't concern it
+void Profiling::catch_up_ticks(prof_data_t *data, unsigned long upto) {
+    if (upto <= data->tick_cursor) return;
+    if (data->run_mode == PROF_MODE_CPU) {
+        data->tick_cursor = upto;
+        return;
+    }
+
+    // the oldest ticks may have been overwritten already
+    if (upto - data->tick_cursor > TICK_LOG_SIZE)
+        data->tick_cursor = upto - TICK_LOG_SIZE;
+
+    while (data->tick_cursor < upto) {
+        long ts = tick_log[data->tick_cursor % TICK_LOG_SIZE].load(memory_order_relaxed);
+        data->tick_cursor++;
+
+        drain_buffer[0] = gvl_frame(data, ts);
+        drain_lines[0] = 0;
+        Profiling::process_snapshot(drain_buffer, 1, data, ts, data->run_lines ? drain_lines : NULL);
+    }
+}
+
+// ENTRY and EXIT go into the room the other records leave free, see
+// SampleRing::CONTROL_RESERVE, the thread never waits for the encoder
+// returns false and counts the record if it still doesn't fit in
+bool Profiling::push_control(prof_data_t *data, int kind, long ts, unsigned long tick,
+                             const VALUE *payload, int num) {
+    if (encoder_done) return false;  // nobody left to send it
+    if (data->samples.push(kind, ts, tick, payload, num)) return true;
+
+    data->stats.control_dropped.add();
+    return false;
+}
+
+// runs in the encoder thread
+void Profiling::drain_samples(prof_data_t *data) {
+    SampleRing::Record rec;
+    Logging::timing = &data->stats.logging;
+
+    while (data->samples.peek(rec)) {
+        // the intervals up to now, before the catch-up needs them
+        if (rec.kind != SampleRing::ENTRY) take_gvl(data);
+
+        switch (rec.kind) {
+            case SampleRing::ENTRY:
+                data->run_tid = (pid_t)rec.frames[1];
+                data->run_mode = (int)rec.frames[2];
+                data->run_seq = (long)rec.frames[3];
+                data->run_lines = rec.frames[4] != 0;
+                data->run_interval = (long)rec.frames[0];
+                data->md = Metadata((const oboe_metadata_t *)&rec.frames[ENTRY_MD_OFFSET]);
+                data->prev_num = 0;
+                data->native_pending_num = 0;
+                data->omitted_num = 0;
+                data->tick_cursor = rec.tick;
+                data->run_batch_size = batch_size.load(memory_order_relaxed);
+                data->run_batch_us = batch_us.load(memory_order_relaxed);
+                data->run_format = configured_format.load(memory_order_relaxed);
+                data->run_frame_ids = configured_frame_ids.load(memory_order_relaxed);
+                data->dict_sent.clear();
+                // left over if the EXIT of the previous run didn't fit in the ring
+                data->batch.clear();
+                if (data->run_format == PROF_FORMAT_PPROF)
+                    data->profile.start(rec.ts, (long)rec.frames[0],
+                                        data->run_mode == PROF_MODE_CPU ? Logging::cpu : Logging::wall);
+                if (data->run_format == PROF_FORMAT_COLLAPSED) data->tree.clear();
+                data->stack_ids.clear();
+                data->line_keys.clear();
+                data->allocs.clear();
+                data->gvl_batch.clear();
+                data->gvl_recent.clear();
+                data->encoder_run_start = data->stats.totals();
+                Logging::log_profile_entry(data->md,
+                                           data->prof_op_id,
+                                           data->run_tid,
+                                           (long)rec.frames[0],  // interval
+                                           data->run_mode == PROF_MODE_CPU ? Logging::cpu : Logging::wall);
+                data->samples.pop(rec);
+                break;
+
+            case SampleRing::MISSED: {
+                catch_up_ticks(data, rec.tick);
+                int num = rec.num;
+                memcpy(drain_buffer, rec.frames, num * sizeof(VALUE));
+                data->samples.pop(rec);
+
+                Profiling::process_missed(data, (const long *)drain_buffer, num);
+                break;
+            }
+
+            case SampleRing::INTERVAL:
+                catch_up_ticks(data, rec.tick);  // at the interval before
+                data->run_interval = (long)rec.frames[0];
+                if (data->run_format == PROF_FORMAT_PPROF) data->profile.set_interval(data->run_interval);
+                data->samples.pop(rec);
+                break;
+
+            case SampleRing::NATIVE:
+                // comes right before the sample of its tick
+                data->native_pending_num = rec.num;
+                data->native_tick = rec.tick;
+                memcpy(data->native_pending, rec.frames, rec.num * sizeof(VALUE));
+                data->samples.pop(rec);
+                break;
+
+            case SampleRing::GC: {
+                int num = rec.num;
+                memcpy(drain_buffer, rec.frames, num * sizeof(VALUE));
+                data->samples.pop(rec);
+
+                Profiling::process_gc(data, drain_buffer, num);
+                break;
+            }
+
+            case SampleRing::ALLOC: {
+                int num = rec.num;
+                memcpy(drain_buffer, rec.frames, num * sizeof(VALUE));
+                long ts = rec.ts;
+                data->samples.pop(rec);
+
+                Profiling::process_alloc(data, drain_buffer, num, ts);
+                break;
+            }
+
+            case SampleRing::EXIT: {
+                // flush the ticks handled by other threads
+                catch_up_ticks(data, rec.tick);
+                if (!data->batch.empty()) send_batch(data);
+                if (data->run_format == PROF_FORMAT_PPROF) send_profile(data, rec.ts);
+                if (!data->tree.empty()) send_tree(data);
+                if (!data->allocs.empty()) send_allocs(data);
+                if (!data->gvl_batch.empty()) send_gvl(data);
+
+                // the counters of the thread come with the record
+                RunStats stats = data->stats.totals();
+                const RunStats &start = data->encoder_run_start;
+                stats.samples = (long)rec.frames[1];
+                stats.samples_dropped = (long)rec.frames[2];
+                stats.cache_misses = (long)rec.frames[3];
+                stats.snapshots -= start.snapshots;
+                stats.omitted -= start.omitted;
+                stats.remove_garbage_ns -= start.remove_garbage_ns;
+                stats.logging_ns -= start.logging_ns;  // without the exit event
+
+                Logging::log_profile_exit(data->md,
+                                          data->prof_op_id,
+                                          data->run_tid,
+                                          (long)rec.frames[0],  // interval
+                                          data->omitted,
+                                          data->omitted_num,
+                                          exit_stats ? &stats : NULL);
+                data->samples.pop(rec);
+                break;
+            }
+
+            default: {
+                catch_up_ticks(data, rec.tick);
+                data->tick_cursor = rec.tick + 1;
+
+                // process_snapshot modifies the frames in place
+                int num = rec.num;
+                memcpy(drain_buffer, rec.frames, num * sizeof(VALUE));
+                long ts = rec.ts;
+                unsigned long tick = rec.tick;
+                data->samples.pop(rec);
+
+                int *lines = NULL;
+                if (data->run_lines) {
+                    num /= 2;
+                    for (int i = 0; i < num; i++) drain_lines[i] = (int)drain_buffer[num + i];
+                    lines = drain_lines;
+                }
+                if (data->native_pending_num > 0) {
+                    if (data->native_tick == tick) num = add_native(data, drain_buffer, num, lines);
+                    data->native_pending_num = 0;
+                }
+                Profiling::process_snapshot(drain_buffer, num, data, ts, lines);
+            }
+        }
+    }
+
+    // don't hold on to the snapshots of a thread that stopped getting samples
+    if (!data->batch.empty() && ts_now() - data->batch.first_ts() >= data->run_batch_us)
+        send_batch(data);
+    if (!data->tree.empty() && tree_due(data, ts_now())) send_tree(data);
+    if (!data->allocs.empty() && ts_now() - data->allocs.first_ts() >= data->run_batch_us)
+        send_allocs(data);
+    take_gvl(data);
+    if (!data->gvl_batch.empty() && ts_now() - data->gvl_batch.first_ts() >= data->run_batch_us)
+        send_gvl(data);
+}
+
+// true while a thread is still in CProfiler.run or its ring isn't drained
+static bool runs_pending() {
+    if (running_slots > 0) return true;
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++)
+        if (!prof_threads[i]->samples.empty()) return true;
+    return false;
+}
+
+// After a shutdown the encoder stays until the threads still in
+// CProfiler.run have left it and their rings are drained, so that their
+// exit events get out, unless the encoder itself failed.
+void *Profiling::encoder_loop(void *arg) {
+    struct timespec pause = {0, ENCODER_PAUSE_NS};
+
+    while (true) {
+        int result = try_catch_shutdown([]() {
+            int num = prof_threads_num.load(memory_order_acquire);
+            for (int i = 0; i < num; i++) {
+                Profiling::drain_samples(prof_threads[i]);
+            }
+            return 0;  // block needs an int returned
+        }, Profiling::string_encoder);
+        if (profiling_shut_down && (result != 0 || !runs_pending())) break;
+
+        nanosleep(&pause, NULL);
+    }
+    encoder_done = true;
+    return NULL;
+}
+
+void Profiling::start_encoder() {
+    if (encoder_started.exchange(true)) return;
+    encoder_done = false;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&encoder_thread, &attr, Profiling::encoder_loop, NULL) != 0) {
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "pthread_create() failed for the profiling encoder");
+        profiling_shut_down = true;  // no profiling without encoder
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// returns the tick for a sample, only the wall clock ticks are logged,
+// they are the ones other threads have to catch up on
+unsigned long Profiling::next_tick(bool wall_tick, long ts) {
+    if (wall_tick) return record_tick(ts);
+    return tick_seq.load(memory_order_acquire);
+}
+
+// the frames in frames_buffer, under the GVL
+// in line mode their lines from lines_buffer go after them
+void Profiling::push_sample(prof_data_t *data, long ts, unsigned long tick, int num) {
+    push_interval(data, ts, tick);
+    if (data->lines) {
+        for (int i = 0; i < num; i++) frames_buffer[num + i] = (VALUE)lines_buffer[i];
+        num *= 2;
+    }
+    if (data->samples.push(SampleRing::SAMPLE, ts, tick, frames_buffer, num))
+        data->stats.samples.add();
+    else
+        data->stats.samples_dropped.add();
+}
+
+// the adaptive interval has changed since the last record, the samples
+// after it are weighted with the new one, tried again with the next
+// sample if the encoder has fallen behind
+void Profiling::push_interval(prof_data_t *data, long ts, unsigned long tick) {
+    if (data->pushed_interval == current_interval) return;
+    VALUE payload[1] = {(VALUE)current_interval};
+    if (data->samples.push(SampleRing::INTERVAL, ts, tick, payload, 1)) data->pushed_interval = current_interval;
+}
+
+// the native stack the signal handler took, ahead of the sample of the job,
+// stacks older than two intervals belong to a tick whose job ran elsewhere
+void Profiling::push_native(prof_data_t *data, long ts, unsigned long tick) {
+    int num = data->native_num.exchange(-1);
+    if (num > 0 && monotonic_ns() - data->native_ns <= 2 * current_interval * 1000000L)
+        data->samples.push(SampleRing::NATIVE, ts, tick, (const VALUE *)data->native_pcs, num);
+    data->native_num = 0;
+}
+
+// Runs in the job handlers for wall clock ticks. Returns the number of
+// ticks before this one that didn't get a job, with their timestamps in
+// missed_buffer, -1 if there is no new tick, the job is a leftover of a
+// burst queued up by Ruby and its sample would be a duplicate.
+int Profiling::reconcile_signals(long ts) {
+    unsigned long upto = signal_seq.load(memory_order_acquire);
+    unsigned long from = signal_cursor;
+    if (upto == from) return -1;
+    signal_cursor = upto;
+
+    // the last tick is the one of this job
+    long missed = (long)(upto - from - 1);
+    if (missed == 0) return 0;
+    ticks_missed += missed;
+
+    // the oldest ticks may have been overwritten already, keep clear of the
+    // slot the next signal writes
+    if (upto - from > TICK_LOG_SIZE - 1) from = upto - (TICK_LOG_SIZE - 1);
+    int num = (int)min(upto - 1 - from, (unsigned long)BUF_SIZE - 2);
+    for (int i = 0; i < num; i++)
+        missed_buffer[2 + i] = (VALUE)signal_log[(from + i) % TICK_LOG_SIZE].load(memory_order_relaxed);
+    missed_buffer[0] = (VALUE)missed;
+    missed_buffer[1] = (VALUE)(ts - (long)missed_buffer[2]);  // since the first tick waited
+    return num;
+}
+
+// the ticks in missed_buffer go ahead of the sample of the job, under the GVL
+void Profiling::push_missed(prof_data_t *data, unsigned long tick, int num) {
+    push_interval(data, (long)missed_buffer[2], tick);
+    data->stats.samples_missed.add((long)missed_buffer[0]);
+    // lost like the sample if the encoder has fallen behind
+    data->samples.push(SampleRing::MISSED, (long)missed_buffer[2], tick, missed_buffer, 2 + num);
+}
+
+// true if the thread is being profiled in the mode of the timer that fired
+static bool samples_tick(prof_data_t *data, bool wall_tick) {
+    return data && data->running_p && (data->mode == PROF_MODE_WALL) == wall_tick;
+}
+
+// runs in the postponed job, keep it short, the encoder does the rest
+void Profiling::profiler_record_frames(bool wall_tick) {
     long ts = ts_now();
+    int missed = wall_tick ? reconcile_signals(ts) : 0;
+    if (missed < 0) return;
+    unsigned long tick = next_tick(wall_tick, ts);
+    prof_data_t *data = get_prof_data(false);
 
     // check if this thread is being profiled
-    if (prof_data_map[tid].running_p) {
+    if (samples_tick(data, wall_tick)) {
         // executes in the same thread as rb_postponed_job was called from
 
+        // the interval may have been retuned since the thread armed its timer
+        if (data->cpu_timer_p && data->cpu_timer_interval != current_interval && !profiling_shut_down) {
+            set_timer(data->cpu_timer, current_interval);
+            data->cpu_timer_interval = current_interval;
+        }
+
         // get the frames
         // won't overrun frames buffer, because size is set in arg 2
-        int num = rb_profile_frames(0, sizeof(frames_buffer) / sizeof(VALUE), frames_buffer, lines_buffer);
+        int num = rb_profile_frames(0, BUF_SIZE, frames_buffer, lines_buffer);
 
-        Profiling::process_snapshot(frames_buffer, num, tid, ts);
+        // the encoder can't call into Ruby, new frames have to be cached here
+        data->stats.cache_misses.add(Frames::cache_frames(frames_buffer, num));
+
+        // if the encoder has fallen behind the sample is dropped
+        if (missed > 0) push_missed(data, tick, missed);
+        if (data->native) push_native(data, ts, tick);
+        push_sample(data, ts, tick, num);
     }
 
-    // add this timestamp as omitted to other running threads that are profiled
-    for (pair<const pid_t, prof_data_t> &ele : prof_data_map) {
-        if (ele.second.running_p && ele.first != tid) {
-            frames_buffer[0] = PR_OTHER_THREAD;
-            Profiling::process_snapshot(frames_buffer, 1, ele.first, ts);
-        }
+    if (wall_tick) {
+        wall_ticks++;
+        if (threads_per_tick > 0) sample_other_threads(data, ts, tick);
     }
 }
 
-void Profiling::profiler_record_gc() {
-   pid_t tid = AO_GETTID;
-   long ts = ts_now();
+// Samples the other threads profiled in wall clock mode, round robin, up to
+// threads_per_tick of them. Their rings are written by their own thread
+// otherwise, holding the GVL keeps this job the only producer meanwhile.
+// Threads that are skipped get OTHER THREADS from the catch-up as before.
+void Profiling::sample_other_threads(prof_data_t *self, long ts, unsigned long tick) {
+#ifdef HAVE_RB_PROFILE_THREAD_FRAMES
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int num = prof_threads_num.load(memory_order_acquire);
+    long sampled = 0;
+    int i;
+    for (i = 0; i < num && sampled < threads_per_tick; i++) {
+        prof_data_t *data = prof_threads[(other_threads_cursor + i) % num];
+        // the stack of a thread is the one of its running fiber
+        if (data == self || !samples_tick(data, true) || !data->current || NIL_P(data->thread)) continue;
+
+        int n = rb_profile_thread_frames(data->thread, 0, BUF_SIZE, frames_buffer, lines_buffer);
+        data->stats.cache_misses.add(Frames::cache_frames(frames_buffer, n));
+        push_sample(data, ts, tick, n);
+        sampled++;
+    }
+    if (num > 0) other_threads_cursor = (other_threads_cursor + i) % num;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    other_threads_sampled += sampled;
+    other_threads_ns += (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+#endif
+}
+
+void Profiling::profiler_record_gc(bool wall_tick) {
+    long ts = ts_now();
+    int missed = wall_tick ? reconcile_signals(ts) : 0;
+    if (missed < 0) return;
+    unsigned long tick = next_tick(wall_tick, ts);
+    prof_data_t *data = get_prof_data(false);
 
     // check if this thread is being profiled
-    if (prof_data_map[tid].running_p) {
+    if (samples_tick(data, wall_tick)) {
+        if (missed > 0) push_missed(data, tick, missed);
         frames_buffer[0] = PR_IN_GC;
-        Profiling::process_snapshot(frames_buffer, 1, tid, ts);
+        lines_buffer[0] = 0;
+        push_sample(data, ts, tick, 1);
     }
+}
 
-    // add this timestamp as omitted to other running threads that are profiled
-    for (pair<const pid_t, prof_data_t> &ele : prof_data_map) {
-        if (ele.second.running_p && ele.first != tid) {
-            frames_buffer[0] = PR_OTHER_THREAD;
-            Profiling::process_snapshot(frames_buffer, 1, ele.first, ts);
-        }
+// takes the info for the frames the run hasn't sent yet, needs the frame
+// cache lock, send_frame_dict() sends it after the lock is released, the
+// Ruby threads caching frames don't wait for the reporter
+void Profiling::take_frame_dict(prof_data_t *data, VALUE *frames_buffer, int num) {
+    Frames::collect_frame_dict(frames_buffer, num, data->dict_sent, dict_ids, dict_frames);
+}
+
+// without the frame cache lock, ahead of the event with the ids
+void Profiling::send_frame_dict(prof_data_t *data) {
+    // keep the events at a reasonable size
+    for (size_t i = 0; i < dict_ids.size(); i += BUF_SIZE) {
+        size_t end = min(dict_ids.size(), i + BUF_SIZE);
+        vector<FrameData> frames(dict_frames.begin() + i, dict_frames.begin() + end);
+        Logging::log_profile_frame_dict(data->md,
+                                        data->prof_op_id,
+                                        dict_ids.data() + i,  // frame ids
+                                        frames,               // <vector> frame info
+                                        data->run_tid);
+    }
+    dict_ids.clear();
+    dict_frames.clear();
+}
+
+void Profiling::send_omitted(prof_data_t *data, long ts) {
+    static const vector<FrameData> no_frames;
+    Logging::log_profile_snapshot(data->md,
+                                  data->prof_op_id,
+                                  ts,                 // timestamp
+                                  NULL,               // ids of new frames
+                                  0,                  // number of new frames
+                                  0,                  // number of exited frames
+                                  data->prev_num,     // total number of frames
+                                  data->omitted,      // array of timestamps of omitted snapshots
+                                  data->omitted_num,  // number of omitted snapshots
+                                  data->run_tid,      // thread id
+                                  NULL,               // lines of new frames
+                                  data->run_frame_ids ? NULL : &no_frames);
+
+    data->omitted_num = 0;
+}
+
+void Profiling::send_batch(prof_data_t *data) {
+    Logging::log_profile_batch(data->md,
+                               data->prof_op_id,
+                               data->batch,
+                               data->run_tid);
+    data->batch.clear();
+}
+
+// in batch mode the snapshots are added to the batch instead of sending
+// them one by one
+void Profiling::batch_snapshot(prof_data_t *data, long ts, int num_new, int num_exited, int num) {
+    if (num_new == 0 && num_exited == 0)
+        data->batch.add_omitted(ts);
+    else
+        data->batch.add(ts, new_frames.data(), num_new, num_exited, num,
+                        data->run_lines ? new_lines.data() : NULL);
+
+    if ((long)data->batch.size() >= data->run_batch_size ||
+        data->batch.omitted.size() >= BUF_SIZE ||
+        ts - data->batch.first_ts() >= data->run_batch_us)
+        send_batch(data);
+}
+
+// in pprof and collapsed format every snapshot goes into the profile or
+// call tree of the run, needs the frame cache lock for the info of new frames
+void Profiling::profile_snapshot(prof_data_t *data, VALUE *frames_buffer, long ts,
+                                 int num_new, int num_exited, int num) {
+    bool pprof = data->run_format == PROF_FORMAT_PPROF;
+    vector<long> &stack = data->stack_ids;
+
+    if (num_new == 0 && num_exited == 0) {
+        if (pprof)
+            data->profile.add_repeat(ts);
+        else if (data->tree.empty())  // sent since the last snapshot
+            data->tree.add(stack.data(), (int)stack.size(), ts);
+        else
+            data->tree.add_repeat(ts);
+        return;
     }
+
+    // in line mode each frame and line is a location of its own
+    if (data->run_lines)
+        for (int i = 0; i < num_new; i++) new_frames[i] = data->line_keys.key(new_frames[i], (int)new_lines[i]);
+
+    stack.erase(stack.begin(), stack.begin() + num_exited);
+    stack.insert(stack.begin(), new_frames.begin(), new_frames.begin() + num_new);
+
+    for (int i = 0; i < num_new; i++) {
+        if (pprof ? data->profile.has_location(new_frames[i]) : data->tree.has_name(new_frames[i]))
+            continue;
+        profile_frames.clear();
+        Frames::collect_frame_data(&frames_buffer[i], 1, profile_frames);
+        int line = data->run_lines ? (int)new_lines[i] : 0;
+        if (pprof)
+            data->profile.add_location(new_frames[i], profile_frames[0], line);
+        else
+            data->tree.set_name(new_frames[i], profile_frames[0], line);
+    }
+
+    if (pprof)
+        data->profile.add_sample(stack.data(), num, ts);
+    else
+        data->tree.add(stack.data(), num, ts);
 }
 
-void Profiling::send_omitted(pid_t tid, long ts) {
-    static vector<FrameData> empty;
-    Logging::log_profile_snapshot(prof_data_map[tid].md,
-                                  prof_data_map[tid].prof_op_id,
-                                  ts,                              // timestamp
-                                  empty,                           // <vector> new frames
-                                  0,                               // number of exited frames
-                                  prof_data_map[tid].prev_num,     // total number of frames
-                                  prof_data_map[tid].omitted,      // array of timestamps of omitted snapshots
-                                  prof_data_map[tid].omitted_num,  // number of omitted snapshots
-                                  tid);                            // thread id
+// the call tree is sent at the end of the run and every run_batch_us
+void Profiling::send_tree(prof_data_t *data) {
+    profile_buffer.clear();
+    data->tree.collapse(profile_buffer);
+    Logging::log_profile_collapsed(data->md,
+                                   data->prof_op_id,
+                                   profile_buffer,
+                                   data->tree.samples(),
+                                   data->run_tid);
+    data->tree.clear_counts();
+}
+
+bool Profiling::tree_due(prof_data_t *data, long ts) {
+    return data->run_format == PROF_FORMAT_COLLAPSED && !data->tree.empty() &&
+           ts - data->tree.first_ts() >= data->run_batch_us;
+}
+
+void Profiling::send_profile(prof_data_t *data, long ts) {
+    data->profile.encode(profile_buffer, ts);
+    Logging::log_profile_pprof(data->md,
+                               data->prof_op_id,
+                               profile_buffer,
+                               data->run_tid);
+    data->profile.clear();
+}
 
-    prof_data_map[tid].omitted_num = 0;
+// the ticks of a MISSED record go to the stack of the previous snapshot
+// payload: [number of ticks][blocked us][timestamps ...]
+void Profiling::process_missed(prof_data_t *data, const long *payload, int num) {
+    long *timestamps = (long *)payload + 2;
+    int num_ts = num - 2;
+
+    if (data->run_format != PROF_FORMAT_EVENTS) {
+        // as repeats, there is no stack before the first snapshot
+        if (data->prev_num == 0) return;
+        for (int i = 0; i < num_ts; i++)
+            Profiling::profile_snapshot(data, NULL, timestamps[i], 0, 0, data->prev_num);
+        if (tree_due(data, timestamps[num_ts - 1])) send_tree(data);
+        return;
+    }
+
+    // the batch has the snapshots before the missed ticks
+    if (!data->batch.empty()) send_batch(data);
+    Logging::log_profile_missed(data->md,
+                                data->prof_op_id,
+                                timestamps,      // timestamps of the missed ticks
+                                num_ts,          // number of timestamps
+                                payload[0],      // number of missed ticks
+                                payload[1],      // how long the thread went without a sample
+                                data->prev_num,  // total number of frames
+                                data->run_tid);
+}
+
+// payload of a GC record:
+// [number of pauses][ts, mark ns, sweep ns, flags per pause][frames ...]
+void Profiling::process_gc(prof_data_t *data, VALUE *payload, int num) {
+    int num_pauses = (int)payload[0];
+    VALUE *frames = payload + 1 + 4 * num_pauses;
+    int num_frames = num - 1 - 4 * num_pauses;
+
+    gc_timestamps.clear();
+    gc_mark_ns.clear();
+    gc_sweep_ns.clear();
+    gc_flags.clear();
+    for (int i = 0; i < num_pauses; i++) {
+        const VALUE *pause = payload + 1 + 4 * i;
+        gc_timestamps.push_back((long)pause[0]);
+        gc_mark_ns.push_back((long)pause[1]);
+        gc_sweep_ns.push_back((long)pause[2]);
+        gc_flags.push_back((long)pause[3]);
+    }
+
+    // the whole stack, not a diff, the GC events are not part of the snapshots
+    gc_frame_ids.clear();
+    {
+        unique_lock<mutex> guard = Frames::lock_cached_frames();
+        num_frames = Frames::remove_garbage(frames, num_frames);
+        Frames::collect_frame_ids(frames, num_frames, gc_frame_ids);
+        Profiling::take_frame_dict(data, frames, num_frames);
+    }
+    Profiling::send_frame_dict(data);
+
+    Logging::log_profile_gc(data->md,
+                            data->prof_op_id,
+                            gc_timestamps,
+                            gc_mark_ns,
+                            gc_sweep_ns,
+                            gc_flags,
+                            gc_frame_ids,
+                            data->run_tid);
 }
 
-void Profiling::process_snapshot(VALUE *frames_buffer, int num, pid_t tid, long ts) {
+// payload of an ALLOC record: [weight][bytes][frames ...]
+// the samples are aggregated per stack and sent every run_batch_us
+void Profiling::process_alloc(prof_data_t *data, VALUE *payload, int num, long ts) {
+    VALUE *frames = payload + 2;
+    int num_frames = num - 2;
+
+    alloc_ids.clear();
+    {
+        unique_lock<mutex> guard = Frames::lock_cached_frames();
+        num_frames = Frames::remove_garbage(frames, num_frames);
+        Frames::collect_frame_ids(frames, num_frames, alloc_ids);
+        Profiling::take_frame_dict(data, frames, num_frames);
+    }
+    Profiling::send_frame_dict(data);
+
+    long weight = (long)payload[0];
+    data->allocs.add(alloc_ids.data(), (int)alloc_ids.size(), weight, weight * (long)payload[1], ts);
+    if (ts - data->allocs.first_ts() >= data->run_batch_us) send_allocs(data);
+}
+
+// moves the GVL intervals of the current run from the ring into the batch,
+// drops the ones of earlier runs and leaves the ones of the next run
+void Profiling::take_gvl(prof_data_t *data) {
+    GvlInterval interval;
+    while (data->gvl_ring.peek(interval)) {
+        if (interval.run > data->run_seq) return;
+        data->gvl_ring.pop();
+        if (interval.run < data->run_seq) continue;
+
+        data->gvl_batch.add(interval);
+        // in CPU mode there is no catch-up
+        if (interval.state == GVL_STATE_RUNNING || data->run_mode == PROF_MODE_CPU) continue;
+        data->gvl_recent.push_back(interval);
+        if (data->gvl_recent.size() > GvlRing::CAPACITY) data->gvl_recent.pop_front();
+    }
+}
+
+// the pseudo frame for a tick handled by another thread, the ticks come
+// in order, the intervals that ended before are done with
+VALUE Profiling::gvl_frame(prof_data_t *data, long ts) {
+    deque<GvlInterval> &recent = data->gvl_recent;
+    while (!recent.empty() && recent.front().ts + recent.front().us <= ts) recent.pop_front();
+
+    // e.g. the interval hasn't ended yet, or was too short
+    if (recent.empty() || recent.front().ts > ts) return PR_OTHER_THREAD;
+    return recent.front().state == GVL_STATE_WAIT ? PR_GVL_WAIT : PR_OFF_CPU;
+}
+
+void Profiling::send_gvl(prof_data_t *data) {
+    Logging::log_profile_gvl(data->md,
+                             data->prof_op_id,
+                             data->gvl_batch,
+                             data->run_tid);
+    data->gvl_batch.clear();
+}
+
+void Profiling::send_allocs(prof_data_t *data) {
+    Logging::log_profile_alloc(data->md,
+                               data->prof_op_id,
+                               data->allocs,
+                               alloc_interval,
+                               data->run_tid);
+    data->allocs.clear();
+}
+
+// Symbolizes the native stack waiting for the sample and splices it into
+// the frames, returns their number. Only the innermost frames outside of
+// the Ruby VM are kept, with the VM frames they called, e.g. rb_ary_push(),
+// the VM frames after them are the ones that called the <cfunc> frame. A
+// stack that is all VM, e.g. while running Ruby code, adds nothing. Runs
+// in the encoder thread.
+int Profiling::add_native(prof_data_t *data, VALUE *frames_buffer, int num, int *lines) {
+    static NativeSymbols symbols((const void *)&rb_profile_frames);
+    VALUE native[NATIVE_MAX_FRAMES];
+
+    int keep = 0;
+    bool outside = false;
+    for (; keep < data->native_pending_num; keep++) {
+        const NativeSymbols::Symbol &symbol = symbols.lookup(data->native_pending[keep]);
+        if (outside && symbol.vm) break;
+        outside = outside || !symbol.vm;
+        native[keep] = symbol.key;
+    }
+    if (!outside) return num;
+
+    unique_lock<mutex> guard = Frames::lock_cached_frames();
+    for (int i = 0; i < keep; i++)
+        Frames::cache_native_frame(native[i], symbols.lookup(data->native_pending[i]).data);
+    return Frames::splice_native(frames_buffer, num, native, keep, lines, BUF_SIZE);
+}
+
+// in line mode lines has the line of each frame, they are part of its
+// identity when comparing with the previous snapshot
+void Profiling::process_snapshot(VALUE *frames_buffer, int num, prof_data_t *data, long ts, int *lines) {
     int num_new = 0;
     int num_exited = 0;
-    vector<FrameData> new_frames;
 
-    num = Frames::remove_garbage(frames_buffer, num);
+    // the frame cache is only read here, but the Ruby threads add to it
+    unique_lock<mutex> guard = Frames::lock_cached_frames();
+    long start = monotonic_ns();
+    num = Frames::remove_garbage(frames_buffer, num, lines);
+    data->stats.remove_garbage.add(monotonic_ns() - start);
+    data->stats.snapshots.add();
 
     // find the number of matching frames from the top
     int num_match = Frames::num_matching(frames_buffer,
                                          num,
-                                         prof_data_map[tid].prev_frames_buffer,
-                                         prof_data_map[tid].prev_num);
+                                         data->prev_frames_buffer,
+                                         data->prev_num,
+                                         lines,
+                                         data->prev_lines_buffer);
     num_new = num - num_match;
-    num_exited = prof_data_map[tid].prev_num - num_match;
+    num_exited = data->prev_num - num_match;
 
     if (num_new == 0 && num_exited == 0) {
-        prof_data_map[tid].omitted[prof_data_map[tid].omitted_num] = ts;
-        prof_data_map[tid].omitted_num++;
+        data->stats.omitted.add();
+        if (data->run_format != PROF_FORMAT_EVENTS) {
+            Profiling::profile_snapshot(data, frames_buffer, ts, 0, 0, num);
+            guard.unlock();
+            if (tree_due(data, ts)) send_tree(data);
+            return;
+        }
+        if (data->run_batch_size > 0) {
+            guard.unlock();
+            Profiling::batch_snapshot(data, ts, 0, 0, num);
+            return;
+        }
+
+        data->omitted[data->omitted_num] = ts;
+        data->omitted_num++;
 
         // the omitted buffer can fill up if the interval is small
         // and the stack doesn't change
         // We need to send a profiling event with the timestamps when it is full
-        if (prof_data_map[tid].omitted_num >= BUF_SIZE) {
-            Profiling::send_omitted(tid, ts);
+        if (data->omitted_num >= BUF_SIZE) {
+            Profiling::send_omitted(data, ts);
         }
         return;
     }
 
-    Frames::collect_frame_data(frames_buffer, num_new, new_frames);
-
-    Logging::log_profile_snapshot(prof_data_map[tid].md,
-                                  prof_data_map[tid].prof_op_id,
-                                  ts,                              // timestamp
-                                  new_frames,                      // <vector> new frames
-                                  num_exited,                      // number of exited frames
-                                  num,                             // total number of frames
-                                  prof_data_map[tid].omitted,      // array of timestamps of omitted snapshots
-                                  prof_data_map[tid].omitted_num,  // number of omitted snapshots
-                                  tid);                            // thread id
+    new_frames.clear();
+    Frames::collect_frame_ids(frames_buffer, num_new, new_frames);
+    if (lines) new_lines.assign(lines, lines + num_new);
+
+    if (data->run_format != PROF_FORMAT_EVENTS) {
+        Profiling::profile_snapshot(data, frames_buffer, ts, num_new, num_exited, num);
+        guard.unlock();
+        if (tree_due(data, ts)) send_tree(data);
+    } else if (data->run_batch_size > 0) {
+        Profiling::take_frame_dict(data, frames_buffer, num_new);
+        guard.unlock();
+        Profiling::send_frame_dict(data);
+        Profiling::batch_snapshot(data, ts, num_new, num_exited, num);
+    } else {
+        // without frame ids the snapshot carries the new frames themselves
+        new_frame_data.clear();
+        if (data->run_frame_ids)
+            Profiling::take_frame_dict(data, frames_buffer, num_new);
+        else
+            Frames::collect_frame_data(frames_buffer, num_new, new_frame_data);
+        guard.unlock();
+        Profiling::send_frame_dict(data);
+        Logging::log_profile_snapshot(data->md,
+                                      data->prof_op_id,
+                                      ts,                 // timestamp
+                                      new_frames.data(),  // ids of new frames
+                                      num_new,            // number of new frames
+                                      num_exited,         // number of exited frames
+                                      num,                // total number of frames
+                                      data->omitted,      // array of timestamps of omitted snapshots
+                                      data->omitted_num,  // number of omitted snapshots
+                                      data->run_tid,      // thread id
+                                      lines ? new_lines.data() : NULL,  // lines of new frames
+                                      data->run_frame_ids ? NULL : &new_frame_data);
+        data->omitted_num = 0;
+    }
 
-    prof_data_map[tid].omitted_num = 0;
-    prof_data_map[tid].prev_num = num;
+    data->prev_num = num;
     for (int i = 0; i < num; ++i)
-        prof_data_map[tid].prev_frames_buffer[i] = frames_buffer[i];
+        data->prev_frames_buffer[i] = frames_buffer[i];
+    if (lines) memcpy(data->prev_lines_buffer, lines, num * sizeof(int));
+}
+
+// returns the start time of a job handler, the signals since the last job
+// were waiting for it
+static long job_started() {
+    long now = monotonic_ns();
+    long signalled = pending_signal_ns.exchange(0);
+    if (signalled) job_latency.add(now - signalled);
+    return now;
 }
 
 void Profiling::profiler_job_handler(void *data) {
     static atomic_bool in_job_handler{false};
 
     // atomically replaces the value of the object, returns the value held previously
-    if (in_job_handler.exchange(true)) return;
+    if (in_job_handler.exchange(true)) {
+        ticks_dropped_job++;
+        return;
+    }
 
+    long start = job_started();
+    in_profiler_job = true;
     try_catch_shutdown([&]() {
-        Profiling::profiler_record_frames();
+        Profiling::profiler_record_frames(data == WALL_TICK);
         return 0;  // block needs an int returned
     }, Profiling::string_job_handler);
+    in_profiler_job = false;
+    adapt_interval(monotonic_ns() - start);
 
     in_job_handler = false;
 }
@@ -207,16 +1240,305 @@ void Profiling::profiler_gc_handler(void *data) {
     static atomic_bool in_gc_handler{false};
 
     // atomically replaces the value of the object, returns the value held previously
-    if (in_gc_handler.exchange(true)) return;
+    if (in_gc_handler.exchange(true)) {
+        ticks_dropped_job++;
+        return;
+    }
 
-    try_catch_shutdown([]() {
-        Profiling::profiler_record_gc();
+    long start = job_started();
+    try_catch_shutdown([&]() {
+        Profiling::profiler_record_gc(data == WALL_TICK);
         return 0;  // block needs an int returned
     }, Profiling::string_gc_handler);
+    adapt_interval(monotonic_ns() - start);
 
     in_gc_handler = false;
 }
 
+// Runs inside the GC, nothing in here may allocate or call into Ruby.
+// The pauses go to the thread that ran the GC step, the one that allocated.
+void Profiling::gc_event_hook(VALUE tpval, void *arg) {
+    queue_hooks_job();
+    rb_event_flag_t event = rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tpval));
+    long now = monotonic_ns();
+
+    switch (event) {
+        case RUBY_INTERNAL_EVENT_GC_ENTER:
+            gc_phases.enter(now, ts_now());
+            return;
+        case RUBY_INTERNAL_EVENT_GC_START:
+            // the latest GC info is already about this GC, :major_by is nil
+            // for a minor one
+            gc_phases.start(now, rb_gc_latest_gc_info(sym_major_by) != Qnil);
+            return;
+        case RUBY_INTERNAL_EVENT_GC_END_MARK:
+            gc_phases.end_mark(now);
+            return;
+        case RUBY_INTERNAL_EVENT_GC_END_SWEEP:
+            gc_phases.end_sweep(now);
+            return;
+    }
+
+    // RUBY_INTERNAL_EVENT_GC_EXIT
+    GcPause pause = gc_phases.exit(now);
+    prof_data_t *data = get_prof_data(false);
+    if (!data || !data->running_p) return;
+
+    data->stats.gc_pauses.add(pause.mark_ns + pause.sweep_ns);
+    if (data->gc_pauses_num < GC_PAUSES_MAX) {
+        data->gc_pauses[data->gc_pauses_num++] = pause;
+    } else {
+        GcPause &last = data->gc_pauses[GC_PAUSES_MAX - 1];
+        last.mark_ns += pause.mark_ns;
+        last.sweep_ns += pause.sweep_ns;
+        last.flags |= pause.flags;
+    }
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    rb_postponed_job_trigger(gc_stack_job_handle);
+#else
+    rb_postponed_job_register_one(0, Profiling::gc_stack_job, NULL);
+#endif
+}
+
+// Runs after the GC in the thread that ran it, its stack is the one that
+// allocated. A GC while caching the frames starts a new list of pauses.
+void Profiling::gc_stack_job(void *arg) {
+    in_profiler_job = true;
+    try_catch_shutdown([]() {
+        prof_data_t *data = get_prof_data(false);
+        if (!data || !data->running_p || data->gc_pauses_num == 0) return 0;
+
+        int num_pauses = data->gc_pauses_num;
+        gc_buffer[0] = (VALUE)num_pauses;
+        for (int i = 0; i < num_pauses; i++) {
+            const GcPause &pause = data->gc_pauses[i];
+            VALUE *col = &gc_buffer[1 + 4 * i];
+            col[0] = (VALUE)pause.ts;
+            col[1] = (VALUE)pause.mark_ns;
+            col[2] = (VALUE)pause.sweep_ns;
+            col[3] = (VALUE)pause.flags;
+        }
+        data->gc_pauses_num = 0;
+
+        // the record has to fit into the drain buffer, deep stacks lose outer frames
+        int head = 1 + 4 * num_pauses;
+        int num = rb_profile_frames(0, BUF_SIZE - head, &gc_buffer[head], lines_buffer);
+        data->stats.cache_misses.add(Frames::cache_frames(&gc_buffer[head], num));
+
+        // lost like a sample if the encoder has fallen behind
+        data->samples.push(SampleRing::GC, (long)gc_buffer[1], tick_seq.load(memory_order_acquire),
+                           gc_buffer, head + num);
+        return 0;  // block needs an int returned
+    }, Profiling::string_gc_stack_job);
+    in_profiler_job = false;
+}
+
+// NEWOBJ and FREEOBJ, runs inside the allocation or the GC, nothing in
+// here may allocate or call into Ruby
+void Profiling::alloc_event_hook(VALUE tpval, void *arg) {
+    queue_hooks_job();
+    rb_trace_arg_t *trace_arg = rb_tracearg_from_tracepoint(tpval);
+
+    if (rb_tracearg_event_flag(trace_arg) == RUBY_INTERNAL_EVENT_FREEOBJ) {
+        if (alloc_pending == 0) return;
+        VALUE obj = rb_tracearg_object(trace_arg);
+        int num = prof_threads_num.load(memory_order_acquire);
+        for (int i = 0; i < num; i++)
+            if (prof_threads[i]->alloc_obj == obj) prof_threads[i]->alloc_obj = Qnil;
+        return;
+    }
+
+    if (in_profiler_job) return;
+    long weight = alloc_sampler.sample();
+    if (weight == 0) return;
+    prof_data_t *data = get_prof_data(false);
+    if (!data || !data->running_p) return;
+
+    long start = monotonic_ns();
+    data->stats.alloc_samples.add();
+    if (data->alloc_num > 0) {
+        // alloc_job() hasn't run since the last sample, that one takes the weight
+        data->alloc_weight += weight;
+    } else {
+        // rb_profile_frames() doesn't allocate, caching the frames does
+        int num = rb_profile_frames(0, BUF_SIZE - 2, data->alloc_frames, lines_buffer);
+        if (num > 0) {
+            data->alloc_num = num;
+            data->alloc_weight = weight;
+            data->alloc_ts = ts_now();
+            data->alloc_obj = rb_tracearg_object(trace_arg);
+            alloc_pending++;
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+            rb_postponed_job_trigger(alloc_job_handle);
+#else
+            rb_postponed_job_register_one(0, Profiling::alloc_job, NULL);
+#endif
+        }
+    }
+    long now = monotonic_ns();
+    alloc_sampler.spent(now - start, now);
+}
+
+// Runs after the sampled allocation in the same thread, the object is
+// set up by now, unless it was freed already
+void Profiling::alloc_job(void *arg) {
+    in_profiler_job = true;
+    try_catch_shutdown([]() {
+        prof_data_t *data = get_prof_data(false);
+        if (!data || data->alloc_num == 0) return 0;
+
+        long start = monotonic_ns();
+        int num = data->alloc_num;
+        data->alloc_num = 0;
+        alloc_pending--;
+
+        alloc_buffer[0] = (VALUE)data->alloc_weight;
+        alloc_buffer[1] = NIL_P(data->alloc_obj) ? (VALUE)ALLOC_MIN_BYTES
+                                                 : (VALUE)rb_obj_memsize_of(data->alloc_obj);
+        data->alloc_obj = Qnil;
+        memcpy(&alloc_buffer[2], data->alloc_frames, num * sizeof(VALUE));
+        data->stats.cache_misses.add(Frames::cache_frames(&alloc_buffer[2], num));
+
+        // lost like a sample if the encoder has fallen behind
+        data->samples.push(SampleRing::ALLOC, data->alloc_ts, tick_seq.load(memory_order_acquire),
+                           alloc_buffer, 2 + num);
+        long now = monotonic_ns();
+        alloc_sampler.spent(now - start, now);
+        return 0;  // block needs an int returned
+    }, Profiling::string_alloc_job);
+    in_profiler_job = false;
+}
+
+// the thread event hook is there while slots are running, if the GVL
+// events are allowed, under the GVL
+void Profiling::update_gvl_hook() {
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    bool on = gvl_events && running_slots > 0;
+    if (on && !gvl_hook) {
+        gvl_hook = rb_internal_thread_add_event_hook(Profiling::gvl_event_hook,
+                                                     RUBY_INTERNAL_THREAD_EVENT_READY |
+                                                         RUBY_INTERNAL_THREAD_EVENT_RESUMED |
+                                                         RUBY_INTERNAL_THREAD_EVENT_SUSPENDED,
+                                                     NULL);
+    } else if (!on && gvl_hook) {
+        rb_internal_thread_remove_event_hook(gvl_hook);
+        gvl_hook = NULL;
+    }
+#endif
+}
+
+// the hooks that are only needed while slots are running, after a run
+// started or stopped, under the GVL
+void Profiling::update_hooks() {
+    update_alloc_tracepoint();
+    update_fiber_tracepoint();
+    update_gc_tracepoint();
+    update_gvl_hook();
+}
+
+// the GC tracepoint is on while slots are running, if the GC events are
+// allowed, under the GVL
+void Profiling::update_gc_tracepoint() {
+    if (NIL_P(gc_tracepoint)) return;
+
+    bool on = gc_events && running_slots > 0;
+    if (on == RTEST(rb_tracepoint_enabled_p(gc_tracepoint))) return;
+    if (on) {
+        VALUE state = rb_gc_latest_gc_info(sym_state);
+        gc_phases.resume(state == sym_marking, state == sym_sweeping, !NIL_P(rb_gc_latest_gc_info(sym_major_by)));
+        rb_tracepoint_enable(gc_tracepoint);
+    } else {
+        rb_tracepoint_disable(gc_tracepoint);
+    }
+}
+
+// the NEWOBJ tracepoint is on while threads are profiled with an
+// allocation interval, under the GVL
+void Profiling::update_alloc_tracepoint() {
+    if (NIL_P(alloc_tracepoint)) return;
+
+    bool on = alloc_interval > 0 && running_slots > 0;
+    if (on == RTEST(rb_tracepoint_enabled_p(alloc_tracepoint))) return;
+    if (on)
+        rb_tracepoint_enable(alloc_tracepoint);
+    else
+        rb_tracepoint_disable(alloc_tracepoint);
+}
+
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+// Runs in the thread of the event, READY and RESUMED without the GVL,
+// nothing in here may allocate or call into Ruby. Only the thread itself
+// changes its tracker, the encoder only reads the ring.
+void Profiling::gvl_event_hook(rb_event_flag_t event, const rb_internal_thread_event_data_t *event_data,
+                               void *arg) {
+    queue_hooks_job();
+    prof_data_t *data = get_prof_data(false);
+    if (!data || !data->running_p) return;
+
+    long ts = ts_now();
+    GvlInterval interval;
+    bool done;
+    if (event == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED) {
+        done = data->gvl.suspended(ts, interval);
+    } else if (event == RUBY_INTERNAL_THREAD_EVENT_READY) {
+        done = data->gvl.ready(ts, interval);
+    } else {
+        if (data->gvl.current() == GVL_STATE_WAIT) data->stats.gvl_waits.add((ts - data->gvl.since()) * 1000);
+        done = data->gvl.resumed(ts, interval);
+    }
+    if (!done) return;
+
+    interval.run = data->runs;
+    if (!data->gvl_ring.push(interval)) data->stats.gvl_dropped.add();
+}
+#endif
+
+// runs in the job handlers with the time they took
+// The overhead is proportional to the sampling rate. The interval is left
+// alone while the overhead is between 1/2 and all of the budget, otherwise
+// it is set to aim for 3/4 of it. When idle, the overhead drops and the
+// interval goes back down.
+void Profiling::adapt_interval(long spent) {
+    job_ns += spent;
+    job_time.add(spent);
+    if (overhead_budget_ppm == 0 || profiling_shut_down) return;
+
+    long now = monotonic_ns();
+    adapt_window_ns += spent;
+    if (adapt_window_start == 0) adapt_window_start = now;
+    long elapsed = now - adapt_window_start;
+    if (elapsed < ADAPT_WINDOW_NS) return;
+
+    overhead_ppm = adapt_window_ns * 1000000 / elapsed;
+    adapt_window_start = now;
+    adapt_window_ns = 0;
+
+    if (overhead_ppm <= overhead_budget_ppm && overhead_ppm * 2 >= overhead_budget_ppm) return;
+
+    long target = 3 * overhead_budget_ppm / 4;
+    if (target <= 0) return;
+    long interval = (current_interval * overhead_ppm + target - 1) / target;
+    interval = max(min_interval, min(interval, (long)ADAPT_MAX_INTERVAL));
+    if (interval == current_interval) return;
+
+    // the thread CPU timers are re-armed by their threads on their next tick
+    current_interval = interval;
+    if (running_threads > 0 && set_timer(timerid, current_interval) == -1)
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "timer_settime() failed");
+}
+
+// the native stack of the interrupted thread for its next job, see
+// push_native(), pthread_getspecific() doesn't lock in glibc or musl
+static void take_native_stack(void *ucontext) {
+    prof_data_t *data = (prof_data_t *)pthread_getspecific(prof_current_key);
+    if (!data || !data->native || !data->running_p) return;
+    if (data->native_num.load() < 0) return;  // interrupted the job copying the last one
+
+    int num = native_walk(ucontext, data->stack_lo, data->stack_hi, data->native_pcs, NATIVE_MAX_FRAMES);
+    data->native_ns = monotonic_ns();
+    data->native_num.store(num);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // THIS IS THE SIGNAL HANDLER FUNCTION
 // ONLY ASYNC-SAFE FUNCTIONS ALLOWED IN HERE (no exception handling !!!)
@@ -224,75 +1546,221 @@ void Profiling::profiler_gc_handler(void *data) {
 extern "C" void profiler_signal_handler(int sigint, siginfo_t *siginfo, void *ucontext) {
     if (!ruby_native_thread_p()) return;
     static std::atomic_bool in_signal_handler{false};
+    ticks_received++;
 
     // atomically replaces the value of the object, returns the value held previously
     // also keeps in_signal_handler lock_free -> async-safe
-    if (in_signal_handler.exchange(true)) return;
+    if (in_signal_handler.exchange(true)) {
+        ticks_dropped_signal++;
+        return;
+    }
+
+    // clock_gettime() is async-safe, the job handler takes the latency
+    long none = 0;
+    pending_signal_ns.compare_exchange_strong(none, monotonic_ns());
+
+    // the wall clock timer carries &timerid, the thread CPU timers nothing
+    void *tick = (siginfo->si_value.sival_ptr == &timerid) ? WALL_TICK : CPU_TICK;
+
+    // log the wall clock ticks for the job handlers to find the missed ones
+    // in_signal_handler keeps this the only writer
+    if (tick == WALL_TICK) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        unsigned long seq = signal_seq.load(memory_order_relaxed);
+        signal_log[seq % TICK_LOG_SIZE].store(now.tv_sec * 1000000L + now.tv_nsec / 1000, memory_order_relaxed);
+        signal_seq.store(seq + 1, memory_order_release);
+    }
+
+    if (configured_native.load(memory_order_relaxed)) take_native_stack(ucontext);
 
     // the following two ruby c-functions are async safe
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    if (rb_during_gc())
+        rb_postponed_job_trigger(tick == WALL_TICK ? wall_gc_job_handle : cpu_gc_job_handle);
+    else
+        rb_postponed_job_trigger(tick == WALL_TICK ? wall_job_handle : cpu_job_handle);
+#else
     if (rb_during_gc())
     {
-        rb_postponed_job_register(0, Profiling::profiler_gc_handler, (void *)0);
+        rb_postponed_job_register(0, Profiling::profiler_gc_handler, tick);
     } else {
-        rb_postponed_job_register(0, Profiling::profiler_job_handler, (void *)0);
+        rb_postponed_job_register(0, Profiling::profiler_job_handler, tick);
     }
+#endif
 
     in_signal_handler = false;
 }
 
-void Profiling::profiling_start(pid_t tid) {
-    prof_data_map[tid].md = Metadata(Context::get());
-    prof_data_map[tid].prev_num = 0;
-    prof_data_map[tid].omitted_num = 0;
-    prof_data_map[tid].running_p = true;
-
-    Logging::log_profile_entry(prof_data_map[tid].md,
-                               prof_data_map[tid].prof_op_id,
-                               tid,
-                               current_interval);
-
-    if (!running.exchange(true)) {
-        // start timer with interval timer spec
-        struct itimerspec ts;
-        ts.it_interval.tv_sec = 0;
-        ts.it_interval.tv_nsec = current_interval * 1000000;
-        ts.it_value.tv_sec = 0;
-        ts.it_value.tv_nsec = ts.it_interval.tv_nsec;
-
+bool Profiling::profiling_start(prof_data_t *data) {
+    // before the entry record, see encoder_loop()
+    running_slots++;
+
+    VALUE payload[ENTRY_NUM];
+    Metadata md(Context::get());
+    payload[0] = (VALUE)current_interval;
+    data->pushed_interval = current_interval;
+    payload[1] = (VALUE)data->tid;
+    payload[2] = (VALUE)configured_mode;
+    payload[3] = (VALUE)++data->runs;
+    payload[4] = (VALUE)configured_lines;
+    memcpy(&payload[ENTRY_MD_OFFSET], md.metadata(), sizeof(oboe_metadata_t));
+
+    // ticks before this one don't concern this run
+    // without the entry record the encoder can't tell the samples from
+    // the ones of the previous run, the block runs without profiling
+    if (!push_control(data, SampleRing::ENTRY, ts_now(), tick_seq.load(memory_order_acquire),
+                      payload, ENTRY_NUM)) {
+        running_slots--;
+        return false;
+    }
+    data->thread_run_start = data->stats.totals();
+    data->gc_pauses_num = 0;
+    data->gvl.reset(ts_now());
+    data->mode = configured_mode;
+    data->lines = configured_lines;
+    // the bounds of the stack are looked up once, not in the signal handler
+    if (configured_native && data->stack_hi == 0) native_stack_bounds(data->stack_lo, data->stack_hi);
+    data->native = configured_native && data->stack_hi != 0;
+    data->native_num = 0;
+    data->thread = rb_thread_current();
+    data->running_p = true;
+    update_hooks();
+
+    if (data->mode == PROF_MODE_CPU) {
+        start_thread_timer(data);
+    } else if (running_threads.fetch_add(1) == 0) {
         // global timer_t timerid points to timer created in Init_profiling
-        if (timer_settime(timerid, 0, &ts, NULL) == -1) {
+        if (set_timer(timerid, current_interval) == -1) {
             OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "timer_settime() failed");
             shut_down();
         }
     }
+    return true;
 }
 
-VALUE Profiling::profiling_stop(pid_t tid) {
-    if (!running.exchange(false)) return Qfalse;
+// arms the timer with the interval in milliseconds, 0 disarms it
+int Profiling::set_timer(timer_t timer, long interval) {
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = 0;
+    ts.it_interval.tv_nsec = interval * 1000000;
+    ts.it_value.tv_sec = 0;
+    ts.it_value.tv_nsec = ts.it_interval.tv_nsec;
 
-    int result = try_catch_shutdown([&]() {
-        // stop the timer, needs both (value and interval) set to 0
-        struct itimerspec ts;
-        ts.it_value.tv_sec = 0;
-        ts.it_value.tv_nsec = 0;
-        ts.it_interval.tv_sec = 0;
-        ts.it_interval.tv_nsec = 0;
-
-        if (timer_settime(timerid, 0, &ts, NULL) == -1) {
-            OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "timer_settime() failed");
-            shut_down();
-        }
+    return timer_settime(timer, 0, &ts, NULL);
+}
+
+void Profiling::stop_timer() {
+    // stop the timer, needs both (value and interval) set to 0
+    if (set_timer(timerid, 0) == -1) {
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "timer_settime() failed");
+        profiling_shut_down = true;
+    }
+}
+
+// the slot with the CPU timer of the thread, other than data
+static prof_data_t *thread_timer_slot(prof_data_t *data) {
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++) {
+        prof_data_t *other = prof_threads[i];
+        if (other != data && other->cpu_timer_p && other->tid == data->tid && other->running_p) return other;
+    }
+    return nullptr;
+}
+
+// The timer runs on the CPU clock of the calling thread and signals only
+// this thread, a thread waiting for I/O or a lock doesn't get sampled.
+// The postponed job runs in the signalled thread, so every sample has
+// the real frames of the thread. The fibers of a thread share the timer
+// of the first slot that started one.
+void Profiling::start_thread_timer(prof_data_t *data) {
+    if (thread_timer_slot(data)) return;
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = TIMER_SIG;
+    sev.sigev_notify_thread_id = data->tid;
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &data->cpu_timer) == -1) {
+        // only this run goes without samples
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "timer_create() failed for the thread CPU clock");
+        return;
+    }
+    data->cpu_timer_p = true;
+    data->cpu_timer_interval = current_interval;
+
+    if (set_timer(data->cpu_timer, current_interval) == -1) {
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "timer_settime() failed");
+        stop_thread_timer(data);
+    }
+}
+
+// the timer goes to another slot of the thread still profiled in CPU mode
+void Profiling::stop_thread_timer(prof_data_t *data) {
+    if (!data->cpu_timer_p) return;
+    data->cpu_timer_p = false;
+
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++) {
+        prof_data_t *other = prof_threads[i];
+        if (other == data || other->tid != data->tid || !other->running_p || other->mode != PROF_MODE_CPU) continue;
+        other->cpu_timer = data->cpu_timer;
+        other->cpu_timer_interval = data->cpu_timer_interval;
+        other->cpu_timer_p = true;
+        return;
+    }
+    timer_delete(data->cpu_timer);
+}
+
+VALUE Profiling::profiling_stop(prof_data_t *data) {
+    if (!data->running_p.exchange(false)) return Qfalse;
+    data->thread = Qnil;
+    data->fiber = Qnil;
+    if (data->current) {
+        data->current = false;
+        pthread_setspecific(prof_current_key, NULL);
+    }
 
-        Logging::log_profile_exit(prof_data_map[tid].md,
-                                  prof_data_map[tid].prof_op_id,
-                                  tid,
-                                  prof_data_map[tid].omitted,
-                                  prof_data_map[tid].omitted_num);
+    // a sample still waiting for alloc_job() is dropped
+    if (data->alloc_num > 0) {
+        data->alloc_num = 0;
+        alloc_pending--;
+    }
+
+    // the short GVL intervals not reported yet, before the exit record
+    GvlInterval interval;
+    if (data->gvl.flush(interval)) {
+        interval.run = data->runs;
+        if (!data->gvl_ring.push(interval)) data->stats.gvl_dropped.add();
+    }
 
-        prof_data_map[tid].running_p = false;
+    int result = try_catch_shutdown([&]() {
+        // the last thread to leave stops the timer
+        if (data->mode == PROF_MODE_CPU)
+            stop_thread_timer(data);
+        else if (running_threads.fetch_sub(1) == 1)
+            stop_timer();
+
+        // the encoder logs the exit event after flushing the samples
+        // and the ticks handled by other threads up to now
+        // payload: [interval in effect at the end][samples][dropped][cache misses] of the run
+        const RunStats &start = data->thread_run_start;
+        VALUE payload[4] = {(VALUE)current_interval,
+                            (VALUE)(data->stats.samples.get() - start.samples),
+                            (VALUE)(data->stats.samples_dropped.get() - start.samples_dropped),
+                            (VALUE)(data->stats.cache_misses.get() - start.cache_misses)};
+        push_control(data, SampleRing::EXIT, ts_now(), tick_seq.load(memory_order_acquire),
+                     payload, 4);
         return 0; // block needs an int returned
     }, Profiling::string_stop);
 
+    // after the exit record, the encoder waits for it in a shutdown
+    running_slots--;
+    update_hooks();
+
+    // the slot of a fiber is done with the run, the thread keeps its own
+    if (!data->home) data->in_use = false;
     return (result == 0) ? Qtrue : Qfalse;
 }
 
@@ -308,21 +1776,273 @@ VALUE Profiling::get_interval() {
     return INT2FIX(current_interval);
 }
 
+// in percent of one core, 0 turns the adaptive interval off, the smallest
+// budget is ADAPT_MIN_BUDGET_PPM (0.0004%)
+VALUE Profiling::set_overhead_budget(VALUE self, VALUE val) {
+    if (!RB_FLOAT_TYPE_P(val) && !FIXNUM_P(val)) return Qfalse;
+
+    double percent = NUM2DBL(val);
+    if (percent < 0 || percent > 100) return Qfalse;
+    long ppm = (long)(percent * 10000 + 0.5);
+    if (percent > 0 && ppm < ADAPT_MIN_BUDGET_PPM) return Qfalse;
+
+    // adapt from the configured interval, kept across runs after that
+    overhead_budget_ppm = ppm;
+    current_interval = max(configured_interval, min_interval);
+    adapt_window_start = 0;
+    adapt_window_ns = 0;
+    return val;
+}
+
+// :wall or :cpu, applies to the runs started after the call
+VALUE Profiling::set_mode(VALUE self, VALUE val) {
+    if (!SYMBOL_P(val)) return Qfalse;
+
+    ID id = SYM2ID(val);
+    if (id == rb_intern("wall"))
+        configured_mode = PROF_MODE_WALL;
+    else if (id == rb_intern("cpu"))
+        configured_mode = PROF_MODE_CPU;
+    else
+        return Qfalse;
+
+    return val;
+}
+
+VALUE Profiling::get_mode() {
+    return ID2SYM(rb_intern(configured_mode == PROF_MODE_CPU ? "cpu" : "wall"));
+}
+
+// how many of the other threads in wall clock mode get sampled per tick,
+// needs rb_profile_thread_frames() (Ruby 3.3+), always 0 without it
+VALUE Profiling::set_threads_per_tick(VALUE self, VALUE val) {
+    if (!FIXNUM_P(val) || FIX2LONG(val) < 0) return Qfalse;
+
+#ifdef HAVE_RB_PROFILE_THREAD_FRAMES
+    threads_per_tick = min(FIX2LONG(val), (long)MAX_PROF_THREADS);
+#endif
+    return LONG2NUM(threads_per_tick);
+}
+
+VALUE Profiling::set_format(VALUE self, VALUE val) {
+    if (!SYMBOL_P(val)) return Qfalse;
+
+    ID id = SYM2ID(val);
+    if (id == rb_intern("events"))
+        configured_format = PROF_FORMAT_EVENTS;
+    else if (id == rb_intern("pprof"))
+        configured_format = PROF_FORMAT_PPROF;
+    else if (id == rb_intern("collapsed"))
+        configured_format = PROF_FORMAT_COLLAPSED;
+    else
+        return Qfalse;
+
+    return val;
+}
+
+VALUE Profiling::get_format() {
+    switch (configured_format) {
+        case PROF_FORMAT_PPROF:
+            return ID2SYM(rb_intern("pprof"));
+        case PROF_FORMAT_COLLAPSED:
+            return ID2SYM(rb_intern("collapsed"));
+        default:
+            return ID2SYM(rb_intern("events"));
+    }
+}
+
+// also write the events into a ring file in dir, nil stops it
+VALUE Profiling::set_ring_file(VALUE self, VALUE dir, VALUE bytes) {
+    if (NIL_P(dir)) return Logging::open_ring_file("", 0) ? Qtrue : Qfalse;
+    if (!RB_TYPE_P(dir, T_STRING) || !FIXNUM_P(bytes) || FIX2LONG(bytes) <= 0) return Qfalse;
+
+    string path(RSTRING_PTR(dir), RSTRING_LEN(dir));
+    if (!Logging::open_ring_file(path, FIX2LONG(bytes))) {
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "can't open the profiling ring file in %s", path.c_str());
+        return Qfalse;
+    }
+    return rb_str_new_cstr(Logging::ring_file.path().c_str());
+}
+
+// snapshots per event, 0 sends each snapshot in its own event
+VALUE Profiling::set_batch_size(VALUE self, VALUE val) {
+    if (!FIXNUM_P(val) || FIX2LONG(val) < 0) return Qfalse;
+
+    batch_size = FIX2LONG(val);
+    return val;
+}
+
+// longest time a snapshot waits in a batch, in milliseconds
+VALUE Profiling::set_batch_ms(VALUE self, VALUE val) {
+    if (!FIXNUM_P(val) || FIX2LONG(val) <= 0) return Qfalse;
+
+    batch_us = FIX2LONG(val) * 1000;
+    return val;
+}
+
+// the cost of sampling the other threads in wall clock mode
+VALUE Profiling::get_sampling_stats() {
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("threads_per_tick")), LONG2NUM(threads_per_tick));
+    rb_hash_aset(hash, ID2SYM(rb_intern("wall_ticks")), LONG2NUM(wall_ticks));
+    rb_hash_aset(hash, ID2SYM(rb_intern("other_threads_sampled")), LONG2NUM(other_threads_sampled));
+    rb_hash_aset(hash, ID2SYM(rb_intern("other_threads_ns")), LONG2NUM(other_threads_ns));
+    rb_hash_aset(hash, ID2SYM(rb_intern("interval")), LONG2NUM(current_interval));
+    rb_hash_aset(hash, ID2SYM(rb_intern("overhead_budget_ppm")), LONG2NUM(overhead_budget_ppm));
+    rb_hash_aset(hash, ID2SYM(rb_intern("overhead_ppm")), LONG2NUM(overhead_ppm));
+    rb_hash_aset(hash, ID2SYM(rb_intern("job_ns")), LONG2NUM(job_ns));
+    return hash;
+}
+
+// count, sum, max and quantiles in ns, the buckets up to the last one used,
+// bucket i has the durations from 2^(i-1) up to 2^i
+static VALUE histogram_hash(const StatHistogram &hist) {
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("count")), LONG2NUM(hist.count()));
+    rb_hash_aset(hash, ID2SYM(rb_intern("sum_ns")), LONG2NUM(hist.sum()));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max_ns")), LONG2NUM(hist.max()));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p50_ns")), LONG2NUM(hist.quantile(0.5)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p99_ns")), LONG2NUM(hist.quantile(0.99)));
+
+    int last = StatHistogram::BUCKETS - 1;
+    while (last >= 0 && hist.bucket(last) == 0) last--;
+    VALUE buckets = rb_ary_new_capa(last + 1);
+    for (int i = 0; i <= last; i++) rb_ary_push(buckets, LONG2NUM(hist.bucket(i)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("buckets")), buckets);
+    return hash;
+}
+
+// the cost of the profiler itself, process-wide and per thread
+VALUE Profiling::get_stats() {
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("ticks")), LONG2NUM(ticks_received));
+    rb_hash_aset(hash, ID2SYM(rb_intern("ticks_dropped_signal")), LONG2NUM(ticks_dropped_signal));
+    rb_hash_aset(hash, ID2SYM(rb_intern("ticks_dropped_job")), LONG2NUM(ticks_dropped_job));
+    rb_hash_aset(hash, ID2SYM(rb_intern("ticks_missed")), LONG2NUM(ticks_missed));
+    rb_hash_aset(hash, ID2SYM(rb_intern("job_latency")), histogram_hash(job_latency));
+    rb_hash_aset(hash, ID2SYM(rb_intern("job_time")), histogram_hash(job_time));
+    rb_hash_aset(hash, ID2SYM(rb_intern("alloc_interval")), LONG2NUM(alloc_sampler.interval()));
+
+    VALUE threads = rb_ary_new();
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++) {
+        prof_data_t *data = prof_threads[i];
+        if (!data->in_use) continue;
+
+        const ThreadStats &stats = data->stats;
+        VALUE thread = rb_hash_new();
+        rb_hash_aset(thread, ID2SYM(rb_intern("tid")), INT2NUM(data->tid));
+        rb_hash_aset(thread, ID2SYM(rb_intern("running")), data->running_p ? Qtrue : Qfalse);
+        rb_hash_aset(thread, ID2SYM(rb_intern("samples")), LONG2NUM(stats.samples.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("samples_dropped")), LONG2NUM(stats.samples_dropped.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("samples_missed")), LONG2NUM(stats.samples_missed.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("control_dropped")), LONG2NUM(stats.control_dropped.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("cache_misses")), LONG2NUM(stats.cache_misses.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("snapshots")), LONG2NUM(stats.snapshots.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("snapshots_omitted")), LONG2NUM(stats.omitted.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("remove_garbage")), histogram_hash(stats.remove_garbage));
+        rb_hash_aset(thread, ID2SYM(rb_intern("logging")), histogram_hash(stats.logging));
+        rb_hash_aset(thread, ID2SYM(rb_intern("gc_pauses")), histogram_hash(stats.gc_pauses));
+        rb_hash_aset(thread, ID2SYM(rb_intern("alloc_samples")), LONG2NUM(stats.alloc_samples.get()));
+        rb_hash_aset(thread, ID2SYM(rb_intern("gvl_waits")), histogram_hash(stats.gvl_waits));
+        rb_hash_aset(thread, ID2SYM(rb_intern("gvl_dropped")), LONG2NUM(stats.gvl_dropped.get()));
+        rb_ary_push(threads, thread);
+    }
+    rb_hash_aset(hash, ID2SYM(rb_intern("threads")), threads);
+    return hash;
+}
+
+// true adds the stats of each run to its exit event
+VALUE Profiling::set_exit_stats(VALUE self, VALUE val) {
+    exit_stats = RTEST(val);
+    return exit_stats ? Qtrue : Qfalse;
+}
+
+// true measures the GC pauses of the profiled threads, see GcPhases
+VALUE Profiling::set_gc_events(VALUE self, VALUE val) {
+    if (NIL_P(gc_tracepoint)) return Qfalse;  // Ruby without the events
+
+    gc_events = RTEST(val);
+    update_gc_tracepoint();
+    return gc_events ? Qtrue : Qfalse;
+}
+
+// true follows the GVL waits and off-CPU time of the profiled threads,
+// see GvlTracker, Ruby 3.2+
+VALUE Profiling::set_gvl_events(VALUE self, VALUE val) {
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    gvl_events = RTEST(val);
+    update_gvl_hook();
+    return gvl_events ? Qtrue : Qfalse;
+#else
+    return Qfalse;  // Ruby without the thread events
+#endif
+}
+
+// true adds the current line of each frame to the samples of the runs
+// starting from now on, see Profiling::process_snapshot
+VALUE Profiling::set_lines(VALUE self, VALUE val) {
+    configured_lines = RTEST(val);
+    return configured_lines ? Qtrue : Qfalse;
+}
+
+// true sends the ids of the new frames in the snapshots of the runs
+// starting from now on, their info comes once per run in dictionary
+// events, false sends the frames themselves in NewFrames
+VALUE Profiling::set_frame_ids(VALUE self, VALUE val) {
+    configured_frame_ids = RTEST(val);
+    return configured_frame_ids ? Qtrue : Qfalse;
+}
+
+// true adds the native stack below the <cfunc> frame to the samples of the
+// runs starting from now on, false if the platform doesn't support it
+VALUE Profiling::set_native(VALUE self, VALUE val) {
+    configured_native = NATIVE_STACK_SUPPORTED && RTEST(val);
+    return configured_native ? Qtrue : Qfalse;
+}
+
+// on average one in num allocations of the profiled threads is sampled,
+// 0 turns allocation sampling off
+VALUE Profiling::set_alloc_interval(VALUE self, VALUE val) {
+    if (!FIXNUM_P(val) || FIX2LONG(val) < 0) return Qfalse;
+
+    alloc_interval = FIX2LONG(val);
+    alloc_sampler.configure(alloc_interval, ALLOC_BUDGET_PPM);
+    update_alloc_tracepoint();
+    return val;
+}
+
 VALUE Profiling::profiling_run(VALUE self, VALUE rb_thread_val, VALUE interval) {
     rb_need_block();  // checks if function is called with a block in Ruby
     if (profiling_shut_down || OboeProfiling::get_interval() == 0) {
         return rb_yield(Qundef);
     }
 
+    start_encoder();
+    if (profiling_shut_down) return rb_yield(Qundef);
+
     if (FIXNUM_P(interval)) configured_interval = FIX2INT(interval);
-    current_interval = max(configured_interval, (long)OboeProfiling::get_interval());
+    min_interval = OboeProfiling::get_interval();
+    if (overhead_budget_ppm == 0)
+        current_interval = max(configured_interval, min_interval);
+    else  // tuned by adapt_interval()
+        current_interval = max(min_interval, min(current_interval, (long)ADAPT_MAX_INTERVAL));
 
     // !!!!! Can't use try_catch_shutdown() here, MAKES rb_ensure cause a memory leak !!!!!
     try {
-        pid_t tid = AO_GETTID;
-        profiling_start(tid);
+        prof_data_t *data = get_prof_data(true);
+        // no slot left or nested call, the outer call is already profiling
+        if (!data || data->running_p) return rb_yield(Qundef);
+
+        if (!profiling_start(data)) {
+            if (!data->home) data->in_use = false;
+            return rb_yield(Qundef);
+        }
         rb_ensure(reinterpret_cast<VALUE (*)(...)>(rb_yield), Qundef,
-                  reinterpret_cast<VALUE (*)(...)>(profiling_stop), tid);
+                  reinterpret_cast<VALUE (*)(...)>(profiling_stop), (VALUE)data);
         return Qtrue;
     } catch (const std::exception &e) {
         string msg = "Exception in Profiling::profiling_run(), can't recover, profiling shutting down";
@@ -350,10 +2070,37 @@ void Profiling::shut_down() {
     // avoid running any more profiling
     profiling_shut_down = true;
 
-    // stop all profiling, the last one also stops the timer/signals
-    for (pair<const pid_t, prof_data_t> &ele : prof_data_map) {
-        profiling_stop(ele.first);
-    }
+    // stop the signals, threads still inside CProfiler.run wrap up in
+    // profiling_stop() when they leave the block, the encoder sends their
+    // exit events, see encoder_loop(), this may be the encoder thread, so
+    // it must not touch the sample rings
+    // The thread CPU timers are only disarmed, their threads delete them.
+    stop_timer();
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++)
+        if (prof_threads[i]->cpu_timer_p) set_timer(prof_threads[i]->cpu_timer, 0);
+}
+
+// returns a Hash with the size and the counters of the frame cache
+VALUE Profiling::get_frame_cache_stats() {
+    FrameCacheStats stats = Frames::cache_stats();
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("size")), SIZET2NUM(stats.size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(stats.bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("limit")), SIZET2NUM(stats.limit));
+    rb_hash_aset(hash, ID2SYM(rb_intern("names_bytes")), SIZET2NUM(stats.names_bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")), LONG2NUM(stats.hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), LONG2NUM(stats.misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), LONG2NUM(stats.evictions));
+    return hash;
+}
+
+// the memory budget of the frame cache in bytes
+VALUE Profiling::set_frame_cache_limit(VALUE self, VALUE val) {
+    if (!FIXNUM_P(val) || FIX2LONG(val) <= 0) return Qfalse;
+
+    return SIZET2NUM(Frames::set_cache_limit((size_t)FIX2LONG(val)));
 }
 
 VALUE Profiling::getTid() {
@@ -362,23 +2109,52 @@ VALUE Profiling::getTid() {
     return INT2NUM(tid);
 }
 
+// the encoder thread may hold the frame cache lock while another thread
+// forks, the child would inherit it locked
 static void
 prof_atfork_prepare(void) {
-    // cout << "Parent getting ready" << endl;
+    Frames::lock_cached_frames().release();
+    Logging::ring_file.lock_writer();
 }
 
 static void
 prof_atfork_parent(void) {
-    // cout << "Parent let child loose" << endl;
+    Frames::unlock_cached_frames();
+    Logging::ring_file.unlock_writer();
 }
 
 // make sure new processes have a clean slate for profiling
 static void
 prof_atfork_child(void) {
-    // cout << "A child is born" << endl;
+    Frames::unlock_cached_frames();
     Frames::clear_cached_frames();
-    prof_data_map.clear();
-    running = false;
+    Logging::ring_file.unlock_writer();
+    Logging::reopen_ring_file();
+
+    // the other threads didn't make it into the child, their slots are free
+    // and the forking thread has to register again
+    int num = prof_threads_num.load(memory_order_acquire);
+    for (int i = 0; i < num; i++) {
+        // timers are not inherited by the child
+        prof_threads[i]->cpu_timer_p = false;
+        prof_threads[i]->running_p = false;
+        prof_threads[i]->current = false;
+        prof_threads[i]->fiber = Qnil;
+        prof_threads[i]->alloc_num = 0;
+        prof_threads[i]->samples.clear();
+        prof_threads[i]->gvl_ring.clear();
+        prof_threads[i]->in_use = false;
+    }
+    pthread_setspecific(prof_data_key, NULL);
+    pthread_setspecific(prof_current_key, NULL);
+    running_threads = 0;
+    // the allocation and fiber tracepoints stay on until the next run
+    // ends, they can't be changed in here
+    running_slots = 0;
+    alloc_pending = 0;
+
+    // threads don't survive a fork, the next run starts a new encoder
+    encoder_started = false;
 
     // make sure it has a timer ready, it is a per-process-timer
     Profiling::create_timer();
@@ -412,13 +2188,52 @@ void Profiling::create_timer() {
 
 extern "C" void Init_profiling(void) {
     // assign values to global atomic vars that know about state of profiling
-    running = false;
+    running_threads = 0;
     profiling_shut_down = false;
+    prof_threads_num = 0;
+    tick_seq = 0;
+    signal_seq = 0;
+    signal_cursor = 0;
+    encoder_started = false;
 
     // prep data structures
     Profiling::create_sigaction();
     Profiling::create_timer();
     Frames::reserve_cached_frames();
+    Frames::register_gc_marker();
+    new_frames.reserve(BUF_SIZE);
+    pthread_key_create(&prof_data_key, Profiling::prof_data_release);
+    pthread_key_create(&prof_current_key, NULL);
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    if (!preregister_jobs()) {
+        OBOE_DEBUG_LOG_ERROR(OBOE_MODULE_RUBY, "no room for the postponed jobs, profiling disabled");
+        profiling_shut_down = true;
+    }
+#endif
+
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+    // the GC info sets up its symbols on the first call, that must not be in the hook
+    sym_major_by = ID2SYM(rb_intern("major_by"));
+    sym_state = ID2SYM(rb_intern("state"));
+    sym_marking = ID2SYM(rb_intern("marking"));
+    sym_sweeping = ID2SYM(rb_intern("sweeping"));
+    rb_gc_latest_gc_info(sym_major_by);
+    gc_tracepoint = rb_tracepoint_new(0,
+                                      RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_START |
+                                          RUBY_INTERNAL_EVENT_GC_END_MARK | RUBY_INTERNAL_EVENT_GC_END_SWEEP |
+                                          RUBY_INTERNAL_EVENT_GC_EXIT,
+                                      Profiling::gc_event_hook, NULL);
+    rb_gc_register_address(&gc_tracepoint);
+#endif
+
+    alloc_tracepoint = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ | RUBY_INTERNAL_EVENT_FREEOBJ,
+                                         Profiling::alloc_event_hook, NULL);
+    rb_gc_register_address(&alloc_tracepoint);
+
+#ifdef RUBY_EVENT_FIBER_SWITCH
+    fiber_tracepoint = rb_tracepoint_new(0, RUBY_EVENT_FIBER_SWITCH, Profiling::fiber_switch_hook, NULL);
+    rb_gc_register_address(&fiber_tracepoint);
+#endif
 
     // create Ruby Module: SolarWindsAPM::CProfiler
     static VALUE rb_mSolarWindsAPM = rb_define_module("SolarWindsAPM");
@@ -426,8 +2241,28 @@ extern "C" void Init_profiling(void) {
 
     rb_define_singleton_method(rb_mCProfiler, "get_interval", reinterpret_cast<VALUE (*)(...)>(Profiling::get_interval), 0);
     rb_define_singleton_method(rb_mCProfiler, "set_interval", reinterpret_cast<VALUE (*)(...)>(Profiling::set_interval), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_overhead_budget", reinterpret_cast<VALUE (*)(...)>(Profiling::set_overhead_budget), 1);
+    rb_define_singleton_method(rb_mCProfiler, "get_mode", reinterpret_cast<VALUE (*)(...)>(Profiling::get_mode), 0);
+    rb_define_singleton_method(rb_mCProfiler, "set_mode", reinterpret_cast<VALUE (*)(...)>(Profiling::set_mode), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_threads_per_tick", reinterpret_cast<VALUE (*)(...)>(Profiling::set_threads_per_tick), 1);
+    rb_define_singleton_method(rb_mCProfiler, "get_format", reinterpret_cast<VALUE (*)(...)>(Profiling::get_format), 0);
+    rb_define_singleton_method(rb_mCProfiler, "set_format", reinterpret_cast<VALUE (*)(...)>(Profiling::set_format), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_ring_file", reinterpret_cast<VALUE (*)(...)>(Profiling::set_ring_file), 2);
+    rb_define_singleton_method(rb_mCProfiler, "set_batch_size", reinterpret_cast<VALUE (*)(...)>(Profiling::set_batch_size), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_batch_ms", reinterpret_cast<VALUE (*)(...)>(Profiling::set_batch_ms), 1);
+    rb_define_singleton_method(rb_mCProfiler, "sampling_stats", reinterpret_cast<VALUE (*)(...)>(Profiling::get_sampling_stats), 0);
+    rb_define_singleton_method(rb_mCProfiler, "stats", reinterpret_cast<VALUE (*)(...)>(Profiling::get_stats), 0);
+    rb_define_singleton_method(rb_mCProfiler, "set_exit_stats", reinterpret_cast<VALUE (*)(...)>(Profiling::set_exit_stats), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_gc_events", reinterpret_cast<VALUE (*)(...)>(Profiling::set_gc_events), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_alloc_interval", reinterpret_cast<VALUE (*)(...)>(Profiling::set_alloc_interval), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_gvl_events", reinterpret_cast<VALUE (*)(...)>(Profiling::set_gvl_events), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_lines", reinterpret_cast<VALUE (*)(...)>(Profiling::set_lines), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_native", reinterpret_cast<VALUE (*)(...)>(Profiling::set_native), 1);
+    rb_define_singleton_method(rb_mCProfiler, "set_frame_ids", reinterpret_cast<VALUE (*)(...)>(Profiling::set_frame_ids), 1);
     rb_define_singleton_method(rb_mCProfiler, "run", reinterpret_cast<VALUE (*)(...)>(Profiling::profiling_run), 2);
     rb_define_singleton_method(rb_mCProfiler, "get_tid", reinterpret_cast<VALUE (*)(...)>(Profiling::getTid), 0);
+    rb_define_singleton_method(rb_mCProfiler, "frame_cache_stats", reinterpret_cast<VALUE (*)(...)>(Profiling::get_frame_cache_stats), 0);
+    rb_define_singleton_method(rb_mCProfiler, "set_frame_cache_limit", reinterpret_cast<VALUE (*)(...)>(Profiling::set_frame_cache_limit), 1);
 
     pthread_atfork(prof_atfork_prepare,
                    prof_atfork_parent,
@@ -6,19 +6,38 @@
 
 #include <ruby/ruby.h>
 #include <ruby/debug.h>
+#include <ruby/thread.h>
 #include <signal.h>
 #include <time.h>
 
 #include <atomic>
+#include <deque>
 #include <functional>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "alloc_profile.h"
+#include "alloc_sampler.h"
+#include "call_tree.h"
 #include "frames.h"
+#include "gc_phases.h"
+#include "gvl_tracker.h"
+#include "line_keys.h"
 #include "logging.h"
+#include "native_stack.h"
 #include "oboe_api.h"
+#include "pprof.h"
+#include "profiler_stats.h"
+#include "sample_ring.h"
+#include "snapshot_batch.h"
 
 #define BUF_SIZE 2048
+#define MAX_PROF_THREADS 256  // max number of threads and fibers profiled at the same time
+#define TICK_LOG_SIZE 4096    // must be >= the number of ticks a thread can fall behind
+#define GC_PAUSES_MAX 64      // GC pauses of a thread waiting for its stack, the last one takes the rest
+#define GVL_MIN_US 100        // shorter GVL waits and off-CPU intervals only count in the totals
+#define GVL_FLUSH_US 100000   // the totals of the short ones are sent at least this often
 
 // these definitions are based on the assumption that there are no
 // frames with VALUE == 1 or VALUE == 2 in Ruby
@@ -26,6 +45,17 @@
 // if the stack has size == 1 when assuming what these frames refer to
 #define PR_OTHER_THREAD 1
 #define PR_IN_GC 2
+#define PR_GVL_WAIT 3  // from the thread events, see GvlTracker
+#define PR_OFF_CPU 4
+
+// output formats
+#define PROF_FORMAT_EVENTS 0  // snapshot events, one per snapshot or batch
+#define PROF_FORMAT_PPROF 1   // one pprof profile per run
+#define PROF_FORMAT_COLLAPSED 2  // sample counts per unique stack, periodically
+
+// sampling modes
+#define PROF_MODE_WALL 0  // process-wide wall clock timer, idle threads get OTHER THREADS or GVL states
+#define PROF_MODE_CPU 1   // per-thread timer on the thread's CPU clock
 
 #if !defined(AO_GETTID)
      #if defined(_WIN32)
@@ -39,9 +69,105 @@
      #endif
 #endif
 
+// per-thread or per-fiber profiling data, see the registry in profiling.cc
+typedef struct prof_data {
+    // owned by the Ruby thread
+    atomic_bool in_use{false};  // slot is owned by a live thread
+    atomic_bool running_p{false};
+    pid_t tid = 0;
+    VALUE thread = Qnil;        // the Ruby thread, while running
+    VALUE fiber = Qnil;         // the fiber of the run, while running
+    bool home = false;          // the slot of the thread, not of one of its other fibers
+    bool current = false;       // the fiber of the run is the one the thread is running
+    int mode = PROF_MODE_WALL;  // of the current run
+    bool lines = false;         // the samples of the current run carry the line of each frame
+    bool native = false;        // the signal handler takes the native stack in the current run
+    // the timer on the thread's CPU clock in PROF_MODE_CPU
+    timer_t cpu_timer;
+    bool cpu_timer_p = false;
+    long cpu_timer_interval = 0;  // the timer is re-armed when the interval changes
+    // GC pauses of the current run, waiting for the job that takes the stack
+    GcPause gc_pauses[GC_PAUSES_MAX];
+    int gc_pauses_num = 0;
+    // allocation sample waiting for alloc_job()
+    VALUE alloc_frames[BUF_SIZE];
+    int alloc_num = 0;  // frames of the sample, 0 if there is none
+    long alloc_weight = 0;
+    long alloc_ts = 0;
+    VALUE alloc_obj = Qnil;  // nil once it is freed
+    // native stack taken by the signal handler of the thread for its next
+    // job, native_num is 0 while there is none and -1 while the job copies
+    // it, the handler leaves it alone then
+    uintptr_t stack_lo = 0, stack_hi = 0;  // of the thread, 0 if unknown
+    uintptr_t native_pcs[NATIVE_MAX_FRAMES];
+    atomic_int native_num{0};
+    long native_ns = 0;  // monotonic, when it was taken
+    // counts the runs of the thread, the GVL intervals carry the number
+    long runs = 0;
+    long pushed_interval = 0;  // in the last ENTRY or INTERVAL record
+    // GVL waits and off-CPU intervals, written by the thread event hook,
+    // also while the thread doesn't hold the GVL
+    GvlTracker gvl{GVL_MIN_US, GVL_FLUSH_US};
+    GvlRing gvl_ring;
+
+    // raw samples written by the thread itself in the postponed job
+    // and ENTRY/EXIT records written by profiling_start/stop
+    SampleRing samples;
+
+    // owned by the encoder thread, set up from the ENTRY record
+    // the slot may already belong to a new thread while the encoder is
+    // still finishing the run of the previous one
+    pid_t run_tid = 0;
+    int run_mode = PROF_MODE_WALL;
+    bool run_lines = false;
+    long run_interval = 0;  // in effect for the samples, see INTERVAL records
+    bool run_frame_ids = false;     // the snapshots carry frame ids instead of the frames
+    unordered_set<long> dict_sent;  // the frame ids in the dictionary of the run
+    Metadata md = Metadata(Context::get());
+    string prof_op_id;
+    // next tick to look at when catching up on ticks sampled by other threads
+    unsigned long tick_cursor = 0;
+
+    VALUE prev_frames_buffer[BUF_SIZE];
+    int prev_lines_buffer[BUF_SIZE];  // in line mode
+    int prev_num = 0;
+    // native stack waiting for the sample of its tick
+    uintptr_t native_pending[NATIVE_MAX_FRAMES];
+    int native_pending_num = 0;
+    unsigned long native_tick = 0;
+    long omitted[BUF_SIZE];
+    int omitted_num = 0;
+    // batch mode settings of the run and the snapshots not sent yet
+    long run_batch_size = 0;
+    long run_batch_us = 0;
+    SnapshotBatch batch;
+    // pprof and collapsed format, the profile or call tree of the run and
+    // the frame ids of the previous snapshot, leaf first, in line mode the
+    // keys of the frames and their lines instead
+    int run_format = PROF_FORMAT_EVENTS;
+    PprofProfile profile;
+    CallTree tree;
+    vector<long> stack_ids;
+    LineKeys line_keys;
+    // allocation samples of the run per stack
+    AllocProfile allocs;
+    // the GVL intervals of the run not sent yet, and the recent ones for
+    // the catch-up on ticks handled by other threads
+    long run_seq = 0;
+    GvlBatch gvl_batch;
+    deque<GvlInterval> gvl_recent;
+
+    // the cost of profiling the thread, and the totals at the start of the
+    // run, taken by the thread and by the encoder for their own counters
+    ThreadStats stats;
+    RunStats thread_run_start;
+    RunStats encoder_run_start;
+} prof_data_t;
+
 class Profiling {
    public:
-    static const string string_job_handler, string_gc_handler, string_signal_handler, string_stop;
+    static const string string_job_handler, string_gc_handler, string_signal_handler, string_stop, string_encoder,
+        string_gc_stack_job, string_alloc_job;
 
     static void create_sigaction();
     static void create_timer();
@@ -49,6 +175,17 @@ class Profiling {
     static int try_catch_shutdown(std::function<int()>, const string& fun_name);
     static void profiler_job_handler(void* data);
     static void profiler_gc_handler(void* data);
+    static void gc_event_hook(VALUE tpval, void* data);
+    static void gc_stack_job(void* data);
+    static void alloc_event_hook(VALUE tpval, void* data);
+    static void alloc_job(void* data);
+    static void fiber_switch_hook(VALUE tpval, void* data);
+    static void prof_data_release(void* ptr);
+    static void hooks_job(void* data);
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    static void gvl_event_hook(rb_event_flag_t event, const rb_internal_thread_event_data_t* event_data,
+                               void* data);
+#endif
     // This is used when catching an exception
     static void shut_down();
 
@@ -56,21 +193,87 @@ class Profiling {
     static VALUE profiling_run(VALUE self, VALUE rb_thread_val, VALUE interval);
     static VALUE get_interval();
     static VALUE set_interval(VALUE self, VALUE interval);
+    static VALUE set_overhead_budget(VALUE self, VALUE percent);
+    static VALUE get_mode();
+    static VALUE set_mode(VALUE self, VALUE mode);
+    static VALUE set_threads_per_tick(VALUE self, VALUE num);
+    static VALUE get_format();
+    static VALUE set_format(VALUE self, VALUE format);
+    static VALUE set_ring_file(VALUE self, VALUE dir, VALUE bytes);
+    static VALUE set_batch_size(VALUE self, VALUE num);
+    static VALUE set_batch_ms(VALUE self, VALUE ms);
+    static VALUE get_sampling_stats();
+    static VALUE get_stats();
+    static VALUE set_exit_stats(VALUE self, VALUE val);
+    static VALUE set_gc_events(VALUE self, VALUE val);
+    static VALUE set_alloc_interval(VALUE self, VALUE num);
+    static VALUE set_gvl_events(VALUE self, VALUE val);
+    static VALUE set_lines(VALUE self, VALUE val);
+    static VALUE set_native(VALUE self, VALUE val);
+    static VALUE set_frame_ids(VALUE self, VALUE val);
     static VALUE getTid();
+    static VALUE get_frame_cache_stats();
+    static VALUE set_frame_cache_limit(VALUE self, VALUE bytes);
 
    private:
-    static void profiling_start(pid_t tid);
+    friend struct ProfilingInternals;  // for the benchmarks
+
+    static prof_data_t* get_prof_data(bool create);
+    static bool profiling_start(prof_data_t* data);
+    static int set_timer(timer_t timer, long interval);
+    static void stop_timer();
+    static void start_thread_timer(prof_data_t* data);
+    static void stop_thread_timer(prof_data_t* data);
 
     // This is used via rb_ensure and therefore needs VALUE as a return type
-    static VALUE profiling_stop(pid_t tid);
+    static VALUE profiling_stop(prof_data_t* data);
 
     static void process_snapshot(VALUE* frames_buffer,
                                  int num,
-                                 pid_t tid,
-                                 long ts);
-    static void profiler_record_frames();
-    static void profiler_record_gc();
-    static void send_omitted(pid_t tid, long ts);
+                                 prof_data_t* data,
+                                 long ts,
+                                 int* lines = NULL);
+    static void profiler_record_frames(bool wall_tick);
+    static void profiler_record_gc(bool wall_tick);
+    static void push_sample(prof_data_t* data, long ts, unsigned long tick, int num);
+    static void push_interval(prof_data_t* data, long ts, unsigned long tick);
+    static void push_native(prof_data_t* data, long ts, unsigned long tick);
+    static int add_native(prof_data_t* data, VALUE* frames_buffer, int num, int* lines);
+    static int reconcile_signals(long ts);
+    static void push_missed(prof_data_t* data, unsigned long tick, int num);
+    static void process_missed(prof_data_t* data, const long* payload, int num);
+    static void process_gc(prof_data_t* data, VALUE* payload, int num);
+    static void process_alloc(prof_data_t* data, VALUE* payload, int num, long ts);
+    static void send_allocs(prof_data_t* data);
+    static void update_alloc_tracepoint();
+    static void update_fiber_tracepoint();
+    static void update_gc_tracepoint();
+    static void update_gvl_hook();
+    static void update_hooks();
+    static prof_data_t* fiber_prof_data(VALUE fiber);
+    static void take_gvl(prof_data_t* data);
+    static VALUE gvl_frame(prof_data_t* data, long ts);
+    static void send_gvl(prof_data_t* data);
+    static void sample_other_threads(prof_data_t* data, long ts, unsigned long tick);
+    static unsigned long record_tick(long ts);
+    static unsigned long next_tick(bool wall_tick, long ts);
+    static void adapt_interval(long spent);
+    static void catch_up_ticks(prof_data_t* data, unsigned long upto);
+    static bool push_control(prof_data_t* data, int kind, long ts, unsigned long tick,
+                             const VALUE* payload, int num);
+    static void drain_samples(prof_data_t* data);
+    static void start_encoder();
+    static void* encoder_loop(void* arg);
+    static void take_frame_dict(prof_data_t* data, VALUE* frames_buffer, int num);
+    static void send_frame_dict(prof_data_t* data);
+    static void send_omitted(prof_data_t* data, long ts);
+    static void batch_snapshot(prof_data_t* data, long ts, int num_new, int num_exited, int num);
+    static void send_batch(prof_data_t* data);
+    static void profile_snapshot(prof_data_t* data, VALUE* frames_buffer, long ts,
+                                 int num_new, int num_exited, int num);
+    static void send_profile(prof_data_t* data, long ts);
+    static void send_tree(prof_data_t* data);
+    static bool tree_due(prof_data_t* data, long ts);
 };
 
 extern "C" void Init_profiling(void);
@@ -0,0 +1,167 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#include "ring_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+using namespace std;
+
+static const char MAGIC[8] = {'S', 'W', 'P', 'R', 'I', 'N', 'G', '\0'};
+
+struct RingFile::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t count;
+    uint64_t seq;
+    uint64_t pid;
+};
+
+bool RingFile::open(const string &path, size_t size) {
+    static_assert(sizeof(Header) <= HEADER_SIZE, "ring file header too large");
+
+    lock_guard<mutex> guard(lock);
+    if (map) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+
+    size = max(size, (size_t)MIN_SIZE) & ~(size_t)7;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    // allocate the blocks now, no surprises when the pages are written back
+    if (ftruncate(fd, size) != 0 || posix_fallocate(fd, 0, size) != 0) {
+        ::close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    map = (char *)mem;
+    map_size = size;
+    file_path = path;
+
+    Header *h = header();
+    memcpy(h->magic, MAGIC, sizeof(MAGIC));
+    h->version = VERSION;
+    h->header_size = HEADER_SIZE;
+    h->capacity = size - HEADER_SIZE;
+    h->head = h->tail = h->count = h->seq = 0;
+    h->pid = getpid();
+    return true;
+}
+
+void RingFile::close() {
+    lock_guard<mutex> guard(lock);
+    if (!map) return;
+    munmap(map, map_size);
+    map = NULL;
+    map_size = 0;
+}
+
+// tail is always at a record or at the end marker while count > 0
+void RingFile::drop_oldest() {
+    Header *h = header();
+    uint32_t len = 0;
+    if (h->tail + sizeof(len) <= h->capacity) memcpy(&len, data() + h->tail, sizeof(len));
+
+    if (len == 0) {  // end marker or end of the area
+        h->tail = 0;
+        return;
+    }
+    h->tail += len;
+    if (h->tail >= h->capacity) h->tail = 0;
+    h->count--;
+}
+
+bool RingFile::append(const char *payload, size_t len) {
+    size_t need = (RECORD_HEADER_SIZE + len + 7) & ~(size_t)7;
+
+    lock_guard<mutex> guard(lock);
+    if (!map) return false;
+    Header *h = header();
+    if (need > h->capacity) return false;
+
+    if (h->head + need > h->capacity) {
+        // the rest of the area stays unused, the records there are dropped
+        while (h->count > 0 && h->tail >= h->head) drop_oldest();
+        if (h->capacity - h->head >= sizeof(uint32_t)) memset(data() + h->head, 0, sizeof(uint32_t));
+        h->head = 0;
+    }
+    while (h->count > 0 && h->tail >= h->head && h->tail < h->head + need) drop_oldest();
+    if (h->count == 0) h->tail = h->head;
+
+    // the record first, then the header, readers never see half a record
+    char *rec = data() + h->head;
+    uint32_t rec_len = (uint32_t)need;
+    uint32_t reserved = 0;
+    uint64_t seq = h->seq;
+    memcpy(rec, &rec_len, sizeof(rec_len));
+    memcpy(rec + 4, &reserved, sizeof(reserved));
+    memcpy(rec + 8, &seq, sizeof(seq));
+    memcpy(rec + RECORD_HEADER_SIZE, payload, len);
+    atomic_thread_fence(memory_order_release);
+
+    h->head += need;
+    if (h->head >= h->capacity) h->head = 0;
+    h->count++;
+    h->seq++;
+    return true;
+}
+
+bool RingFile::read(const string &path,
+                    const function<void(uint64_t seq, const char *payload, size_t len)> &fn) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+        ::close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    const char *file = (const char *)mem;
+    Header h;
+    memcpy(&h, file, sizeof(h));
+    bool ok = memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 && h.version == VERSION &&
+              h.header_size + h.capacity <= (uint64_t)st.st_size;
+
+    const char *area = file + h.header_size;
+    uint64_t offset = h.tail;
+    for (uint64_t i = 0; ok && i < h.count;) {
+        uint32_t len = 0;
+        if (offset + sizeof(len) <= h.capacity) memcpy(&len, area + offset, sizeof(len));
+        if (len == 0) {
+            offset = 0;
+            continue;
+        }
+        if (len < RECORD_HEADER_SIZE || offset + len > h.capacity) {
+            ok = false;  // corrupt
+            break;
+        }
+        uint64_t seq;
+        memcpy(&seq, area + offset + 8, sizeof(seq));
+        fn(seq, area + offset + RECORD_HEADER_SIZE, len - RECORD_HEADER_SIZE);
+        offset += len;
+        if (offset >= h.capacity) offset = 0;
+        i++;
+    }
+
+    munmap(mem, st.st_size);
+    return ok;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef RING_FILE_H
+#define RING_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+// Fixed size file, memory mapped, that keeps the most recent records
+//
+// Writing a record is a memcpy into the mapping, the kernel writes the
+// pages back in its own time, so appending never waits for I/O. The
+// header is updated after each record, the file can be read while the
+// process is running or after it crashed.
+//
+// Layout, all integers in native byte order:
+//   header (HEADER_SIZE bytes)
+//     char     magic[8]   "SWPRING\0"
+//     uint32_t version
+//     uint32_t header_size
+//     uint64_t capacity   bytes of the data area
+//     uint64_t head       offset where the next record goes
+//     uint64_t tail       offset of the oldest record
+//     uint64_t count      number of records in the file
+//     uint64_t seq        number of records ever written
+//     uint64_t pid
+//   data area (capacity bytes)
+//     records, each: uint32_t len (header and payload, multiple of 8),
+//     uint32_t reserved, uint64_t seq, payload
+//     a len of 0 means the rest of the area is unused, continue at 0
+//
+// Old records are dropped to make room for new ones. Records are never
+// split, a record that doesn't fit at the end starts over at offset 0.
+class RingFile {
+   public:
+    enum : uint32_t { VERSION = 1 };
+    enum : size_t {
+        HEADER_SIZE = 64,
+        RECORD_HEADER_SIZE = 16,
+        MIN_SIZE = 64 * 1024,
+    };
+
+    RingFile() : map(NULL), map_size(0) {}
+    ~RingFile() { close(); }
+
+    // creates or truncates the file, size includes the header
+    bool open(const std::string &path, size_t size);
+    void close();
+    bool is_open() const { return map != NULL; }
+    const std::string &path() const { return file_path; }
+
+    // false if the record is larger than the file
+    bool append(const char *payload, size_t len);
+
+    // for fork(), the child must not inherit a locked writer
+    void lock_writer() { lock.lock(); }
+    void unlock_writer() { lock.unlock(); }
+
+    // calls fn for every record in the file at path, oldest first,
+    // for reading the file back in the tests
+    static bool read(const std::string &path,
+                     const std::function<void(uint64_t seq, const char *payload, size_t len)> &fn);
+
+   private:
+    struct Header;
+
+    Header *header() const { return (Header *)map; }
+    char *data() const { return map + HEADER_SIZE; }
+    void drop_oldest();
+
+    std::mutex lock;
+    std::string file_path;
+    char *map;
+    size_t map_size;
+};
+
+#endif  // RING_FILE_H
@@ -0,0 +1,137 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <ruby/ruby.h>
+
+#include <atomic>
+#include <cstddef>
+
+// Single-producer/single-consumer ring of variable length sample records.
+//
+// Every profiled thread owns one ring. The producer is the thread itself
+// (from within the postponed job or CProfiler.run), the consumer is the
+// encoder thread. Records are stored contiguously as
+//   [header][timestamp][tick][frame 0] ... [frame num-1]
+// in a preallocated array of words, so pushing a sample is a memcpy and
+// never allocates.
+class SampleRing {
+   public:
+    enum Kind {
+        PAD = 0,     // filler at the end of the buffer, skip to the start
+        SAMPLE = 1,  // frames captured by rb_profile_frames()
+        ENTRY = 2,   // start of a profiling run
+        EXIT = 3,    // end of a profiling run
+        MISSED = 4,  // ticks that didn't get a sample, see the signal log
+        GC = 5,      // GC pauses of the thread and its stack after them
+        ALLOC = 6,   // an allocation sample
+        NATIVE = 7,  // native stack of the sample of the same tick, see native_stack.h
+        INTERVAL = 8,  // the interval of the samples after it, when it changed during the run
+    };
+
+    struct Record {
+        int kind;
+        int num;
+        long ts;
+        unsigned long tick;  // sequence number of the timer tick
+        const VALUE *frames;  // points into the ring, valid until pop()
+    };
+
+    // power of 2, in words, big enough for a few snapshots of BUF_SIZE frames
+    static const size_t CAPACITY = 1 << 14;
+    // kept free by all other records, so that the ENTRY and EXIT of a run
+    // fit in even when the consumer has fallen behind
+    static const size_t CONTROL_RESERVE = 128;
+
+    SampleRing() : head(0), tail(0) {}
+
+    // producer side
+    // returns false and drops the sample if the consumer has fallen behind
+    bool push(int kind, long ts, unsigned long tick, const VALUE *frames, int num) {
+        size_t size = HEADER_SIZE + num;
+        size_t reserve = (kind == ENTRY || kind == EXIT) ? 0 : CONTROL_RESERVE;
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t pos = h & MASK;
+        size_t to_end = CAPACITY - pos;
+
+        // records never wrap, pad the remainder and start over at 0
+        size_t needed = (size > to_end) ? to_end + size : size;
+        if (size > CAPACITY || CAPACITY - (h - t) < needed + reserve) return false;
+
+        if (size > to_end) {
+            buf[pos] = make_header(PAD, 0);
+            h += to_end;
+            pos = 0;
+        }
+
+        buf[pos] = make_header(kind, num);
+        buf[pos + 1] = (VALUE)ts;
+        buf[pos + 2] = (VALUE)tick;
+        for (int i = 0; i < num; i++)
+            buf[pos + HEADER_SIZE + i] = frames[i];
+
+        head.store(h + size, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side
+    // returns false if there is no record available
+    bool peek(Record &rec) {
+        size_t t = tail.load(std::memory_order_relaxed);
+
+        while (t != head.load(std::memory_order_acquire)) {
+            size_t pos = t & MASK;
+            VALUE header = buf[pos];
+
+            if (header_kind(header) == PAD) {
+                t += CAPACITY - pos;
+                tail.store(t, std::memory_order_release);
+                continue;
+            }
+
+            rec.kind = header_kind(header);
+            rec.num = header_num(header);
+            rec.ts = (long)buf[pos + 1];
+            rec.tick = (unsigned long)buf[pos + 2];
+            rec.frames = &buf[pos + HEADER_SIZE];
+            return true;
+        }
+        return false;
+    }
+
+    // releases the record returned by the last peek()
+    void pop(const Record &rec) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        tail.store(t + HEADER_SIZE + rec.num, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+    // only safe when neither side is active, e.g. in the child after fork
+    void clear() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+   private:
+    static const size_t MASK = CAPACITY - 1;
+    static const size_t HEADER_SIZE = 3;  // header + timestamp + tick
+
+    static VALUE make_header(int kind, int num) {
+        return ((VALUE)num << 8) | (VALUE)(kind & 0xff);
+    }
+    static int header_kind(VALUE header) { return (int)(header & 0xff); }
+    static int header_num(VALUE header) { return (int)(header >> 8); }
+
+    VALUE buf[CAPACITY];
+    // indices grow monotonically, the position in buf is index & MASK
+    std::atomic<size_t> head;  // written by the producer
+    std::atomic<size_t> tail;  // written by the consumer
+};
+
+#endif  // SAMPLE_RING_H
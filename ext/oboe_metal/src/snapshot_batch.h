@@ -0,0 +1,71 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef SNAPSHOT_BATCH_H
+#define SNAPSHOT_BATCH_H
+
+#include <cstddef>
+#include <vector>
+
+// Columnar buffer for the snapshots of one thread
+//
+// In batch mode the encoder collects the snapshots of a run here and sends
+// them as one event with a column per field, instead of one event each.
+// Snapshot i is timestamps[i], exited[i], counts[i] and the next
+// new_counts[i] ids of new_ids, in line mode new_lines has the line of
+// each of the new frames. Unchanged snapshots only add their
+// timestamp to omitted, they repeat the stack of the latest snapshot
+// before them, the same as in the single snapshot events.
+//
+// The vectors keep their capacity when cleared, no allocations once a
+// thread has sent its first few batches.
+class SnapshotBatch {
+   public:
+    SnapshotBatch() : start(0) {}
+
+    void add(long ts, const long *ids, int num_new, long num_exited, long num_frames,
+             const long *lines = NULL) {
+        if (empty()) start = ts;
+        timestamps.push_back(ts);
+        exited.push_back(num_exited);
+        counts.push_back(num_frames);
+        new_counts.push_back(num_new);
+        new_ids.insert(new_ids.end(), ids, ids + num_new);
+        if (lines) new_lines.insert(new_lines.end(), lines, lines + num_new);
+    }
+
+    void add_omitted(long ts) {
+        if (empty()) start = ts;
+        omitted.push_back(ts);
+    }
+
+    // number of snapshots, not counting the omitted ones
+    size_t size() const { return timestamps.size(); }
+    bool empty() const { return timestamps.empty() && omitted.empty(); }
+
+    // timestamp of the first snapshot, only valid if not empty
+    long first_ts() const { return start; }
+
+    void clear() {
+        timestamps.clear();
+        exited.clear();
+        counts.clear();
+        new_counts.clear();
+        new_ids.clear();
+        new_lines.clear();
+        omitted.clear();
+    }
+
+    std::vector<long> timestamps;
+    std::vector<long> exited;
+    std::vector<long> counts;
+    std::vector<long> new_counts;
+    std::vector<long> new_ids;
+    std::vector<long> new_lines;
+    std::vector<long> omitted;
+
+   private:
+    long start;
+};
+
+#endif  // SNAPSHOT_BATCH_H
@@ -0,0 +1,121 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef STRING_ARENA_H
+#define STRING_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Append-only storage for the names in the frame cache
+//
+// Every distinct string is stored once, NUL-terminated, in one contiguous
+// buffer and referenced by its offset. File paths and class names repeat
+// across many frames, they only take up space once, and a frame only
+// carries three 4 byte refs instead of three std::strings.
+//
+// Pointers returned by str() are only valid until the next intern(), the
+// buffer may grow. Strings are never removed, the owner rebuilds the
+// arena with only the strings still in use when too much of it is dead.
+class StringArena {
+   public:
+    typedef uint32_t Ref;
+
+    // ref of the empty string, always available
+    enum : Ref { EMPTY = 0 };
+
+    StringArena() { clear(); }
+
+    Ref intern(const char *str, size_t len) {
+        if (len == 0) return EMPTY;
+        if ((num + 1) * 2 > slots.size()) resize(slots.size() * 2);
+
+        uint32_t h = hash(str, len);
+        size_t i = h & mask;
+        while (slots[i] != EMPTY) {
+            Ref ref = slots[i];
+            if (hashes[i] == h && strncmp(&chars[ref], str, len) == 0 && chars[ref + len] == '\0')
+                return ref;
+            i = (i + 1) & mask;
+        }
+
+        Ref ref = (Ref)chars.size();
+        chars.insert(chars.end(), str, str + len);
+        chars.push_back('\0');
+        slots[i] = ref;
+        hashes[i] = h;
+        num++;
+        return ref;
+    }
+
+    Ref intern(const std::string &str) { return intern(str.data(), str.size()); }
+
+    const char *str(Ref ref) const { return &chars[ref]; }
+
+    // number of distinct strings
+    size_t count() const { return num; }
+    // bytes used by the strings
+    size_t size() const { return chars.size(); }
+    // bytes allocated
+    size_t memsize() const {
+        return chars.capacity() + slots.capacity() * (sizeof(Ref) + sizeof(uint32_t));
+    }
+
+    // releases the memory
+    void clear() {
+        std::vector<char>(1, '\0').swap(chars);  // the empty string at EMPTY
+        std::vector<Ref>(MIN_SLOTS, (Ref)EMPTY).swap(slots);
+        std::vector<uint32_t>(MIN_SLOTS).swap(hashes);
+        mask = MIN_SLOTS - 1;
+        num = 0;
+    }
+
+    void swap(StringArena &other) {
+        chars.swap(other.chars);
+        slots.swap(other.slots);
+        hashes.swap(other.hashes);
+        std::swap(mask, other.mask);
+        std::swap(num, other.num);
+    }
+
+   private:
+    static const size_t MIN_SLOTS = 64;
+
+    // FNV-1a
+    static uint32_t hash(const char *str, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char)str[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    void resize(size_t size) {
+        std::vector<Ref> old_slots(size, (Ref)EMPTY);
+        std::vector<uint32_t> old_hashes(size);
+        old_slots.swap(slots);
+        old_hashes.swap(hashes);
+        mask = size - 1;
+
+        for (size_t j = 0; j < old_slots.size(); j++) {
+            if (old_slots[j] == EMPTY) continue;
+            size_t i = old_hashes[j] & mask;
+            while (slots[i] != EMPTY) i = (i + 1) & mask;
+            slots[i] = old_slots[j];
+            hashes[i] = old_hashes[j];
+        }
+    }
+
+    std::vector<char> chars;
+    std::vector<Ref> slots;  // open addressing set of the interned strings
+    std::vector<uint32_t> hashes;
+    size_t mask;
+    size_t num;
+};
+
+#endif  // STRING_ARENA_H
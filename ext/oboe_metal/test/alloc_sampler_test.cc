@@ -0,0 +1,91 @@
+#include "../src/alloc_sampler.h"
+
+#include "../src/alloc_profile.h"
+#include "gtest/gtest.h"
+
+TEST(AllocSampler, off) {
+    AllocSampler sampler;
+    sampler.configure(0, 0);
+    for (int i = 0; i < 100000; i++) ASSERT_EQ(0, sampler.sample());
+}
+
+TEST(AllocSampler, every_allocation) {
+    AllocSampler sampler;
+    sampler.configure(1, 0);
+    for (int i = 0; i < 1000; i++) ASSERT_EQ(1, sampler.sample());
+}
+
+// the weights add up to the allocations, the gaps average the interval
+TEST(AllocSampler, weights) {
+    AllocSampler sampler;
+    sampler.configure(100, 0);
+
+    long samples = 0, weights = 0, last = 0;
+    for (long i = 1; i <= 1000000; i++) {
+        long weight = sampler.sample();
+        if (weight == 0) continue;
+        EXPECT_EQ(i - last, weight);
+        last = i;
+        samples++;
+        weights += weight;
+    }
+    EXPECT_EQ(last, weights);
+    EXPECT_NEAR(10000, samples, 500);
+}
+
+// doubles over the budget, back to the configured interval when idle
+TEST(AllocSampler, budget) {
+    AllocSampler sampler;
+    sampler.configure(64, 10000);  // 1%
+    long now = 1000;
+
+    // 2% in each window
+    for (int i = 0; i < 3; i++) {
+        sampler.spent(0, now);
+        now += AllocSampler::WINDOW_NS;
+        sampler.spent(AllocSampler::WINDOW_NS / 50, now);
+    }
+    EXPECT_EQ(64 * 8, sampler.interval());
+
+    // 0.5% stays
+    now += AllocSampler::WINDOW_NS;
+    sampler.spent(AllocSampler::WINDOW_NS / 200, now);
+    EXPECT_EQ(64 * 8, sampler.interval());
+
+    for (int i = 0; i < 5; i++) {
+        now += AllocSampler::WINDOW_NS;
+        sampler.spent(0, now);
+    }
+    EXPECT_EQ(64, sampler.interval());
+}
+
+TEST(AllocProfile, stacks) {
+    AllocProfile profile;
+    EXPECT_TRUE(profile.empty());
+
+    long a[] = {3, 2, 1};
+    long b[] = {4, 1};
+    profile.add(a, 3, 10, 400, 100);
+    profile.add(b, 2, 5, 5000, 200);
+    profile.add(a, 3, 20, 800, 300);
+
+    EXPECT_EQ(2u, profile.size());
+    EXPECT_EQ(3, profile.samples());
+    EXPECT_EQ(100, profile.first_ts());
+
+    vector<long> num_frames, ids, counts, bytes;
+    profile.columns(num_frames, ids, counts, bytes);
+    ASSERT_EQ(2u, num_frames.size());
+    EXPECT_EQ(5u, ids.size());
+
+    // in no particular order
+    int i = num_frames[0] == 3 ? 0 : 1;
+    EXPECT_EQ(30, counts[i]);
+    EXPECT_EQ(1200, bytes[i]);
+    EXPECT_EQ(5, counts[1 - i]);
+    EXPECT_EQ(5000, bytes[1 - i]);
+
+    profile.clear();
+    EXPECT_TRUE(profile.empty());
+    EXPECT_EQ(0, profile.samples());
+}
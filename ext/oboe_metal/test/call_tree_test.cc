@@ -0,0 +1,112 @@
+#include "../src/call_tree.h"
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+static FrameData frame(const char *klass, const char *method) {
+    FrameData data;
+    data.klass = klass;
+    data.method = method;
+    return data;
+}
+
+// the lines of the collapsed output, sorted
+static std::vector<std::string> collapsed(const CallTree &tree) {
+    std::string out;
+    tree.collapse(out);
+    std::vector<std::string> lines;
+    std::istringstream in(out);
+    for (std::string line; std::getline(in, line);) lines.push_back(line);
+    std::sort(lines.begin(), lines.end());
+    return lines;
+}
+
+TEST(CallTree, counts_per_stack) {
+    CallTree tree;
+    EXPECT_TRUE(tree.empty());
+
+    tree.set_name(1, frame("", "<main>"));
+    tree.set_name(2, frame("App", "call"));
+    tree.set_name(3, frame("User", "save"));
+    tree.set_name(4, frame("User", "validate"));
+
+    // innermost first
+    long a[] = {3, 2, 1};
+    long b[] = {4, 3, 2, 1};
+    long c[] = {2, 1};
+    tree.add(a, 3, 100);
+    tree.add_repeat(110);
+    tree.add(b, 4, 120);
+    tree.add(a, 3, 130);
+    tree.add(c, 2, 140);
+    tree.add(b, 4, 150);
+
+    EXPECT_EQ(6, tree.samples());
+    EXPECT_EQ(4u, tree.size());  // shared outer frames are one node
+    EXPECT_EQ(100, tree.first_ts());
+
+    std::vector<std::string> expected = {
+        "<main>;App#call 1",
+        "<main>;App#call;User#save 3",
+        "<main>;App#call;User#save;User#validate 2",
+    };
+    EXPECT_EQ(expected, collapsed(tree));
+}
+
+TEST(CallTree, different_callers) {
+    CallTree tree;
+
+    // the same method called from two places is two nodes
+    long a[] = {3, 2, 1};
+    long b[] = {3, 5, 1};
+    tree.add(a, 3, 0);
+    tree.add(b, 3, 0);
+    tree.add(a, 3, 0);
+    EXPECT_EQ(5u, tree.size());
+
+    // frames without a name show their id
+    std::vector<std::string> expected = {"1;2;3 2", "1;5;3 1"};
+    EXPECT_EQ(expected, collapsed(tree));
+}
+
+TEST(CallTree, clear_counts) {
+    CallTree tree;
+    tree.set_name(1, frame("", "main"));
+
+    long a[] = {1};
+    tree.add(a, 1, 100);
+    tree.add(NULL, 0, 110);  // empty stack, not in the output
+    EXPECT_EQ(2, tree.samples());
+    EXPECT_EQ((std::vector<std::string>{"main 1"}), collapsed(tree));
+
+    tree.clear_counts();
+    EXPECT_TRUE(tree.empty());
+    EXPECT_EQ(0u, tree.size());
+    EXPECT_TRUE(collapsed(tree).empty());
+    EXPECT_TRUE(tree.has_name(1));
+
+    tree.add(a, 1, 200);
+    EXPECT_EQ(200, tree.first_ts());
+    EXPECT_EQ((std::vector<std::string>{"main 1"}), collapsed(tree));
+
+    tree.clear();
+    EXPECT_FALSE(tree.has_name(1));
+}
+
+TEST(CallTree, line_names) {
+    CallTree tree;
+    tree.set_name(0, frame("", "main"), 3);
+    tree.set_name(1, frame("App", "call"), 10);
+    tree.set_name(2, frame("App", "call"), 12);
+
+    long a[] = {1, 0};
+    long b[] = {2, 0};
+    tree.add(a, 2, 100);
+    tree.add(b, 2, 110);
+    tree.add(b, 2, 120);
+    EXPECT_EQ((std::vector<std::string>{"main:3;App#call:10 1", "main:3;App#call:12 2"}), collapsed(tree));
+}
@@ -0,0 +1,30 @@
+#include <ruby/ruby.h>
+
+#include "gtest/gtest.h"
+#include "oboe_api.h"
+
+#ifndef FAKE_OBOE_API
+#error "the e2e tests need fake_oboe/oboe_api.h, see the e2eTests target"
+#endif
+
+extern "C" void Init_profiling(void);
+
+int main(int argc, char **argv) {
+    int state = -1;
+
+    // order important! init ruby before adding functions!
+    RUBY_INIT_STACK;
+    ruby_init();
+    {
+        const char *opts[] = {"ruby", "-e", ""};
+        ruby_options(3, (char **)opts);
+    }
+    Init_profiling();
+
+    ::testing::InitGoogleTest(&argc, argv);
+
+    state = RUN_ALL_TESTS();
+
+    ruby_cleanup(0);
+    return state;
+}
@@ -0,0 +1,223 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#include "oboe_api.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+using namespace std;
+
+static mutex events_mutex;
+static vector<FakeEvent> sent_events;
+static atomic_int min_interval{10};
+static atomic_long errors{0};
+static atomic_ulong op_seq{0};
+
+static string hex(const uint8_t *bytes, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    string out;
+    for (size_t i = 0; i < len; i++) {
+        out.push_back(digits[bytes[i] >> 4]);
+        out.push_back(digits[bytes[i] & 0xf]);
+    }
+    return out;
+}
+
+// unique per process, good enough to tell the events apart
+static void new_op_id(uint8_t *op_id) {
+    unsigned long seq = ++op_seq;
+    memcpy(op_id, &seq, sizeof(seq));
+}
+
+/////////////////////// FakeEvent /////////////////////////////
+
+bool FakeEvent::has(const string &key) const {
+    return longs.count(key) || strings.count(key) || arrays.count(key) || frames.count(key);
+}
+
+long FakeEvent::num(const string &key) const {
+    auto it = longs.find(key);
+    return it == longs.end() ? 0 : it->second;
+}
+
+string FakeEvent::str(const string &key) const {
+    auto it = strings.find(key);
+    return it == strings.end() ? "" : it->second;
+}
+
+vector<long> FakeEvent::array(const string &key) const {
+    auto it = arrays.find(key);
+    return it == arrays.end() ? vector<long>() : it->second;
+}
+
+/////////////////////// FakeOboe /////////////////////////////
+
+vector<FakeEvent> FakeOboe::events() {
+    lock_guard<mutex> guard(events_mutex);
+    return sent_events;
+}
+
+size_t FakeOboe::num_events() {
+    lock_guard<mutex> guard(events_mutex);
+    return sent_events.size();
+}
+
+void FakeOboe::clear() {
+    lock_guard<mutex> guard(events_mutex);
+    sent_events.clear();
+}
+
+void FakeOboe::send(const FakeEvent &event) {
+    lock_guard<mutex> guard(events_mutex);
+    sent_events.push_back(event);
+}
+
+void FakeOboe::set_interval(int interval) {
+    min_interval = interval;
+}
+
+int FakeOboe::interval() {
+    return min_interval;
+}
+
+void FakeOboe::log_error(const char *format, ...) {
+    errors++;
+    va_list args;
+    va_start(args, format);
+    fputs("oboe error: ", stderr);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+long FakeOboe::num_errors() {
+    return errors;
+}
+
+/////////////////////// Metadata and Context /////////////////////////////
+
+Metadata::Metadata(const oboe_metadata_t *md) {
+    memcpy(static_cast<oboe_metadata_t *>(this), md, sizeof(oboe_metadata_t));
+}
+
+Metadata::Metadata(const Metadata *md) {
+    memcpy(static_cast<oboe_metadata_t *>(this), static_cast<const oboe_metadata_t *>(md),
+           sizeof(oboe_metadata_t));
+}
+
+// W3C traceparent, like the X-Trace of current liboboe versions
+string Metadata::toString() const {
+    return "00-" + hex(task_id, sizeof(task_id)) + "-" + hex(op_id, sizeof(op_id)) +
+           (flags & 1 ? "-01" : "-00");
+}
+
+static thread_local bool context_set = false;
+static thread_local oboe_metadata_t context;
+
+Metadata *Context::get() {
+    if (!context_set) {
+        memset(&context, 0, sizeof(context));
+        context.version = 1;
+        context.flags = 1;
+        new_op_id(context.task_id);
+        new_op_id(context.op_id);
+        context_set = true;
+    }
+    static thread_local Metadata md(&context);
+    md = Metadata(&context);
+    return &md;
+}
+
+void Context::set(const Metadata &md) {
+    memcpy(&context, static_cast<const oboe_metadata_t *>(&md), sizeof(context));
+    context_set = true;
+}
+
+void Context::clear() {
+    context_set = false;
+}
+
+/////////////////////// Event /////////////////////////////
+
+Event::Event(const oboe_metadata_t *trace) {
+    memcpy(&md, trace, sizeof(md));
+    new_op_id(md.op_id);
+}
+
+Event *Event::startTrace(const oboe_metadata_t *md) {
+    return new Event(md);
+}
+
+bool Event::addInfo(char *key, const string &val) {
+    record.strings[key] = val;
+    return true;
+}
+
+bool Event::addInfo(char *key, long val) {
+    record.longs[key] = val;
+    return true;
+}
+
+bool Event::addInfo(char *key, double val) {
+    record.longs[key] = (long)val;
+    return true;
+}
+
+bool Event::addInfo(char *key, bool val) {
+    record.longs[key] = val;
+    return true;
+}
+
+bool Event::addInfo(char *key, const long *vals, int num) {
+    record.arrays[key] = vector<long>(vals, vals + num);
+    return true;
+}
+
+bool Event::addInfo(char *key, const vector<FrameData> &vals) {
+    record.frames[key] = vals;
+    return true;
+}
+
+bool Event::addEdge(oboe_metadata_t *edge) {
+    record.edges.push_back(hex(edge->op_id, sizeof(edge->op_id)));
+    return true;
+}
+
+bool Event::addContextOpId(oboe_metadata_t *ctx) {
+    record.strings["ContextOpId"] = hex(ctx->op_id, sizeof(ctx->op_id));
+    return true;
+}
+
+bool Event::addSpanRef(oboe_metadata_t *span) {
+    record.strings["SpanRef"] = hex(span->op_id, sizeof(span->op_id));
+    return true;
+}
+
+bool Event::addProfileEdge(string id) {
+    record.edges.push_back(id);
+    return true;
+}
+
+bool Event::addHostname() {
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    record.strings["Hostname"] = host;
+    return true;
+}
+
+string Event::metadataString() const {
+    return Metadata(&md).toString();
+}
+
+string Event::opIdString() const {
+    return hex(md.op_id, sizeof(md.op_id));
+}
+
+bool Event::sendProfiling() {
+    FakeOboe::send(record);
+    return true;
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2021 SolarWinds, LLC.
+// All rights reserved.
+
+#ifndef OBOE_API_H
+#define OBOE_API_H
+
+// Stand-in for the part of liboboe's oboe_api.h the profiler uses
+//
+// Nothing is sent anywhere, Event::sendProfiling() appends the event to
+// FakeOboe, where the tests read it back. Builds the profiler sources
+// without downloading liboboe, see the e2eTests target. The real header
+// is copied into src/ at install, the target builds a copy of src/ without
+// it, "oboe_api.h" is looked up next to the source file first.
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define FAKE_OBOE_API 1
+
+#define OBOE_MODULE_RUBY 0
+#define OBOE_DEBUG_LOG_ERROR(module, ...) FakeOboe::log_error(__VA_ARGS__)
+#define OBOE_DEBUG_LOG_WARNING(module, ...) ((void)0)
+#define OBOE_DEBUG_LOG_HIGH(module, ...) ((void)0)
+#define AO_GETPID getpid
+
+typedef struct oboe_metadata {
+    uint8_t version;
+    uint8_t task_id[16];
+    uint8_t op_id[8];
+    uint8_t flags;
+} oboe_metadata_t;
+
+struct FrameData {
+    std::string method;
+    std::string klass;
+    std::string file;
+    int lineno = 0;
+};
+
+// the KVs of a sent event
+struct FakeEvent {
+    std::map<std::string, long> longs;
+    std::map<std::string, std::string> strings;
+    std::map<std::string, std::vector<long> > arrays;
+    std::map<std::string, std::vector<FrameData> > frames;
+    std::vector<std::string> edges;
+
+    bool has(const std::string &key) const;
+    // 0 and "" if missing
+    long num(const std::string &key) const;
+    std::string str(const std::string &key) const;
+    std::vector<long> array(const std::string &key) const;
+};
+
+class FakeOboe {
+   public:
+    static std::vector<FakeEvent> events();
+    static size_t num_events();
+    static void clear();
+
+    // the minimum interval of OboeProfiling::get_interval(), 0 disables profiling
+    static void set_interval(int interval);
+    static int interval();
+
+    static void log_error(const char *format, ...);
+    static long num_errors();
+
+   private:
+    friend class Event;
+    static void send(const FakeEvent &event);
+};
+
+class Event;
+
+class Metadata : private oboe_metadata_t {
+    friend class Context;
+    friend class Event;
+
+   public:
+    Metadata(const oboe_metadata_t *md);
+    Metadata(const Metadata *md);
+
+    oboe_metadata_t *metadata() { return this; }
+    bool isValid() const { return version != 0; }
+    bool isSampled() const { return flags & 1; }
+    std::string toString() const;
+};
+
+class Context {
+   public:
+    // the trace context of the calling thread, a new trace if none was set
+    static Metadata *get();
+    static void set(const Metadata &md);
+    static void clear();
+};
+
+class Event {
+   public:
+    static Event *startTrace(const oboe_metadata_t *md);
+
+    bool addInfo(char *key, const std::string &val);
+    bool addInfo(char *key, long val);
+    bool addInfo(char *key, double val);
+    bool addInfo(char *key, bool val);
+    bool addInfo(char *key, const long *vals, int num);
+    bool addInfo(char *key, const std::vector<FrameData> &vals);
+
+    bool addEdge(oboe_metadata_t *md);
+    bool addContextOpId(oboe_metadata_t *md);
+    bool addSpanRef(oboe_metadata_t *md);
+    bool addProfileEdge(std::string id);
+    bool addHostname();
+
+    std::string metadataString() const;
+    std::string opIdString() const;
+
+    bool sendProfiling();
+
+   private:
+    Event(const oboe_metadata_t *md);
+
+    oboe_metadata_t md;
+    FakeEvent record;
+};
+
+class OboeProfiling {
+   public:
+    static int get_interval() { return FakeOboe::interval(); }
+};
+
+#endif  // OBOE_API_H
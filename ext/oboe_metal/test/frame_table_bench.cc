@@ -0,0 +1,99 @@
+// Microbenchmark: frame cache lookups as done by Frames::remove_garbage()
+//
+// compares the previous std::unordered_map<VALUE, FrameData> access pattern
+// (count() + operator[] + copying the method name) with a single probe
+// into FrameTable and its flags, for 500, 5k and 50k cached frames
+//
+// build the frameTableBench target and run it, no Ruby VM needed
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../src/frame_table.h"
+
+struct BenchFrameData {
+    std::string method;
+    std::string klass;
+    std::string file;
+    int lineno = 0;
+};
+
+static const int LOOKUPS = 5000000;
+static const int STACK_DEPTH = 100;
+
+static double ns_per_lookup(std::chrono::steady_clock::time_point start, long lookups) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / lookups;
+}
+
+static void bench(size_t num_frames) {
+    std::mt19937_64 rng(42);
+    // distinct addresses like the ones of Ruby objects, in random order
+    std::vector<VALUE> frames;
+    for (size_t i = 0; i < num_frames; i++)
+        frames.push_back((VALUE)(0x7f0000000000 + i * 40));
+    std::shuffle(frames.begin(), frames.end(), rng);
+
+    std::unordered_map<VALUE, BenchFrameData> map;
+    map.reserve(500);
+    FrameTable table;
+    table.reserve(500);
+    for (size_t i = 0; i < frames.size(); i++) {
+        BenchFrameData data;
+        data.method = (i % 5 == 0) ? "block in method_" + std::to_string(i) : "method_" + std::to_string(i);
+        data.file = "/app/models/file_" + std::to_string(i % 100) + ".rb";
+        data.lineno = (int)(i % 7);
+        map[frames[i]] = data;
+        table.insert(frames[i], (long)i, (data.lineno == 0 ? FrameTable::NO_LINENO : 0) |
+                                             (i % 5 == 0 ? FrameTable::BLOCK : 0));
+    }
+
+    // synthetic stacks, frames of a stack are likely close to each other
+    std::vector<VALUE> lookups;
+    while (lookups.size() < (size_t)LOOKUPS) {
+        size_t base = rng() % frames.size();
+        for (int j = 0; j < STACK_DEPTH; j++)
+            lookups.push_back(frames[(base + rng() % 50) % frames.size()]);
+    }
+
+    long hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (VALUE frame : lookups) {
+        if (map.count(frame) == 1) {
+            if (map[frame].lineno == 0) hits++;
+        }
+        if (map.count(frame) == 0) continue;
+        std::string method = map[frame].method;
+        if (method.rfind("block ", 0) == 0) hits++;
+    }
+    double map_ns = ns_per_lookup(start, lookups.size());
+
+    long table_hits = 0;
+    start = std::chrono::steady_clock::now();
+    for (VALUE frame : lookups) {
+        long slot = table.find(frame);
+        if (slot < 0) continue;
+        uint8_t flags = table.flags(slot);
+        if (flags & FrameTable::NO_LINENO) table_hits++;
+        if (flags & FrameTable::BLOCK) table_hits++;
+    }
+    double table_ns = ns_per_lookup(start, lookups.size());
+
+    std::cout << num_frames << " frames:\t"
+              << "unordered_map " << map_ns << " ns/frame\t"
+              << "FrameTable " << table_ns << " ns/frame\t"
+              << "speedup " << map_ns / table_ns << "x"
+              << (hits == table_hits ? "" : "\t(results differ!)") << std::endl;
+}
+
+int main() {
+    bench(500);
+    bench(5000);
+    bench(50000);
+    return 0;
+}
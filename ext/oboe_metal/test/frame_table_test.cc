@@ -0,0 +1,102 @@
+#include "../src/frame_table.h"
+
+#include <unordered_map>
+
+#include "gtest/gtest.h"
+#include "ruby/ruby.h"
+
+TEST(FrameTable, insert_and_find) {
+    FrameTable table;
+
+    EXPECT_EQ(-1, table.find((VALUE)0x1000));
+    EXPECT_EQ(0u, table.count((VALUE)0x1000));
+
+    long slot = table.insert((VALUE)0x1000, 5, FrameTable::BLOCK);
+    EXPECT_EQ(slot, table.find((VALUE)0x1000));
+    EXPECT_EQ(5, table.id(slot));
+    EXPECT_EQ(FrameTable::BLOCK, table.flags(slot));
+    EXPECT_EQ(1u, table.size());
+    EXPECT_EQ(1u, table.count((VALUE)0x1000));
+
+    table.clear();
+    EXPECT_EQ(0u, table.size());
+    EXPECT_EQ(-1, table.find((VALUE)0x1000));
+}
+
+// 0 marks the empty slots, it is never found and never inserted
+TEST(FrameTable, frame_zero) {
+    FrameTable table;
+
+    EXPECT_EQ(-1, table.find((VALUE)0));
+    EXPECT_EQ(-1, table.insert((VALUE)0, 5, 0));
+    EXPECT_EQ(0u, table.size());
+
+    table.insert((VALUE)0x1000, 5, 0);
+    EXPECT_EQ(-1, table.find((VALUE)0));
+    EXPECT_EQ(0u, table.count((VALUE)0));
+}
+
+TEST(FrameTable, grows_and_keeps_entries) {
+    FrameTable table;
+    std::unordered_map<VALUE, long> expected;
+
+    // addresses like the ones of Ruby objects, 40 bytes apart
+    for (long i = 0; i < 50000; i++) {
+        VALUE frame = (VALUE)(0x7f0000000000 + i * 40);
+        table.insert(frame, i, (uint8_t)(i % 4));
+        expected[frame] = i;
+    }
+
+    EXPECT_EQ(expected.size(), table.size());
+    EXPECT_GE(table.capacity(), 2 * table.size()) << "load factor above 1/2";
+
+    for (auto &ele : expected) {
+        long slot = table.find(ele.first);
+        ASSERT_LE(0, slot);
+        EXPECT_EQ(ele.second, table.id(slot));
+        EXPECT_EQ(ele.second % 4, table.flags(slot));
+    }
+    EXPECT_EQ(-1, table.find((VALUE)0x10));
+}
+
+TEST(FrameTable, reserve) {
+    FrameTable table;
+    table.reserve(500);
+    size_t capacity = table.capacity();
+    EXPECT_LE(1000u, capacity);
+
+    for (long i = 0; i < 500; i++)
+        table.insert((VALUE)(0x1000 + i * 8), i, 0);
+    EXPECT_EQ(capacity, table.capacity()) << "should not grow within the reserved size";
+}
+
+TEST(FrameTable, erase) {
+    FrameTable table;
+    std::unordered_map<VALUE, long> expected;
+
+    // erase every third frame, the others have to stay reachable
+    // even if they were placed behind an erased one
+    for (long i = 0; i < 5000; i++) {
+        VALUE frame = (VALUE)(0x7f0000000000 + i * 40);
+        table.insert(frame, i, 0, i * 2);
+        expected[frame] = i;
+    }
+    for (long i = 0; i < 5000; i += 3) {
+        VALUE frame = (VALUE)(0x7f0000000000 + i * 40);
+        table.erase(table.find(frame));
+        expected.erase(frame);
+    }
+
+    EXPECT_EQ(expected.size(), table.size());
+    for (long i = 0; i < 5000; i++) {
+        VALUE frame = (VALUE)(0x7f0000000000 + i * 40);
+        long slot = table.find(frame);
+        if (i % 3 == 0) {
+            EXPECT_EQ(-1, slot);
+        } else {
+            ASSERT_LE(0, slot);
+            EXPECT_EQ(i, table.id(slot));
+            EXPECT_EQ(i * 2, table.ref(slot));
+        }
+    }
+}
@@ -3,6 +3,8 @@
 #include <string.h>
 
 #include <algorithm>
+#include <set>
+#include <unordered_set>
 
 #include "../src/profiling.h"
 #include "../src/frames.h"
@@ -11,7 +13,7 @@
 #include "ruby/ruby.h"
 #include "test.h"
 
-extern unordered_map<VALUE, FrameData> cached_frames;
+extern FrameTable cached_frames;
 
 static VALUE test_frames[BUF_SIZE];
 static int test_lines[BUF_SIZE];
@@ -35,25 +37,28 @@ void Init_RubyCallsFrames() {
 
 TEST(Frames, reserve_cached_frames) {
     // it should only reserve once used during init
-    // unordered_map grows automatically
-    cached_frames.clear();
+    // the frame table grows automatically
+    Frames::clear_cached_frames();
 
     Frames::reserve_cached_frames();
-    int bucket_count = cached_frames.bucket_count();
+    size_t capacity = cached_frames.capacity();
+    EXPECT_LE(1000u, capacity);
 
     Frames::reserve_cached_frames();
-    EXPECT_EQ(bucket_count, cached_frames.bucket_count());
+    EXPECT_EQ(capacity, cached_frames.capacity());
 }
 
 TEST(Frames, collect_frame_data) {
     rb_eval_string("TestMe::Snapshot::all_kinds");
 
+    Frames::cache_frames(test_frames, test_num);
     int num = Frames::remove_garbage(test_frames, test_num);
 
     vector<FrameData> data;
     // Ruby 3 reports a <cfunc>, before the "take_snapshot" method
     // we have to adjust the index of the trace we are checking
     int i = ruby_version == 2 ? 0 : 1;
+    ASSERT_LE(i + 1, num) << "remove_garbage dropped the frames checked below";
     Frames::collect_frame_data(test_frames, i + 1, data);
 
     EXPECT_EQ("take_snapshot", data[i].method) << "method name incorrect";
@@ -64,10 +69,96 @@ TEST(Frames, collect_frame_data) {
     EXPECT_EQ(7, data[i].lineno) << "line number incorrect";
 }
 
+TEST(Frames, collect_frame_ids) {
+    Frames::clear_cached_frames();
+    rb_eval_string("TestMe::Snapshot::all_kinds");
+
+    Frames::cache_frames(test_frames, test_num);
+    int num = Frames::remove_garbage(test_frames, test_num);
+
+    vector<long> ids;
+    long max_id = Frames::collect_frame_ids(test_frames, num, ids);
+    ASSERT_EQ(num, (int)ids.size());
+    EXPECT_LT(max_id, Frames::next_frame_id());
+
+    // the dictionary of a run has each frame once, with the same info as
+    // collect_frame_data(), frames the run has sent already are left out
+    vector<long> dict_ids;
+    vector<FrameData> dict_data;
+    unordered_set<long> sent;
+    Frames::collect_frame_dict(test_frames, num, sent, dict_ids, dict_data);
+    ASSERT_EQ(dict_ids.size(), dict_data.size());
+    EXPECT_EQ(set<long>(ids.begin(), ids.end()).size(), dict_ids.size());
+    EXPECT_EQ(dict_ids.size(), sent.size());
+
+    vector<FrameData> data;
+    Frames::collect_frame_data(test_frames, num, data);
+    for (int i = 0; i < num; i++) {
+        auto it = find(dict_ids.begin(), dict_ids.end(), ids[i]);
+        ASSERT_TRUE(it != dict_ids.end()) << "frame id not in the dictionary";
+        FrameData &entry = dict_data[it - dict_ids.begin()];
+        EXPECT_EQ(data[i].method, entry.method);
+        EXPECT_EQ(data[i].klass, entry.klass);
+        EXPECT_EQ(data[i].file, entry.file);
+        EXPECT_EQ(data[i].lineno, entry.lineno);
+    }
+
+    dict_ids.clear();
+    dict_data.clear();
+    Frames::collect_frame_dict(test_frames, num, sent, dict_ids, dict_data);
+    EXPECT_TRUE(dict_ids.empty());
+
+    // the next run sends them again
+    sent.clear();
+    Frames::collect_frame_dict(test_frames, num, sent, dict_ids, dict_data);
+    EXPECT_EQ(sent.size(), dict_ids.size());
+
+    // the pseudo frames have entries of their own
+    VALUE gvl_wait[1] = {PR_GVL_WAIT};
+    dict_ids.clear();
+    dict_data.clear();
+    Frames::collect_frame_dict(gvl_wait, 1, sent, dict_ids, dict_data);
+    ASSERT_EQ(1u, dict_ids.size());
+    EXPECT_EQ(FRAME_ID_GVL_WAIT, dict_ids[0]);
+    EXPECT_EQ("GVL WAIT", dict_data[0].method);
+
+    // pseudo frames have fixed ids
+    VALUE other[1] = {PR_OTHER_THREAD};
+    ids.clear();
+    EXPECT_EQ(FRAME_ID_OTHER_THREAD, Frames::collect_frame_ids(other, 1, ids));
+    VALUE gc[1] = {PR_IN_GC};
+    ids.clear();
+    EXPECT_EQ(FRAME_ID_IN_GC, Frames::collect_frame_ids(gc, 1, ids));
+    VALUE off_cpu[1] = {PR_OFF_CPU};
+    ids.clear();
+    EXPECT_EQ(FRAME_ID_OFF_CPU, Frames::collect_frame_ids(off_cpu, 1, ids));
+    EXPECT_EQ(1, Frames::remove_garbage(off_cpu, 1));
+}
+
+TEST(Frames, frame_flags) {
+    rb_eval_string("TestMe::Snapshot::all_kinds");
+    Frames::cache_frames(test_frames, test_num);
+
+    // the flags must agree with the frame info
+    vector<FrameData> data;
+    Frames::collect_frame_data(test_frames, test_num, data);
+    for (int i = 0; i < test_num; i++) {
+        long slot = cached_frames.find(test_frames[i]);
+        ASSERT_LE(0, slot) << "frame not cached";
+        uint8_t flags = cached_frames.flags(slot);
+
+        bool block = data[i].method.rfind("block ", 0) == 0;
+        EXPECT_EQ(block, (flags & FrameTable::BLOCK) != 0) << data[i].method;
+        EXPECT_EQ(data[i].file == "<cfunc>", (flags & FrameTable::CFUNC) != 0) << data[i].method;
+        EXPECT_EQ(data[i].lineno == 0, (flags & FrameTable::NO_LINENO) != 0) << data[i].method;
+    }
+}
+
 TEST(Frames, remove_garbage) {
     // run some Ruby code and get a snapshot
     rb_eval_string("TestMe::Snapshot::all_kinds");
 
+    Frames::cache_frames(test_frames, test_num);
     int num = Frames::remove_garbage(test_frames, test_num);
 
     int expected = (ruby_version == 2) ? 7 : 9;
@@ -90,6 +181,67 @@ TEST(Frames, remove_garbage) {
                 << "not all repeated frames were removed";
 }
 
+// the previous O(n^2) implementation of step 2 in remove_garbage(),
+// remove_repeated() has to produce exactly the same output
+static int remove_repeated_reference(VALUE *frames_buffer, int num) {
+    int count = 0;
+    int k = 0;
+    bool found = false;
+    while (count < num - k) {
+        for (int j = count + k + 1; j < num; j++) {
+            if (frames_buffer[count] == frames_buffer[j]) {
+                found = true;
+                break;
+            }
+        }
+
+        if (found) {
+            k++;
+            if (count + k < num - 1) frames_buffer[count] = frames_buffer[count + k];
+        } else {
+            count++;
+            frames_buffer[count] = frames_buffer[count + k];
+        }
+        found = false;
+    }
+    return count;
+}
+
+TEST(Frames, remove_repeated) {
+    // the reference reads one past the end
+    static VALUE expected[BUF_SIZE + 1];
+    static VALUE actual[BUF_SIZE];
+    srand(42);
+
+    for (int run = 0; run < 500; run++) {
+        int num = rand() % BUF_SIZE + 1;
+        // few distinct frames make for lots of repetition, like recursion
+        int distinct = rand() % 2 ? rand() % 20 + 1 : rand() % 2000 + 1;
+        for (int i = 0; i < num; i++)
+            expected[i] = actual[i] = (VALUE)(0x1000 + (rand() % distinct) * 40);
+
+        int expected_num = remove_repeated_reference(expected, num);
+        int actual_num = Frames::remove_repeated(actual, num);
+
+        ASSERT_EQ(expected_num, actual_num) << "run " << run;
+        for (int i = 0; i < expected_num; i++)
+            ASSERT_EQ(expected[i], actual[i]) << "run " << run << ", frame " << i;
+    }
+
+    // corner cases
+    VALUE none[1];
+    EXPECT_EQ(0, Frames::remove_repeated(none, 0));
+
+    VALUE same[4] = {(VALUE)8, (VALUE)8, (VALUE)8, (VALUE)8};
+    EXPECT_EQ(1, Frames::remove_repeated(same, 4));
+    EXPECT_EQ((VALUE)8, same[0]);
+
+    VALUE abab[4] = {(VALUE)8, (VALUE)16, (VALUE)8, (VALUE)16};
+    EXPECT_EQ(2, Frames::remove_repeated(abab, 4));
+    EXPECT_EQ((VALUE)8, abab[0]);
+    EXPECT_EQ((VALUE)16, abab[1]);
+}
+
 TEST(Frames, num_matching) {
     VALUE a[BUF_SIZE];
     VALUE b[BUF_SIZE];
@@ -138,12 +290,105 @@ TEST(Frames, num_matching) {
         << "* different length, frames matching from the end";
 }
 
+// the lines move along with the frames they belong to
+TEST(Frames, remove_repeated_lines) {
+    VALUE frames[5] = {(VALUE)8, (VALUE)16, (VALUE)8, (VALUE)24, (VALUE)16};
+    int lines[5] = {1, 2, 3, 4, 5};
+    ASSERT_EQ(3, Frames::remove_repeated(frames, 5, lines));
+    EXPECT_EQ((VALUE)8, frames[0]);
+    EXPECT_EQ(3, lines[0]);
+    EXPECT_EQ((VALUE)24, frames[1]);
+    EXPECT_EQ(4, lines[1]);
+    EXPECT_EQ((VALUE)16, frames[2]);
+    EXPECT_EQ(5, lines[2]);
+}
+
+TEST(Frames, num_matching_lines) {
+    VALUE a[3] = {(VALUE)11, (VALUE)12, (VALUE)13};
+    VALUE b[3] = {(VALUE)11, (VALUE)12, (VALUE)13};
+    int a_lines[3] = {5, 6, 7};
+    int b_lines[3] = {5, 6, 7};
+    EXPECT_EQ(3, Frames::num_matching(a, 3, b, 3, a_lines, b_lines));
+
+    // the same frames, the middle one moved on
+    b_lines[1] = 9;
+    EXPECT_EQ(1, Frames::num_matching(a, 3, b, 3, a_lines, b_lines));
+    EXPECT_EQ(3, Frames::num_matching(a, 3, b, 3));
+
+    b_lines[1] = 6;
+    b_lines[0] = 9;
+    EXPECT_EQ(2, Frames::num_matching(a, 3, b, 3, a_lines, b_lines));
+}
+
+// native frames go under the innermost <cfunc> frame, with their own ids
+// and dictionary entries, the lines move along
+TEST(Frames, native_frames) {
+    Frames::clear_cached_frames();
+
+    FrameData ruby, cfunc, native;
+    ruby.method = "work";
+    ruby.file = "work.rb";
+    ruby.lineno = 3;
+    cfunc.method = "query";
+    cfunc.file = "<cfunc>";
+    native.method = "PQexec";
+    native.file = "/usr/lib/libpq.so.5";
+
+    VALUE frames[6] = {(VALUE)0x1000, (VALUE)0x2000, (VALUE)0x3000, (VALUE)0x4000};
+    int lines[6] = {0, 5, 0, 7};
+    VALUE natives[2] = {(VALUE)0x7f0011, (VALUE)0x7f0021};
+    unique_lock<mutex> guard = Frames::lock_cached_frames();
+    Frames::add_frame(frames[0], cfunc, FrameTable::CFUNC | FrameTable::NO_LINENO);
+    Frames::add_frame(frames[1], ruby, 0);
+    Frames::add_frame(frames[2], cfunc, FrameTable::CFUNC | FrameTable::NO_LINENO);
+    Frames::add_frame(frames[3], ruby, 0);
+    Frames::cache_native_frame(natives[0], native);
+    Frames::cache_native_frame(natives[1], native);
+    Frames::cache_native_frame(natives[0], native);  // only once
+
+    ASSERT_EQ(6, Frames::splice_native(frames, 4, natives, 2, lines, BUF_SIZE));
+    EXPECT_EQ(natives[0], frames[0]);
+    EXPECT_EQ(natives[1], frames[1]);
+    EXPECT_EQ((VALUE)0x1000, frames[2]);
+    EXPECT_EQ((VALUE)0x4000, frames[5]);
+    EXPECT_EQ(0, lines[1]);
+    EXPECT_EQ(5, lines[3]);
+    EXPECT_EQ(7, lines[5]);
+    EXPECT_EQ(6, Frames::remove_garbage(frames, 6, lines));
+
+    vector<long> ids;
+    Frames::collect_frame_ids(frames, 6, ids);
+    EXPECT_EQ(ids[0] + 1, ids[1]);
+    EXPECT_NE(FRAME_ID_OTHER_THREAD, ids[0]);
+    vector<FrameData> data;
+    Frames::collect_frame_data(frames, 2, data);
+    EXPECT_EQ("PQexec", data[0].method);
+    EXPECT_EQ("/usr/lib/libpq.so.5", data[1].file);
+
+    vector<long> dict_ids;
+    vector<FrameData> dict_data;
+    unordered_set<long> sent;
+    Frames::collect_frame_dict(frames, 6, sent, dict_ids, dict_data);
+    ASSERT_EQ(6u, dict_ids.size());
+    EXPECT_EQ(ids[1], dict_ids[1]);
+    EXPECT_EQ("PQexec", dict_data[1].method);
+
+    // no <cfunc> frame, under the leaf, and never more than max
+    VALUE ruby_only[3] = {(VALUE)0x4000};
+    EXPECT_EQ(3, Frames::splice_native(ruby_only, 1, natives, 2, NULL, BUF_SIZE));
+    EXPECT_EQ(natives[0], ruby_only[0]);
+    EXPECT_EQ((VALUE)0x4000, ruby_only[2]);
+    VALUE full[2] = {(VALUE)0x1000, (VALUE)0x4000};
+    EXPECT_EQ(2, Frames::splice_native(full, 2, natives, 2, NULL, 2));
+    EXPECT_EQ(natives[1], full[1]);
+}
+
 TEST(Frames, cached_frames) {
-    cached_frames.clear();
+    Frames::clear_cached_frames();
     // run some Ruby code and get a snapshot
     rb_eval_string("TestMe::Snapshot::all_kinds");
 
-    Frames::remove_garbage(test_frames, test_num);
+    Frames::cache_frames(test_frames, test_num);
 
     // Check the expected size
     int expected = (ruby_version == 2) ? 8 : 10;
@@ -155,10 +400,74 @@ TEST(Frames, cached_frames) {
 
     // repeat
     rb_eval_string("TestMe::Snapshot::all_kinds");
-    Frames::remove_garbage(test_frames, test_num);
+    Frames::cache_frames(test_frames, test_num);
 
     expected = (ruby_version == 2) ? 9 : 11;
     EXPECT_EQ(expected, cached_frames.size());  // +1 for an extra main frame
     for (int i = 0; i < test_num; i++)
         EXPECT_EQ(1, cached_frames.count(test_frames[i]));
 }
+
+TEST(Frames, frame_cache_limit) {
+    Frames::clear_cached_frames();
+    rb_eval_string("TestMe::Snapshot::all_kinds");
+    Frames::cache_frames(test_frames, test_num);
+
+    FrameCacheStats stats = Frames::cache_stats();
+    EXPECT_EQ(cached_frames.size(), stats.size);
+    EXPECT_EQ(FRAME_CACHE_LIMIT, stats.limit);
+    EXPECT_LT(0, stats.misses);
+    EXPECT_LT(0u, stats.bytes);
+    EXPECT_EQ(0, stats.evictions);
+
+    Frames::cache_frames(test_frames, test_num);
+    EXPECT_EQ(stats.hits + test_num, Frames::cache_stats().hits);
+
+    // the limit can't be set lower than the minimum, the frames still fit
+    EXPECT_EQ((size_t)FRAME_CACHE_MIN_LIMIT, Frames::set_cache_limit(1));
+    EXPECT_EQ(0, Frames::cache_stats().evictions);
+    for (int i = 0; i < test_num; i++)
+        EXPECT_EQ(1, cached_frames.count(test_frames[i]));
+
+    // many more fake frames than fit, the ones not hit again get evicted
+    // fake frames only have their VALUE, the strings would come from Ruby
+    size_t per_frame = stats.bytes / stats.size;
+    size_t fake = 20 * FRAME_CACHE_MIN_LIMIT / per_frame;
+    string prefix(200, 'f');
+    long first_id = Frames::next_frame_id();
+    {
+        unique_lock<mutex> guard = Frames::lock_cached_frames();
+        for (size_t i = 0; i < fake; i++) {
+            FrameData data;
+            data.method = prefix + to_string(i);  // all different
+            Frames::add_frame((VALUE)(0x10 + i * 40), data, 0);  // aligned like objects
+        }
+    }
+    stats = Frames::cache_stats();
+    EXPECT_LT(0, stats.evictions);
+    EXPECT_GE((size_t)FRAME_CACHE_MIN_LIMIT, stats.bytes);
+    EXPECT_EQ(stats.size, cached_frames.size());
+    // the names of evicted frames don't pile up
+    EXPECT_GT((size_t)4 * FRAME_CACHE_MIN_LIMIT, stats.names_bytes);
+
+    // the frames still cached have their info in the dictionary
+    VALUE last[1] = {(VALUE)(0x10 + (fake - 1) * 40)};
+    vector<long> dict_ids;
+    vector<FrameData> dict_data;
+    unordered_set<long> sent;
+    {
+        unique_lock<mutex> guard = Frames::lock_cached_frames();
+        Frames::collect_frame_dict(last, 1, sent, dict_ids, dict_data);
+    }
+    ASSERT_EQ(1u, dict_ids.size());
+    EXPECT_EQ(first_id + (long)fake - 1, dict_ids[0]);
+    EXPECT_EQ(prefix + to_string(fake - 1), dict_data[0].method);
+
+    // and are removed from snapshots, ids of frames that came back are new
+    VALUE evicted[1] = {(VALUE)0x10};
+    ASSERT_EQ(0, cached_frames.count(evicted[0]));
+    EXPECT_EQ(0, Frames::remove_garbage(evicted, 1));
+
+    Frames::set_cache_limit(FRAME_CACHE_LIMIT);
+    Frames::clear_cached_frames();
+}
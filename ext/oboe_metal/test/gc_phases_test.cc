@@ -0,0 +1,87 @@
+#include "../src/gc_phases.h"
+
+#include "gtest/gtest.h"
+
+// GC.start, marking and sweeping in one step
+TEST(GcPhases, full_gc) {
+    GcPhases phases;
+    phases.enter(1000, 7);
+    phases.start(1010, true);
+    phases.end_mark(1500);
+    phases.end_sweep(1800);
+    GcPause pause = phases.exit(1820);
+
+    EXPECT_EQ(7, pause.ts);
+    EXPECT_EQ(490, pause.mark_ns);
+    EXPECT_EQ(330, pause.sweep_ns);  // with the 10 before the start and 20 after the sweep
+    EXPECT_EQ(GC_PAUSE_MAJOR | GC_PAUSE_START | GC_PAUSE_END, pause.flags);
+}
+
+// incremental marking and lazy sweeping, the steps are separate pauses
+TEST(GcPhases, steps) {
+    GcPhases phases;
+    phases.enter(0, 1);
+    phases.start(0, false);
+    GcPause pause = phases.exit(100);
+    EXPECT_EQ(100, pause.mark_ns);
+    EXPECT_EQ(0, pause.sweep_ns);
+    EXPECT_EQ(GC_PAUSE_START, pause.flags);
+
+    // more marking, then the first part of the sweep
+    phases.enter(1000, 2);
+    phases.end_mark(1200);
+    pause = phases.exit(1250);
+    EXPECT_EQ(200, pause.mark_ns);
+    EXPECT_EQ(50, pause.sweep_ns);
+    EXPECT_EQ(0, pause.flags);
+
+    phases.enter(2000, 3);
+    phases.end_sweep(2070);
+    pause = phases.exit(2080);
+    EXPECT_EQ(0, pause.mark_ns);
+    EXPECT_EQ(80, pause.sweep_ns);
+    EXPECT_EQ(GC_PAUSE_END, pause.flags);
+}
+
+// the steps of a major GC are all major, the next GC starts over
+TEST(GcPhases, major) {
+    GcPhases phases;
+    phases.enter(0, 1);
+    phases.start(0, true);
+    phases.end_mark(10);
+    EXPECT_EQ(GC_PAUSE_MAJOR | GC_PAUSE_START, phases.exit(20).flags);
+
+    phases.enter(100, 2);
+    phases.end_sweep(110);
+    EXPECT_EQ(GC_PAUSE_MAJOR | GC_PAUSE_END, phases.exit(120).flags);
+
+    // a step without a GC in progress, e.g. finalizers
+    phases.enter(200, 3);
+    GcPause pause = phases.exit(230);
+    EXPECT_EQ(0, pause.flags);
+    EXPECT_EQ(30, pause.sweep_ns);
+
+    phases.enter(300, 4);
+    phases.start(300, false);
+    phases.end_mark(310);
+    phases.end_sweep(320);
+    EXPECT_EQ(GC_PAUSE_START | GC_PAUSE_END, phases.exit(320).flags);
+}
+
+// the events are turned on during the lazy sweep of a major GC
+TEST(GcPhases, resume) {
+    GcPhases phases;
+    phases.resume(false, true, true);
+    phases.enter(1000, 1);
+    phases.end_sweep(1040);
+    GcPause pause = phases.exit(1050);
+    EXPECT_EQ(0, pause.mark_ns);
+    EXPECT_EQ(50, pause.sweep_ns);
+    EXPECT_EQ(GC_PAUSE_MAJOR | GC_PAUSE_END, pause.flags);
+
+    // no GC in progress
+    phases.resume(false, false, true);
+    phases.enter(2000, 2);
+    phases.start(2000, false);
+    EXPECT_EQ(0, phases.exit(2010).flags & GC_PAUSE_MAJOR);
+}
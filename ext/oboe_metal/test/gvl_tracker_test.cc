@@ -0,0 +1,127 @@
+#include "../src/gvl_tracker.h"
+
+#include "gtest/gtest.h"
+
+// blocked in IO, then waiting for the GVL until another thread releases it
+TEST(GvlTracker, off_cpu_and_wait) {
+    GvlTracker tracker(100, 100000);
+    GvlInterval interval;
+    tracker.reset(0);
+
+    EXPECT_FALSE(tracker.suspended(1000, interval));
+    EXPECT_EQ(GVL_STATE_OFF_CPU, tracker.current());
+    ASSERT_TRUE(tracker.ready(6000, interval));
+    EXPECT_EQ(GVL_STATE_OFF_CPU, interval.state);
+    EXPECT_EQ(1000, interval.ts);
+    EXPECT_EQ(5000, interval.us);
+
+    ASSERT_TRUE(tracker.resumed(8000, interval));
+    EXPECT_EQ(GVL_STATE_WAIT, interval.state);
+    EXPECT_EQ(6000, interval.ts);
+    EXPECT_EQ(2000, interval.us);
+    EXPECT_EQ(GVL_STATE_RUNNING, tracker.current());
+}
+
+// the short ones come with the next long one or the flush
+TEST(GvlTracker, short_intervals) {
+    GvlTracker tracker(100, 100000);
+    GvlInterval interval;
+    tracker.reset(0);
+
+    // a timer switch, released and waiting again right away
+    EXPECT_FALSE(tracker.suspended(1000, interval));
+    EXPECT_FALSE(tracker.ready(1001, interval));
+    EXPECT_FALSE(tracker.resumed(1050, interval));
+    EXPECT_FALSE(tracker.suspended(2000, interval));
+    EXPECT_FALSE(tracker.ready(2010, interval));
+    ASSERT_TRUE(tracker.resumed(3000, interval));
+    EXPECT_EQ(GVL_STATE_WAIT, interval.state);
+    EXPECT_EQ(990, interval.us);
+    EXPECT_EQ(49, interval.wait_us);
+    EXPECT_EQ(11, interval.off_cpu_us);
+
+    EXPECT_FALSE(tracker.flush(interval));
+    EXPECT_FALSE(tracker.suspended(4000, interval));
+    EXPECT_FALSE(tracker.ready(4020, interval));
+    EXPECT_FALSE(tracker.resumed(4050, interval));
+    ASSERT_TRUE(tracker.flush(interval));
+    EXPECT_EQ(GVL_STATE_RUNNING, interval.state);
+    EXPECT_EQ(4000, interval.ts);
+    EXPECT_EQ(30, interval.wait_us);
+    EXPECT_EQ(20, interval.off_cpu_us);
+    EXPECT_FALSE(tracker.flush(interval));
+}
+
+// a thread with only short waits reports its totals every flush_us
+TEST(GvlTracker, flush_due) {
+    GvlTracker tracker(100, 10000);
+    GvlInterval interval;
+    tracker.reset(0);
+
+    int records = 0;
+    long wait_us = 0;
+    for (long ts = 1000; ts < 100000; ts += 1000) {
+        if (tracker.suspended(ts, interval)) {
+            records++;
+            wait_us += interval.wait_us;
+        }
+        tracker.ready(ts, interval);
+        tracker.resumed(ts + 10, interval);
+    }
+    EXPECT_EQ(9, records);
+    EXPECT_EQ(90 * 10, wait_us);
+}
+
+// the thread starts profiling while it holds the GVL
+TEST(GvlTracker, reset) {
+    GvlTracker tracker(100, 100000);
+    GvlInterval interval;
+    tracker.suspended(1000, interval);
+    tracker.ready(1010, interval);
+
+    tracker.reset(5000);
+    EXPECT_FALSE(tracker.resumed(9000, interval));
+    EXPECT_FALSE(tracker.flush(interval));
+}
+
+TEST(GvlRing, push_pop) {
+    GvlRing ring;
+    GvlInterval interval = {1, GVL_STATE_WAIT, 0, 200, 0, 0};
+    GvlInterval out;
+    EXPECT_FALSE(ring.peek(out));
+
+    for (size_t i = 0; i < GvlRing::CAPACITY; i++) {
+        interval.ts = (long)i;
+        ASSERT_TRUE(ring.push(interval));
+    }
+    EXPECT_FALSE(ring.push(interval));
+
+    for (size_t i = 0; i < GvlRing::CAPACITY; i++) {
+        ASSERT_TRUE(ring.peek(out));
+        EXPECT_EQ((long)i, out.ts);
+        ring.pop();
+    }
+    EXPECT_FALSE(ring.peek(out));
+    EXPECT_TRUE(ring.push(interval));
+}
+
+TEST(GvlBatch, totals) {
+    GvlBatch batch;
+    EXPECT_TRUE(batch.empty());
+
+    batch.add({1, GVL_STATE_OFF_CPU, 1000, 5000, 10, 20});
+    batch.add({1, GVL_STATE_WAIT, 6000, 2000, 0, 0});
+    batch.add({1, GVL_STATE_RUNNING, 9000, 0, 30, 40});
+
+    EXPECT_EQ(1000, batch.first_ts());
+    ASSERT_EQ(2u, batch.states.size());
+    EXPECT_EQ(GVL_STATE_OFF_CPU, batch.states[0]);
+    EXPECT_EQ(6000, batch.timestamps[1]);
+    EXPECT_EQ(2000, batch.durations[1]);
+    EXPECT_EQ(2040, batch.wait_us);
+    EXPECT_EQ(5060, batch.off_cpu_us);
+
+    batch.clear();
+    EXPECT_TRUE(batch.empty());
+    EXPECT_EQ(0, batch.wait_us);
+}
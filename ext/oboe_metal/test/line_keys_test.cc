@@ -0,0 +1,16 @@
+#include "../src/line_keys.h"
+
+#include "gtest/gtest.h"
+
+TEST(LineKeys, pairs) {
+    LineKeys keys;
+    EXPECT_EQ(0, keys.key(7, 10));
+    EXPECT_EQ(1, keys.key(7, 12));
+    EXPECT_EQ(2, keys.key(8, 10));
+    EXPECT_EQ(0, keys.key(7, 10));
+    EXPECT_EQ(3u, keys.size());
+
+    keys.clear();
+    EXPECT_EQ(0u, keys.size());
+    EXPECT_EQ(0, keys.key(8, 10));
+}
@@ -0,0 +1,107 @@
+#include "../src/native_stack.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+// a fake stack with the frame records [previous fp][return address]
+TEST(NativeStack, walk) {
+    uintptr_t stack[16];
+    memset(stack, 0, sizeof(stack));
+    uintptr_t lo = (uintptr_t)stack, hi = (uintptr_t)(stack + 16);
+    stack[2] = (uintptr_t)&stack[6];
+    stack[3] = 0x1001;
+    stack[6] = (uintptr_t)&stack[10];
+    stack[7] = 0x2001;
+    stack[10] = 0;  // the outermost one
+    stack[11] = 0x3001;
+
+    uintptr_t pcs[NATIVE_MAX_FRAMES];
+    ASSERT_EQ(4, native_walk_from(0x500, (uintptr_t)&stack[2], lo, hi, pcs, NATIVE_MAX_FRAMES));
+    EXPECT_EQ(0x500u, pcs[0]);
+    EXPECT_EQ(0x1000u, pcs[1]);  // inside the call instruction
+    EXPECT_EQ(0x2000u, pcs[2]);
+    EXPECT_EQ(0x3000u, pcs[3]);
+
+    // at most max
+    EXPECT_EQ(2, native_walk_from(0x500, (uintptr_t)&stack[2], lo, hi, pcs, 2));
+    EXPECT_EQ(0, native_walk_from(0, (uintptr_t)&stack[2], lo, hi, pcs, 2));
+}
+
+// anything that doesn't look like a frame record ends the walk
+TEST(NativeStack, walk_stops) {
+    uintptr_t stack[16];
+    memset(stack, 0, sizeof(stack));
+    uintptr_t lo = (uintptr_t)stack, hi = (uintptr_t)(stack + 16);
+    uintptr_t pcs[NATIVE_MAX_FRAMES];
+
+    // not on the stack, not aligned
+    EXPECT_EQ(1, native_walk_from(0x500, 0x10, lo, hi, pcs, NATIVE_MAX_FRAMES));
+    EXPECT_EQ(1, native_walk_from(0x500, (uintptr_t)&stack[2] + 1, lo, hi, pcs, NATIVE_MAX_FRAMES));
+    EXPECT_EQ(1, native_walk_from(0x500, (uintptr_t)&stack[15], lo, hi, pcs, NATIVE_MAX_FRAMES));
+
+    // a loop, or a frame further in than the one before
+    stack[6] = (uintptr_t)&stack[6];
+    stack[7] = 0x2001;
+    EXPECT_EQ(2, native_walk_from(0x500, (uintptr_t)&stack[6], lo, hi, pcs, NATIVE_MAX_FRAMES));
+    stack[6] = (uintptr_t)&stack[2];
+    stack[2] = (uintptr_t)&stack[10];
+    stack[3] = 0x1001;
+    EXPECT_EQ(2, native_walk_from(0x500, (uintptr_t)&stack[6], lo, hi, pcs, NATIVE_MAX_FRAMES));
+}
+
+TEST(NativeStack, bounds) {
+    uintptr_t lo = 0, hi = 0;
+    if (!NATIVE_STACK_SUPPORTED) return;
+    ASSERT_TRUE(native_stack_bounds(lo, hi));
+    uintptr_t here = (uintptr_t)&lo;
+    EXPECT_LE(lo, here);
+    EXPECT_GT(hi, here);
+}
+
+TEST(NativeSymbols, lookup) {
+    NativeSymbols symbols((const void *)&rb_str_new);
+
+    // inside the function, the VM's own
+    const NativeSymbols::Symbol &str_new = symbols.lookup((uintptr_t)&rb_str_new + 1);
+    EXPECT_EQ("rb_str_new", str_new.data.method);
+    EXPECT_NE(std::string::npos, str_new.data.file.find("ruby"));
+    EXPECT_TRUE(str_new.vm);
+    EXPECT_EQ((VALUE)((uintptr_t)&rb_str_new | 1), str_new.key);
+    EXPECT_TRUE(FIXNUM_P(str_new.key));
+
+    // a function of another library
+    const NativeSymbols::Symbol &libc = symbols.lookup((uintptr_t)&strtol + 1);
+    EXPECT_FALSE(libc.vm);
+    EXPECT_EQ(2u, symbols.size());
+
+    // the same symbol, one entry
+    symbols.lookup((uintptr_t)&rb_str_new + 2);
+    EXPECT_EQ(2u, symbols.size());
+
+    // nowhere
+    const NativeSymbols::Symbol &unknown = symbols.lookup(0x10);
+    VALUE unknown_key = NativeSymbols::UNKNOWN_KEY;
+    EXPECT_EQ(unknown_key, unknown.key);
+    EXPECT_TRUE(unknown.vm);
+    EXPECT_EQ("[unknown]", unknown.data.method);
+}
+
+// a function of the test binary itself
+void native_stack_test_function() {}
+
+// the main program is named by /proc/self/exe, not by the path it was
+// started with
+TEST(NativeSymbols, main_program) {
+    if (!NATIVE_STACK_SUPPORTED) return;
+    char exe[4096];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    ASSERT_LT(0, len);
+    exe[len] = 0;
+
+    NativeSymbols symbols((const void *)&rb_str_new);
+    const NativeSymbols::Symbol &symbol = symbols.lookup((uintptr_t)&native_stack_test_function);
+    EXPECT_EQ(std::string(exe), symbol.data.file);
+    EXPECT_FALSE(symbol.vm);
+}
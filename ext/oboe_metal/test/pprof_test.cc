@@ -0,0 +1,234 @@
+#include "../src/pprof.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// Minimal protobuf decoder, enough to read back what PprofProfile writes
+struct Message {
+    std::multimap<int, uint64_t> ints;
+    std::multimap<int, std::string> bytes;
+
+    explicit Message(const std::string &buf) {
+        size_t pos = 0;
+        while (pos < buf.size()) {
+            uint64_t key = varint(buf, pos);
+            if ((key & 7) == 0) {
+                ints.emplace((int)(key >> 3), varint(buf, pos));
+            } else {
+                uint64_t len = varint(buf, pos);
+                bytes.emplace((int)(key >> 3), buf.substr(pos, len));
+                pos += len;
+            }
+        }
+    }
+
+    static uint64_t varint(const std::string &buf, size_t &pos) {
+        uint64_t val = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t b = buf[pos++];
+            val |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return val;
+        }
+    }
+
+    uint64_t get(int field) const {
+        auto it = ints.find(field);
+        return it == ints.end() ? 0 : it->second;
+    }
+
+    std::vector<std::string> all(int field) const {
+        std::vector<std::string> vals;
+        auto range = bytes.equal_range(field);
+        for (auto it = range.first; it != range.second; ++it) vals.push_back(it->second);
+        return vals;
+    }
+
+    std::vector<uint64_t> packed(int field) const {
+        std::vector<uint64_t> vals;
+        for (const std::string &buf : all(field)) {
+            size_t pos = 0;
+            while (pos < buf.size()) vals.push_back(varint(buf, pos));
+        }
+        return vals;
+    }
+};
+
+static FrameData frame(const char *klass, const char *method, const char *file, int lineno) {
+    FrameData data;
+    data.klass = klass;
+    data.method = method;
+    data.file = file;
+    data.lineno = lineno;
+    return data;
+}
+
+TEST(PprofProfile, encode_and_decode) {
+    PprofProfile profile;
+    profile.start(1000000, 10, "wall");
+
+    profile.add_location(5, frame("User", "save", "/app/models/user.rb", 12));
+    profile.add_location(6, frame("UsersController", "create", "/app/controllers/users.rb", 30));
+    profile.add_location(0, frame("", "OTHER THREADS", "", 0));
+
+    long stack1[] = {5, 6};
+    long stack2[] = {6};
+    long stack3[] = {0};
+    profile.add_sample(stack1, 2, 1000500);
+    profile.add_repeat(1010500);
+    profile.add_sample(stack1, 2, 1020500);  // same stack, merged
+    profile.add_sample(stack2, 1, 1030500);
+    profile.add_sample(stack3, 1, 1040500);
+    EXPECT_EQ(3u, profile.num_samples());
+
+    std::string out;
+    profile.encode(out, 1100000);
+    Message msg(out);
+
+    std::vector<std::string> strings = msg.all(6);
+    ASSERT_FALSE(strings.empty());
+    EXPECT_EQ("", strings[0]);
+
+    // sample types samples/count and wall/nanoseconds
+    std::vector<std::string> types = msg.all(1);
+    ASSERT_EQ(2u, types.size());
+    EXPECT_EQ("samples", strings[Message(types[0]).get(1)]);
+    EXPECT_EQ("count", strings[Message(types[0]).get(2)]);
+    EXPECT_EQ("wall", strings[Message(types[1]).get(1)]);
+    EXPECT_EQ("nanoseconds", strings[Message(types[1]).get(2)]);
+    EXPECT_EQ(10000000u, msg.get(12));   // period
+    EXPECT_EQ(1000000000u, msg.get(9));  // time_nanos
+    EXPECT_EQ(100000000u, msg.get(10));  // duration_nanos
+    EXPECT_EQ("wall", strings[Message(msg.all(11)[0]).get(1)]);
+
+    // functions by id
+    std::map<uint64_t, Message> functions;
+    for (const std::string &buf : msg.all(5)) {
+        Message function(buf);
+        functions.emplace(function.get(1), function);
+    }
+    ASSERT_EQ(3u, functions.size());
+
+    // location id => "name file:line"
+    std::map<uint64_t, std::string> locations;
+    for (const std::string &buf : msg.all(4)) {
+        Message location(buf);
+        Message line(location.all(4)[0]);
+        const Message &function = functions.at(line.get(1));
+        locations[location.get(1)] = strings[function.get(2)] + " " + strings[function.get(4)] +
+                                     ":" + std::to_string(line.get(2));
+    }
+    ASSERT_EQ(3u, locations.size());
+
+    std::vector<std::string> samples = msg.all(2);
+    ASSERT_EQ(3u, samples.size());
+
+    Message sample(samples[0]);
+    std::vector<uint64_t> ids = sample.packed(1);
+    ASSERT_EQ(2u, ids.size());
+    EXPECT_EQ("User#save /app/models/user.rb:12", locations[ids[0]]);
+    EXPECT_EQ("UsersController#create /app/controllers/users.rb:30", locations[ids[1]]);
+    EXPECT_EQ((std::vector<uint64_t>{3, 30000000}), sample.packed(2));
+    Message label(sample.all(3)[0]);
+    EXPECT_EQ("delta_us", strings[label.get(1)]);
+    EXPECT_EQ(500u, label.get(3));
+
+    sample = Message(samples[1]);
+    ids = sample.packed(1);
+    ASSERT_EQ(1u, ids.size());
+    EXPECT_EQ("UsersController#create /app/controllers/users.rb:30", locations[ids[0]]);
+    EXPECT_EQ((std::vector<uint64_t>{1, 10000000}), sample.packed(2));
+    EXPECT_EQ(30000u, Message(sample.all(3)[0]).get(3));  // since the previous sample
+
+    sample = Message(samples[2]);
+    EXPECT_EQ("OTHER THREADS :0", locations[sample.packed(1)[0]]);
+}
+
+// the adaptive interval goes from 10ms to 40ms, the snapshots after that
+// count 4 times as much, also within a merged sample
+TEST(PprofProfile, interval_changes) {
+    PprofProfile profile;
+    profile.start(0, 10, "wall");
+    profile.add_location(1, frame("Foo", "bar", "/foo.rb", 3));
+    profile.add_location(2, frame("Foo", "baz", "/foo.rb", 9));
+
+    long stack1[] = {1};
+    long stack2[] = {2};
+    profile.add_sample(stack1, 1, 10000);
+    profile.set_interval(40);
+    profile.add_repeat(50000);
+    profile.add_sample(stack1, 1, 90000);
+    profile.add_sample(stack2, 1, 130000);
+
+    std::string out;
+    profile.encode(out, 200000);
+    Message msg(out);
+    EXPECT_EQ(10000000u, msg.get(12));  // period, of the start
+
+    std::vector<std::string> samples = msg.all(2);
+    ASSERT_EQ(2u, samples.size());
+    EXPECT_EQ((std::vector<uint64_t>{3, 90000000}), Message(samples[0]).packed(2));
+    EXPECT_EQ((std::vector<uint64_t>{1, 40000000}), Message(samples[1]).packed(2));
+
+    // the next run starts at its own interval
+    profile.start(300000, 10, "wall");
+    profile.add_sample(stack1, 1, 310000);
+    profile.encode(out, 400000);
+    EXPECT_EQ((std::vector<uint64_t>{1, 10000000}), Message(Message(out).all(2)[0]).packed(2));
+}
+
+TEST(PprofProfile, shares_functions_and_strings) {
+    PprofProfile profile;
+    profile.start(0, 1, "cpu");
+
+    // two frames of the same method, lines differ
+    profile.add_location(1, frame("Foo", "bar", "/foo.rb", 3));
+    profile.add_location(2, frame("Foo", "bar", "/foo.rb", 7));
+    profile.add_location(3, frame("Foo", "baz", "/foo.rb", 9));
+    EXPECT_TRUE(profile.has_location(2));
+    EXPECT_FALSE(profile.has_location(4));
+
+    long stack[] = {1, 2, 3};
+    profile.add_sample(stack, 3, 10);
+
+    std::string out;
+    profile.encode(out, 100);
+    Message msg(out);
+
+    EXPECT_EQ(3u, msg.all(4).size());  // locations
+    EXPECT_EQ(2u, msg.all(5).size());  // functions
+
+    std::vector<std::string> strings = msg.all(6);
+    EXPECT_EQ(1, std::count(strings.begin(), strings.end(), "/foo.rb"));
+    EXPECT_EQ(1, std::count(strings.begin(), strings.end(), "cpu"));
+
+    // reused for the next run
+    profile.start(200, 1, "cpu");
+    EXPECT_EQ(0u, profile.num_samples());
+    EXPECT_FALSE(profile.has_location(1));
+}
+
+// in line mode the locations of a method have the sampled lines
+TEST(PprofProfile, line_locations) {
+    PprofProfile profile;
+    profile.start(0, 1, "wall");
+    profile.add_location(0, frame("Foo", "bar", "/foo.rb", 3), 5);
+    profile.add_location(1, frame("Foo", "bar", "/foo.rb", 3), 8);
+
+    long stack[] = {0, 1};
+    profile.add_sample(stack, 2, 10);
+    std::string out;
+    profile.encode(out, 100);
+    Message msg(out);
+
+    std::vector<std::string> functions = msg.all(5);
+    ASSERT_EQ(1u, functions.size());
+    EXPECT_EQ(3u, Message(functions[0]).get(5));  // start_line
+
+    std::vector<uint64_t> lines;
+    for (const std::string &buf : msg.all(4)) lines.push_back(Message(Message(buf).all(4)[0]).get(2));
+    EXPECT_EQ((std::vector<uint64_t>{5, 8}), lines);
+}
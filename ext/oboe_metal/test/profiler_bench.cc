@@ -0,0 +1,290 @@
+// Microbenchmarks of the encoder path of the profiler, Google Benchmark
+//
+// synthetic stacks of 10, 100 and 1000 frames, alternating between two
+// stacks that share
+//   same       all frames, every snapshot is a repeat
+//   leaf       all but the innermost frame
+//   half       the outer half
+//   recursive  like leaf, but the frames are a recursion through 4 methods,
+//              remove_garbage() drops all but the last call of each
+//
+// With lines=1 the benchmark runs in line mode, the frames come with a line
+// each, the same in both stacks, the difference to lines=0 is the cost of
+// carrying them through.
+//
+// The frames are fake VALUEs added to the frame cache directly, no Ruby VM
+// needed. liboboe is not initialized, the events are built and then dropped
+// without a reporter.
+//
+// The allocation benchmarks use the sampler and the profile of a run
+// directly, the native stack ones a fake stack of frame records and the
+// symbols of the benchmark itself.
+//
+// build the profilerBench target and run it, e.g.
+//   ./build/profilerBench --benchmark_filter=process_snapshot
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "frames.h"
+#include "profiling.h"
+
+// for calling the private encoder functions
+struct ProfilingInternals {
+    static void process_snapshot(VALUE *frames_buffer, int num, prof_data_t *data, long ts, int *lines) {
+        Profiling::process_snapshot(frames_buffer, num, data, ts, lines);
+    }
+};
+
+enum Pattern { SAME, LEAF, HALF, RECURSIVE };
+
+static const char *pattern_names[] = {"same", "leaf", "half", "recursive"};
+
+// the two stacks of a depth and pattern, innermost frame first
+struct Stacks {
+    std::vector<VALUE> a;
+    std::vector<VALUE> b;
+};
+
+static VALUE fake_frame(int i) {
+    return (VALUE)(0x7f0000000000 + (long)i * 40);  // aligned like objects
+}
+
+// all frames used by the stacks, in the frame cache with a line number
+static void cache_fake_frames() {
+    static bool done = false;
+    if (done) return;
+    done = true;
+
+    unique_lock<mutex> guard = Frames::lock_cached_frames();
+    for (int i = 0; i < 3000; i++) {
+        FrameData data;
+        data.method = "method_" + std::to_string(i);
+        data.klass = "Bench::Klass" + std::to_string(i % 50);
+        data.file = "/app/lib/bench/file_" + std::to_string(i % 100) + ".rb";
+        data.lineno = 1 + i % 200;
+        Frames::add_frame(fake_frame(i), data, 0);
+    }
+}
+
+static Stacks make_stacks(int depth, Pattern pattern) {
+    cache_fake_frames();
+    Stacks stacks;
+    for (int i = 0; i < depth; i++)
+        stacks.a.push_back(pattern == RECURSIVE ? fake_frame(i % 4) : fake_frame(i));
+    stacks.b = stacks.a;
+
+    switch (pattern) {
+        case SAME:
+            break;
+        case LEAF:
+        case RECURSIVE:
+            stacks.b[0] = fake_frame(depth + 4);
+            break;
+        case HALF:
+            for (int i = 0; i < depth / 2; i++) stacks.b[i] = fake_frame(depth + i);
+            break;
+    }
+    return stacks;
+}
+
+// the lines of the frames of a stack, by position
+static std::vector<int> make_lines(int depth) {
+    std::vector<int> lines;
+    for (int i = 0; i < depth; i++) lines.push_back(10 + i % 50);
+    return lines;
+}
+
+static void set_label(benchmark::State &state) {
+    state.SetLabel(pattern_names[state.range(1)]);
+}
+
+static void stack_args(benchmark::internal::Benchmark *bench) {
+    bench->ArgNames({"depth", "pattern"});
+    bench->ArgsProduct({{10, 100, 1000}, {SAME, LEAF, HALF, RECURSIVE}});
+}
+
+static void line_args(benchmark::internal::Benchmark *bench) {
+    bench->ArgNames({"depth", "pattern", "lines"});
+    bench->ArgsProduct({{10, 100, 1000}, {SAME, LEAF, HALF, RECURSIVE}, {0, 1}});
+}
+
+// the buffer is filtered in place, copying it back is part of the time
+static void BM_remove_garbage(benchmark::State &state) {
+    Stacks stacks = make_stacks((int)state.range(0), (Pattern)state.range(1));
+    VALUE buffer[BUF_SIZE];
+    int num = (int)stacks.a.size();
+    std::vector<int> lines = make_lines(num);
+    int line_buffer[BUF_SIZE];
+    int *lines_p = state.range(2) ? line_buffer : NULL;
+
+    unique_lock<mutex> guard = Frames::lock_cached_frames();
+    long i = 0;
+    for (auto _ : state) {
+        const std::vector<VALUE> &stack = (i++ & 1) ? stacks.b : stacks.a;
+        memcpy(buffer, stack.data(), num * sizeof(VALUE));
+        if (lines_p) memcpy(lines_p, lines.data(), num * sizeof(int));
+        benchmark::DoNotOptimize(Frames::remove_garbage(buffer, num, lines_p));
+    }
+    set_label(state);
+}
+BENCHMARK(BM_remove_garbage)->Apply(line_args);
+
+static void BM_num_matching(benchmark::State &state) {
+    Stacks stacks = make_stacks((int)state.range(0), (Pattern)state.range(1));
+    int num = (int)stacks.a.size();
+    std::vector<int> lines = make_lines(num);
+    const int *lines_p = state.range(2) ? lines.data() : NULL;
+
+    long i = 0;
+    for (auto _ : state) {
+        bool odd = i++ & 1;
+        std::vector<VALUE> &stack = odd ? stacks.b : stacks.a;
+        std::vector<VALUE> &prev = odd ? stacks.a : stacks.b;
+        benchmark::DoNotOptimize(Frames::num_matching(stack.data(), num, prev.data(), num, lines_p, lines_p));
+    }
+    set_label(state);
+}
+BENCHMARK(BM_num_matching)->Apply(line_args);
+
+static void BM_collect_frame_data(benchmark::State &state) {
+    Stacks stacks = make_stacks((int)state.range(0), (Pattern)state.range(1));
+    int num = (int)stacks.a.size();
+    std::vector<FrameData> frame_data;
+    frame_data.reserve(num);
+
+    unique_lock<mutex> guard = Frames::lock_cached_frames();
+    long i = 0;
+    for (auto _ : state) {
+        std::vector<VALUE> &stack = (i++ & 1) ? stacks.b : stacks.a;
+        frame_data.clear();
+        Frames::collect_frame_data(stack.data(), num, frame_data);
+        benchmark::DoNotOptimize(frame_data.data());
+    }
+    set_label(state);
+}
+BENCHMARK(BM_collect_frame_data)->Apply(stack_args);
+
+// one snapshot event or omitted timestamp per iteration, in the events
+// format without batching
+static void BM_process_snapshot(benchmark::State &state) {
+    Stacks stacks = make_stacks((int)state.range(0), (Pattern)state.range(1));
+    VALUE buffer[BUF_SIZE];
+    int num = (int)stacks.a.size();
+    std::vector<int> lines = make_lines(num);
+    int line_buffer[BUF_SIZE];
+    int *lines_p = state.range(2) ? line_buffer : NULL;
+    prof_data_t *data = new prof_data_t;
+    data->run_tid = 1;
+    data->run_lines = lines_p != NULL;
+
+    long i = 0;
+    for (auto _ : state) {
+        const std::vector<VALUE> &stack = (i & 1) ? stacks.b : stacks.a;
+        memcpy(buffer, stack.data(), num * sizeof(VALUE));
+        if (lines_p) memcpy(lines_p, lines.data(), num * sizeof(int));
+        ProfilingInternals::process_snapshot(buffer, num, data, 1000000 + i * 10000, lines_p);
+        i++;
+    }
+    set_label(state);
+    delete data;
+}
+BENCHMARK(BM_process_snapshot)->Apply(line_args);
+
+// with the number of new and exited frames the stacks give after
+// remove_garbage(), like process_snapshot() would call it
+static void BM_log_profile_snapshot(benchmark::State &state) {
+    Stacks stacks = make_stacks((int)state.range(0), (Pattern)state.range(1));
+    int num_a, num_b;
+    {
+        unique_lock<mutex> guard = Frames::lock_cached_frames();
+        num_a = Frames::remove_garbage(stacks.a.data(), (int)stacks.a.size());
+        num_b = Frames::remove_garbage(stacks.b.data(), (int)stacks.b.size());
+    }
+    int num_match = Frames::num_matching(stacks.b.data(), num_b, stacks.a.data(), num_a);
+    std::vector<long> ids;
+    {
+        unique_lock<mutex> guard = Frames::lock_cached_frames();
+        Frames::collect_frame_ids(stacks.b.data(), num_b - num_match, ids);
+    }
+
+    Metadata md(Context::get());
+    string prof_op_id;
+    long omitted[1] = {0};
+    long ts = 1000000;
+    for (auto _ : state) {
+        Logging::log_profile_snapshot(md, prof_op_id, ts, ids.data(), (int)ids.size(),
+                                      num_a - num_match, num_b, omitted, 0, 1);
+        ts += 10000;
+    }
+    set_label(state);
+    state.counters["new_frames"] = (double)ids.size();
+}
+BENCHMARK(BM_log_profile_snapshot)->Apply(stack_args);
+
+// the allocation hook's decision per allocation, at several intervals,
+// the cost of the samples themselves is in test/benchmark/alloc_profiling_bench.rb
+static void BM_alloc_sampler(benchmark::State &state) {
+    AllocSampler sampler;
+    sampler.configure(state.range(0), 0);
+    long samples = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(samples += sampler.sample() != 0);
+    }
+    state.counters["samples"] = (double)samples;
+}
+BENCHMARK(BM_alloc_sampler)->ArgName("interval")->Arg(1)->Arg(16)->Arg(256)->Arg(4096);
+
+// one allocation sample added to the profile of the run in the encoder,
+// alternating between the two stacks
+static void BM_alloc_profile_add(benchmark::State &state) {
+    Stacks stacks = make_stacks((int)state.range(0), (Pattern)state.range(1));
+    std::vector<long> a(stacks.a.begin(), stacks.a.end());
+    std::vector<long> b(stacks.b.begin(), stacks.b.end());
+    AllocProfile profile;
+
+    long i = 0;
+    for (auto _ : state) {
+        const std::vector<long> &ids = (i & 1) ? b : a;
+        profile.add(ids.data(), (int)ids.size(), 64, 2560, 1000000 + i);
+        i++;
+    }
+    set_label(state);
+}
+BENCHMARK(BM_alloc_profile_add)->Apply(stack_args);
+
+// the walk in the signal handler, a chain of depth frame records
+static void BM_native_walk(benchmark::State &state) {
+    int depth = (int)state.range(0);
+    std::vector<uintptr_t> stack(2 * depth + 2);
+    for (int i = 0; i < depth; i++) {
+        stack[2 * i] = (uintptr_t)&stack[2 * i + 2];
+        stack[2 * i + 1] = 0x401000 + i * 16;
+    }
+    stack[2 * depth - 2] = 0;  // the outermost one
+    uintptr_t lo = (uintptr_t)stack.data(), hi = (uintptr_t)(stack.data() + stack.size());
+    uintptr_t pcs[NATIVE_MAX_FRAMES];
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(native_walk_from(0x400000, lo, lo, hi, pcs, NATIVE_MAX_FRAMES));
+    }
+}
+BENCHMARK(BM_native_walk)->ArgName("depth")->Arg(8)->Arg(32)->Arg(64);
+
+// the symbol of an address in the encoder, cached, the first lookup of an
+// address goes to dladdr()
+static void BM_native_symbols(benchmark::State &state) {
+    NativeSymbols symbols((const void *)&rb_profile_frames);
+    uintptr_t pcs[4] = {(uintptr_t)&rb_profile_frames + 4, (uintptr_t)&strtol + 4,
+                        (uintptr_t)&BM_native_walk + 4, (uintptr_t)&memcmp + 4};
+    long i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(symbols.lookup(pcs[i++ & 3]).key);
+    }
+}
+BENCHMARK(BM_native_symbols);
+
+BENCHMARK_MAIN();
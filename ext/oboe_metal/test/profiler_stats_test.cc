@@ -0,0 +1,65 @@
+#include "../src/profiler_stats.h"
+
+#include "gtest/gtest.h"
+
+TEST(StatCounter, add) {
+    StatCounter counter;
+    EXPECT_EQ(0, counter.get());
+    counter.add();
+    counter.add(41);
+    EXPECT_EQ(42, counter.get());
+}
+
+TEST(StatHistogram, buckets) {
+    StatHistogram hist;
+    EXPECT_EQ(0, hist.quantile(0.5));
+
+    hist.add(0);
+    hist.add(1);
+    hist.add(3);     // 2..3
+    hist.add(1000);  // 512..1023
+    hist.add(1023);
+    hist.add(-5);    // clock went backwards, counts as 0
+
+    EXPECT_EQ(6, hist.count());
+    EXPECT_EQ(2027, hist.sum());
+    EXPECT_EQ(1023, hist.max());
+    EXPECT_EQ(2, hist.bucket(0));
+    EXPECT_EQ(1, hist.bucket(1));
+    EXPECT_EQ(1, hist.bucket(2));
+    EXPECT_EQ(2, hist.bucket(10));
+
+    // upper bounds of the buckets
+    EXPECT_EQ(0, hist.quantile(0.0));
+    EXPECT_EQ(1, hist.quantile(0.4));
+    EXPECT_EQ(3, hist.quantile(0.5));
+    EXPECT_EQ(1023, hist.quantile(0.99));
+}
+
+TEST(StatHistogram, last_bucket) {
+    StatHistogram hist;
+    hist.add(1L << 50);
+    EXPECT_EQ(1, hist.bucket(StatHistogram::BUCKETS - 1));
+    EXPECT_EQ(1L << 50, hist.max());
+}
+
+TEST(ThreadStats, totals) {
+    ThreadStats stats;
+    stats.samples.add(10);
+    stats.samples_dropped.add(1);
+    stats.cache_misses.add(7);
+    stats.snapshots.add(12);
+    stats.omitted.add(5);
+    stats.remove_garbage.add(300);
+    stats.remove_garbage.add(200);
+    stats.logging.add(4000);
+
+    RunStats totals = stats.totals();
+    EXPECT_EQ(10, totals.samples);
+    EXPECT_EQ(1, totals.samples_dropped);
+    EXPECT_EQ(7, totals.cache_misses);
+    EXPECT_EQ(12, totals.snapshots);
+    EXPECT_EQ(5, totals.omitted);
+    EXPECT_EQ(500, totals.remove_garbage_ns);
+    EXPECT_EQ(4000, totals.logging_ns);
+}
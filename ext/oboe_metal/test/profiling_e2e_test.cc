@@ -0,0 +1,724 @@
+// End to end tests of the profiler against fake_oboe/oboe_api.h
+//
+// a Ruby workload runs under CProfiler.run, the events the encoder sends
+// are read back from FakeOboe. The recursion of e2e_fib collapses into one
+// frame, the stack changes between e2e_a and e2e_b.
+
+#include <ruby/ruby.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "frames.h"
+#include "gtest/gtest.h"
+#include "gc_phases.h"
+#include "oboe_api.h"
+
+using namespace std;
+
+static const char *workload =
+    "def e2e_fib(n) n < 2 ? n : e2e_fib(n - 1) + e2e_fib(n - 2) end\n"
+    "def e2e_a() e2e_fib(17) end\n"
+    "def e2e_b() e2e_fib(16) end\n"
+    "def e2e_work(secs)\n"
+    "  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)\n"
+    "  while Process.clock_gettime(Process::CLOCK_MONOTONIC) - start < secs\n"
+    "    e2e_a\n"
+    "    e2e_b\n"
+    "  end\n"
+    "end\n"
+    "def e2e_gc() 3.times { GC.start; e2e_fib(12) } end\n"
+    "E2E_X = 'x'\n"
+    "def e2e_strings(n) n.times { E2E_X * 100 } end\n"
+    "def e2e_arrays(n) n.times { Array.new(50) } end\n"
+    "def e2e_run(secs)\n"
+    "  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)\n"
+    "  SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_work(secs) }\n"
+    "  Process.clock_gettime(Process::CLOCK_MONOTONIC) - start\n"
+    "end\n"
+    "def e2e_fiber(secs, a)\n"
+    "  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)\n"
+    "  a ? e2e_a : e2e_b while Process.clock_gettime(Process::CLOCK_MONOTONIC) - start < secs\n"
+    "end\n";
+
+// holds the GVL without checking for interrupts, like a slow C extension
+static VALUE e2e_block(VALUE self, VALUE ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long end = now.tv_sec * 1000000000L + now.tv_nsec + NUM2LONG(ms) * 1000000L;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec * 1000000000L + now.tv_nsec < end);
+    return Qnil;
+}
+
+// holds the GVL in a loop of its own, like e2e_block, but lets the postponed
+// jobs run now and then, like a C extension checking for interrupts
+// built with frame pointers, so that the native stack gets to the caller
+__attribute__((noinline, optimize("no-omit-frame-pointer")))
+static VALUE e2e_native(VALUE self, VALUE ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long end = now.tv_sec * 1000000000L + now.tv_nsec + NUM2LONG(ms) * 1000000L;
+    volatile long spins = 0;
+    do {
+        for (int i = 0; i < 100000; i++) spins = spins + 1;
+        rb_thread_check_ints();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec * 1000000000L + now.tv_nsec < end);
+    return Qnil;
+}
+
+// a snapshot event or one column of a batch
+struct Snapshot {
+    long ts;
+    long exited;
+    long count;
+    vector<long> new_ids;
+};
+
+static VALUE eval(const string &script) {
+    int state = 0;
+    VALUE result = rb_eval_string_protect(script.c_str(), &state);
+    EXPECT_EQ(0, state) << script;
+    return result;
+}
+
+static long sampling_stat(const char *key) {
+    return NUM2LONG(eval(string("SolarWindsAPM::CProfiler.sampling_stats[:") + key + "]"));
+}
+
+static long stat(const string &path) {
+    return NUM2LONG(eval("SolarWindsAPM::CProfiler.stats" + path));
+}
+
+// the events sent until the EXIT event of the last of the runs, the encoder
+// sends them in the background
+static vector<FakeEvent> wait_for_exit(int runs = 1) {
+    for (int i = 0; i < 500; i++) {
+        vector<FakeEvent> events = FakeOboe::events();
+        int exits = 0;
+        for (size_t j = 0; j < events.size(); j++) {
+            if (events[j].str("Label") == "exit" && ++exits == runs) {
+                events.resize(j + 1);
+                return events;
+            }
+        }
+        usleep(10000);
+    }
+    ADD_FAILURE() << "no exit event";
+    return vector<FakeEvent>();
+}
+
+static vector<Snapshot> snapshots(const vector<FakeEvent> &events, long *omitted) {
+    vector<Snapshot> snaps;
+    for (const FakeEvent &event : events) {
+        *omitted += event.array("SnapshotsOmitted").size();
+        if (event.str("Label") == "info") {
+            // without frame ids, -1 for each of the new frames
+            vector<long> new_ids = event.array("NewFrameIds");
+            auto frames = event.frames.find("NewFrames");
+            if (frames != event.frames.end()) new_ids.assign(frames->second.size(), -1);
+            snaps.push_back({event.num("Timestamp_u"), event.num("FramesExited"),
+                             event.num("FramesCount"), new_ids});
+        } else if (event.str("Label") == "batch") {
+            vector<long> timestamps = event.array("Timestamps");
+            vector<long> exited = event.array("FramesExited");
+            vector<long> counts = event.array("FramesCount");
+            vector<long> new_counts = event.array("NewFrameCounts");
+            vector<long> new_ids = event.array("NewFrameIds");
+            EXPECT_EQ(timestamps.size(), exited.size());
+            EXPECT_EQ(timestamps.size(), counts.size());
+            EXPECT_EQ(timestamps.size(), new_counts.size());
+
+            size_t next = 0;
+            for (size_t i = 0; i < timestamps.size(); i++) {
+                snaps.push_back({timestamps[i], exited[i], counts[i],
+                                 vector<long>(new_ids.begin() + next, new_ids.begin() + next + new_counts[i])});
+                next += new_counts[i];
+            }
+            EXPECT_EQ(new_ids.size(), next);
+        }
+    }
+    return snaps;
+}
+
+// the frames of all runs so far, for looking up their names, each run
+// sends the dictionary entries of the frames it uses, see check_stream()
+static set<long> dict_ids;
+static set<string> dict_methods;
+static map<long, string> dict_names;
+static map<long, FrameData> dict_frames;
+
+static void add_dict(const FakeEvent &event) {
+    if (event.str("Label") != "dictionary") return;
+    vector<long> ids = event.array("FrameIds");
+    dict_ids.insert(ids.begin(), ids.end());
+    auto frames = event.frames.find("Frames");
+    if (frames == event.frames.end()) return;
+    for (size_t i = 0; i < frames->second.size(); i++) {
+        dict_methods.insert(frames->second[i].method);
+        dict_names[ids[i]] = frames->second[i].method;
+        dict_frames[ids[i]] = frames->second[i];
+    }
+}
+
+// the events of interleaved runs, one stream per run, following the edges
+static vector<vector<FakeEvent> > streams(const vector<FakeEvent> &events) {
+    vector<vector<FakeEvent> > runs;
+    map<string, size_t> run_of;  // op id of the last event of each run
+    for (const FakeEvent &event : events) {
+        size_t run = runs.size();
+        if (event.str("Label") == "entry") {
+            runs.push_back(vector<FakeEvent>());
+        } else if (event.edges.size() == 1 && run_of.count(event.edges[0])) {
+            run = run_of[event.edges[0]];
+        } else {
+            ADD_FAILURE() << "event of no run: " << event.str("Label");
+            continue;
+        }
+        runs[run].push_back(event);
+        run_of[event.str("X-Trace").substr(36, 16)] = run;
+    }
+    return runs;
+}
+
+// the invariants of the stream of one run
+static void check_stream(const vector<FakeEvent> &events) {
+    ASSERT_LE(2u, events.size());
+    EXPECT_EQ("entry", events.front().str("Label"));
+    EXPECT_EQ("exit", events.back().str("Label"));
+    long tid = events.front().num("TID");
+
+    // every event points to the previous one
+    string prev_op;
+    set<long> run_ids;
+    for (const FakeEvent &event : events) {
+        EXPECT_EQ("profiling", event.str("Spec"));
+        EXPECT_EQ(tid, event.num("TID"));
+        EXPECT_EQ((long)getpid(), event.num("PID"));
+        string x_trace = event.str("X-Trace");
+        ASSERT_EQ(55u, x_trace.size());
+        if (!prev_op.empty()) {
+            ASSERT_EQ(1u, event.edges.size());
+            EXPECT_EQ(prev_op, event.edges[0]);
+        }
+        prev_op = x_trace.substr(36, 16);
+
+        // frames are described in the run before an event refers to them
+        add_dict(event);
+        string label = event.str("Label");
+        if (label == "dictionary") {
+            vector<long> ids = event.array("FrameIds");
+            run_ids.insert(ids.begin(), ids.end());
+        }
+        vector<long> ids = event.array(label == "gc" || label == "alloc" ? "FrameIds" : "NewFrameIds");
+        for (long id : ids) EXPECT_EQ(1u, run_ids.count(id)) << label << " " << id;
+    }
+
+    // each snapshot has the frames of the previous one, minus the exited
+    // ones, plus the new ones
+    long omitted = 0;
+    long prev_ts = 0, prev_count = 0;
+    for (const Snapshot &snap : snapshots(events, &omitted)) {
+        EXPECT_LE(prev_ts, snap.ts);
+        EXPECT_LE(snap.exited, prev_count);
+        EXPECT_EQ(prev_count - snap.exited + (long)snap.new_ids.size(), snap.count);
+        prev_ts = snap.ts;
+        prev_count = snap.count;
+    }
+}
+
+class ProfilingE2E : public ::testing::Test {
+   protected:
+    // once per process, also with --gtest_repeat, redefining the methods
+    // would leave the cached frames of the previous definitions behind
+    static void SetUpTestSuite() {
+        static bool done = false;
+        if (done) return;
+        done = true;
+        eval(workload);
+        rb_define_global_function("e2e_block", reinterpret_cast<VALUE (*)(...)>(e2e_block), 1);
+        rb_define_global_function("e2e_native", reinterpret_cast<VALUE (*)(...)>(e2e_native), 1);
+    }
+
+    void SetUp() override {
+        eval("SolarWindsAPM::CProfiler.set_format(:events)");
+        eval("SolarWindsAPM::CProfiler.set_batch_size(0)");
+        eval("SolarWindsAPM::CProfiler.set_overhead_budget(0)");
+        eval("SolarWindsAPM::CProfiler.set_exit_stats(false)");
+        eval("SolarWindsAPM::CProfiler.set_lines(false)");
+        eval("SolarWindsAPM::CProfiler.set_native(false)");
+        eval("SolarWindsAPM::CProfiler.set_frame_ids(true)");
+        eval("SolarWindsAPM::CProfiler.set_mode(:wall)");
+        for (const FakeEvent &event : FakeOboe::events()) add_dict(event);
+        FakeOboe::clear();
+    }
+};
+
+TEST_F(ProfilingE2E, snapshot_stream) {
+    double secs = NUM2DBL(eval("e2e_run(0.3)"));
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    EXPECT_EQ(10, events.front().num("Interval"));
+    EXPECT_EQ("wall", events.front().str("Mode"));
+
+    // about one snapshot per interval, some are lost to timer slack
+    long omitted = 0;
+    long num = (long)snapshots(events, &omitted).size();
+    EXPECT_LT(1, num);
+    EXPECT_LE(secs * 100 / 2, num + omitted);
+    EXPECT_GE(secs * 100 + 2, num + omitted);
+
+    EXPECT_EQ(1u, dict_methods.count("e2e_fib"));
+    EXPECT_EQ(0, FakeOboe::num_errors());
+}
+
+// the frames of the first run are cached already, the second one still
+// gets their dictionary entries in its own trace
+TEST_F(ProfilingE2E, dictionary_per_run) {
+    eval("e2e_run(0.2)");
+    eval("e2e_run(0.2)");
+    vector<vector<FakeEvent> > runs = streams(wait_for_exit(2));
+    ASSERT_EQ(2u, runs.size());
+    for (const vector<FakeEvent> &run : runs) {
+        check_stream(run);
+        set<string> methods;
+        for (const FakeEvent &event : run) {
+            auto frames = event.frames.find("Frames");
+            if (event.str("Label") != "dictionary" || frames == event.frames.end()) continue;
+            for (const FrameData &frame : frames->second) methods.insert(frame.method);
+        }
+        EXPECT_EQ(1u, methods.count("e2e_fib"));
+    }
+}
+
+// without frame ids the snapshots carry the new frames themselves
+TEST_F(ProfilingE2E, new_frames) {
+    eval("SolarWindsAPM::CProfiler.set_frame_ids(false)");
+    eval("e2e_run(0.2)");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    set<string> methods;
+    long snapshots = 0;
+    for (const FakeEvent &event : events) {
+        if (event.str("Label") != "info") continue;
+        EXPECT_FALSE(event.has("NewFrameIds"));
+        auto frames = event.frames.find("NewFrames");
+        ASSERT_TRUE(frames != event.frames.end());
+        for (const FrameData &frame : frames->second) methods.insert(frame.method);
+        snapshots++;
+    }
+    EXPECT_LT(0, snapshots);
+    EXPECT_EQ(1u, methods.count("e2e_fib"));
+}
+
+TEST_F(ProfilingE2E, batched_stream) {
+    eval("SolarWindsAPM::CProfiler.set_batch_size(8)");
+    eval("e2e_run(0.3)");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    long omitted = 0;
+    long batches = 0;
+    for (const FakeEvent &event : events) {
+        EXPECT_NE("info", event.str("Label"));
+        if (event.str("Label") == "batch") batches++;
+    }
+    EXPECT_LT(0, batches);
+    EXPECT_LT(batches, (long)snapshots(events, &omitted).size());
+}
+
+// the time spent in the signal handler jobs, relative to the workload
+TEST_F(ProfilingE2E, overhead) {
+    long job_ns = sampling_stat("job_ns");
+    double secs = NUM2DBL(eval("e2e_run(0.5)"));
+    job_ns = sampling_stat("job_ns") - job_ns;
+    wait_for_exit();
+
+    EXPECT_LT(0, job_ns);
+    EXPECT_GT(0.05, job_ns / (secs * 1e9)) << job_ns << "ns in " << secs << "s";
+}
+
+// a budget too small to take 3/4 of is refused, the smallest one adapts
+// without dividing by 0
+TEST_F(ProfilingE2E, tiny_overhead_budget) {
+    EXPECT_EQ(Qfalse, eval("SolarWindsAPM::CProfiler.set_overhead_budget(0.0001)"));
+    EXPECT_EQ(0, sampling_stat("overhead_budget_ppm"));
+    eval("SolarWindsAPM::CProfiler.set_overhead_budget(0.0004)");
+    EXPECT_EQ(4, sampling_stat("overhead_budget_ppm"));
+
+    eval("e2e_run(0.5)");  // more than one window
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+    EXPECT_LT(events.front().num("Interval"), events.back().num("Interval"));
+}
+
+TEST_F(ProfilingE2E, stats) {
+    long ticks = stat("[:ticks]");
+    long latencies = stat("[:job_latency][:count]");
+    eval("e2e_run(0.2)");
+    vector<FakeEvent> events = wait_for_exit();
+    EXPECT_FALSE(events.back().has("StatsSamples"));
+
+    EXPECT_LT(ticks, stat("[:ticks]"));
+    EXPECT_LT(latencies, stat("[:job_latency][:count]"));
+    EXPECT_LT(0, stat("[:job_time][:p50_ns]"));
+    EXPECT_GE(stat("[:ticks]"), stat("[:ticks_dropped_signal]") + stat("[:ticks_dropped_job]"));
+
+    string thread = "[:threads].find { |t| t[:tid] == " + to_string(events.front().num("TID")) + " }";
+    EXPECT_LT(0, stat(thread + "[:samples]"));
+    EXPECT_LT(0, stat(thread + "[:cache_misses]"));
+    EXPECT_LT(0, stat(thread + "[:snapshots]"));
+    EXPECT_LT(0, stat(thread + "[:remove_garbage][:count]"));
+    EXPECT_LT(0, stat(thread + "[:logging][:count]"));
+    EXPECT_LE(stat(thread + "[:logging][:max_ns]"), stat(thread + "[:logging][:sum_ns]"));
+}
+
+// the stats of the run in the exit event match the stream
+TEST_F(ProfilingE2E, exit_stats) {
+    eval("SolarWindsAPM::CProfiler.set_exit_stats(true)");
+    eval("e2e_run(0.2)");
+    vector<FakeEvent> events = wait_for_exit();
+    const FakeEvent &exit = events.back();
+
+    long omitted = 0;
+    long num = (long)snapshots(events, &omitted).size();
+    EXPECT_LT(0, exit.num("StatsSamples"));
+    EXPECT_EQ(0, exit.num("StatsSamplesDropped"));
+    EXPECT_EQ(num + omitted, exit.num("StatsSnapshots"));
+    EXPECT_EQ(omitted, exit.num("StatsSnapshotsOmitted"));
+    EXPECT_LT(0, exit.num("StatsRemoveGarbageNs"));
+    EXPECT_LT(0, exit.num("StatsLoggingNs"));
+    EXPECT_TRUE(exit.has("StatsCacheMisses"));
+}
+
+// the ticks while the thread is stuck in C are reported as missed, in the
+// stack of the snapshot before
+TEST_F(ProfilingE2E, missed_samples) {
+    long ticks_missed = stat("[:ticks_missed]");
+    eval("SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_work(0.1); e2e_block(300); e2e_work(0.1) }");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    long missed = 0, blocked = 0, prev_count = -1;
+    for (const FakeEvent &event : events) {
+        if (event.str("Label") == "info") prev_count = event.num("FramesCount");
+        if (event.str("Label") != "missed") continue;
+
+        EXPECT_EQ(prev_count, event.num("FramesCount"));
+        vector<long> timestamps = event.array("SnapshotsMissed");
+        EXPECT_EQ(event.num("MissedCount"), (long)timestamps.size());
+        EXPECT_EQ(timestamps.front(), event.num("Timestamp_u"));
+        missed += event.num("MissedCount");
+        blocked = max(blocked, event.num("BlockedUs"));
+    }
+    EXPECT_LE(20, missed);
+    EXPECT_GE(31, missed);
+    EXPECT_LE(250000, blocked);
+    EXPECT_LE(ticks_missed + missed, stat("[:ticks_missed]"));
+
+    string thread = "[:threads].find { |t| t[:tid] == " + to_string(events.front().num("TID")) + " }";
+    EXPECT_LE(missed, stat(thread + "[:samples_missed]"));
+}
+
+// GC.start is a major GC in one step, attributed to the stack that called it
+TEST_F(ProfilingE2E, gc_pauses) {
+    eval("SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_gc }");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    long full = 0, pauses = 0;
+    for (const FakeEvent &event : events) {
+        if (event.str("Label") != "gc") continue;
+
+        vector<long> timestamps = event.array("Timestamps");
+        vector<long> mark_ns = event.array("MarkNs");
+        vector<long> flags = event.array("GcFlags");
+        ASSERT_EQ(timestamps.size(), mark_ns.size());
+        ASSERT_EQ(timestamps.size(), event.array("SweepNs").size());
+        ASSERT_EQ(timestamps.size(), flags.size());
+        EXPECT_EQ(timestamps.front(), event.num("Timestamp_u"));
+
+        bool in_e2e_gc = false;
+        for (long id : event.array("FrameIds")) {
+            EXPECT_EQ(1u, dict_ids.count(id)) << id;
+            if (dict_names[id] == "e2e_gc") in_e2e_gc = true;
+        }
+        EXPECT_TRUE(in_e2e_gc);
+
+        for (size_t i = 0; i < flags.size(); i++) {
+            if (flags[i] == (GC_PAUSE_MAJOR | GC_PAUSE_START | GC_PAUSE_END)) {
+                full++;
+                EXPECT_LT(0, mark_ns[i]);
+            }
+        }
+        pauses += timestamps.size();
+    }
+    EXPECT_LE(3, full);
+
+    string thread = "[:threads].find { |t| t[:tid] == " + to_string(events.front().num("TID")) + " }";
+    EXPECT_LE(pauses, stat(thread + "[:gc_pauses][:count]"));
+
+    // and none without the GC events
+    eval("SolarWindsAPM::CProfiler.set_gc_events(false)");
+    FakeOboe::clear();
+    eval("SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_gc }");
+    events = wait_for_exit();
+    eval("SolarWindsAPM::CProfiler.set_gc_events(true)");
+    for (const FakeEvent &event : events) EXPECT_NE("gc", event.str("Label"));
+}
+
+// weighted counts and bytes of the allocations per stack, by the method
+// on the stack
+static map<string, pair<long, long> > alloc_totals(const vector<FakeEvent> &events, long *samples) {
+    map<string, pair<long, long> > totals;
+    for (const FakeEvent &event : events) {
+        if (event.str("Label") != "alloc") continue;
+        *samples += event.num("Samples");
+
+        vector<long> num_frames = event.array("StackFrameCounts");
+        vector<long> ids = event.array("FrameIds");
+        vector<long> counts = event.array("Allocations");
+        vector<long> bytes = event.array("Bytes");
+        EXPECT_EQ(num_frames.size(), counts.size());
+        EXPECT_EQ(num_frames.size(), bytes.size());
+
+        size_t next = 0;
+        for (size_t i = 0; i < num_frames.size(); i++) {
+            set<string> methods;
+            for (long j = 0; j < num_frames[i]; j++) {
+                EXPECT_EQ(1u, dict_ids.count(ids[next + j])) << ids[next + j];
+                methods.insert(dict_names[ids[next + j]]);
+            }
+            next += num_frames[i];
+            for (const string &method : methods) {
+                totals[method].first += counts[i];
+                totals[method].second += bytes[i];
+            }
+        }
+        EXPECT_EQ(ids.size(), next);
+    }
+    return totals;
+}
+
+// one in 100 allocations, weighted they add up to all of them
+TEST_F(ProfilingE2E, alloc_samples) {
+    eval("SolarWindsAPM::CProfiler.set_alloc_interval(100)");
+    eval("SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_strings(200_000); e2e_arrays(100_000) }");
+    eval("SolarWindsAPM::CProfiler.set_alloc_interval(0)");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    long samples = 0;
+    map<string, pair<long, long> > totals = alloc_totals(events, &samples);
+    EXPECT_LT(1000, samples);
+    EXPECT_NEAR(200000, totals["e2e_strings"].first, 20000);
+    EXPECT_NEAR(100000, totals["e2e_arrays"].first, 10000);
+    EXPECT_LE(40 * totals["e2e_strings"].first, totals["e2e_strings"].second);
+    EXPECT_LE(400 * totals["e2e_arrays"].first, totals["e2e_arrays"].second);
+
+    string thread = "[:threads].find { |t| t[:tid] == " + to_string(events.front().num("TID")) + " }";
+    EXPECT_LE(samples, stat(thread + "[:alloc_samples]"));
+}
+
+// sampling every allocation is over the budget, the interval goes up
+TEST_F(ProfilingE2E, alloc_budget) {
+    eval("SolarWindsAPM::CProfiler.set_alloc_interval(1)");
+    eval("SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_strings(3_000_000) }");
+    long interval = stat("[:alloc_interval]");
+    eval("SolarWindsAPM::CProfiler.set_alloc_interval(0)");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    EXPECT_LT(1, interval);
+    long samples = 0;
+    map<string, pair<long, long> > totals = alloc_totals(events, &samples);
+    EXPECT_NEAR(3000000, totals["e2e_strings"].first, 300000);
+}
+
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+// sleeping, then sharing the GVL with a busy thread that takes the ticks
+TEST_F(ProfilingE2E, gvl_states) {
+    eval("$e2e_busy = Thread.new { e2e_work(0.6) }\n"
+         "SolarWindsAPM::CProfiler.run(Thread.current, 10) { sleep 0.2; e2e_work(0.4) }\n"
+         "$e2e_busy.join");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    long wait_us = 0, off_cpu_us = 0, long_off_cpu = 0;
+    for (const FakeEvent &event : events) {
+        if (event.str("Label") != "gvl") continue;
+        vector<long> states = event.array("States");
+        vector<long> durations = event.array("DurationsUs");
+        ASSERT_EQ(states.size(), event.array("Timestamps").size());
+        ASSERT_EQ(states.size(), durations.size());
+        wait_us += event.num("GvlWaitUs");
+        off_cpu_us += event.num("OffCpuUs");
+        for (size_t i = 0; i < states.size(); i++)
+            if (states[i] == GVL_STATE_OFF_CPU && durations[i] >= 190000) long_off_cpu++;
+    }
+    EXPECT_EQ(1, long_off_cpu);  // the sleep
+    EXPECT_LE(200000, off_cpu_us);
+    EXPECT_LE(100000, wait_us);  // about half of the 0.4s
+
+    // the ticks of the busy thread
+    long gvl_wait = 0, off_cpu = 0, omitted = 0;
+    for (const Snapshot &snap : snapshots(events, &omitted)) {
+        for (long id : snap.new_ids) {
+            if (id == FRAME_ID_GVL_WAIT) gvl_wait++;
+            if (id == FRAME_ID_OFF_CPU) off_cpu++;
+        }
+    }
+    EXPECT_LE(1, gvl_wait);
+    EXPECT_LE(1, off_cpu);
+
+    string thread = "[:threads].find { |t| t[:tid] == " + to_string(events.front().num("TID")) + " }";
+    EXPECT_LT(0, stat(thread + "[:gvl_waits][:count]"));
+    EXPECT_EQ(0, stat(thread + "[:gvl_dropped]"));
+}
+#endif
+
+// line mode, e2e_work calls e2e_a on line 7 and e2e_b on line 8 of the
+// workload, the frame stays the same, the snapshots tell the lines apart
+TEST_F(ProfilingE2E, lines) {
+    eval("SolarWindsAPM::CProfiler.set_lines(true)");
+    eval("SolarWindsAPM::CProfiler.set_batch_size(8)");
+    eval("e2e_run(0.3)");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    set<long> work_ids, work_lines;
+    for (const FakeEvent &event : events) {
+        vector<long> ids = event.array("NewFrameIds");
+        vector<long> lines = event.array("NewFrameLines");
+        ASSERT_EQ(ids.size(), lines.size()) << event.str("Label");
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (dict_names[ids[i]] != "e2e_work") continue;
+            work_ids.insert(ids[i]);
+            work_lines.insert(lines[i]);
+        }
+    }
+    EXPECT_EQ(1u, work_ids.size());
+    EXPECT_EQ(1u, work_lines.count(7));
+    EXPECT_EQ(1u, work_lines.count(8));
+
+    // the call tree counts them apart
+    FakeOboe::clear();
+    eval("SolarWindsAPM::CProfiler.set_format(:collapsed)");
+    eval("e2e_run(0.3)");
+    string stacks;
+    for (const FakeEvent &event : wait_for_exit()) stacks += event.str("Profile");
+    EXPECT_NE(string::npos, stacks.find("#e2e_work:7;Object#e2e_a:"));
+    EXPECT_NE(string::npos, stacks.find("#e2e_work:8;Object#e2e_b:"));
+}
+
+// the frames of the test binary show up under the e2e_native <cfunc> frame,
+// dladdr() only knows them by the name of the binary, the <cfunc> frame
+// only by its class on Ruby 3
+TEST_F(ProfilingE2E, native_frames) {
+    if (eval("SolarWindsAPM::CProfiler.set_native(true)") != Qtrue) return;  // not supported
+    eval("SolarWindsAPM::CProfiler.set_mode(:cpu)");
+    eval("SolarWindsAPM::CProfiler.run(Thread.current, 10) { e2e_native(300) }");
+    vector<FakeEvent> events = wait_for_exit();
+    check_stream(events);
+
+    // the same file, whatever path the binary was started with
+    char exe[PATH_MAX], file[PATH_MAX];
+    ASSERT_TRUE(realpath("/proc/self/exe", exe));
+
+    set<long> native_ids;
+    for (const auto &frame : dict_frames)
+        if (realpath(frame.second.file.c_str(), file) && strcmp(file, exe) == 0) native_ids.insert(frame.first);
+    ASSERT_FALSE(native_ids.empty());
+
+    // leaf first, the native frames come right before e2e_native
+    int spliced = 0;
+    long omitted = 0;
+    for (const Snapshot &snap : snapshots(events, &omitted)) {
+        for (size_t i = 0; i + 1 < snap.new_ids.size(); i++) {
+            if (!native_ids.count(snap.new_ids[i]) || native_ids.count(snap.new_ids[i + 1])) continue;
+            FrameData &caller = dict_frames[snap.new_ids[i + 1]];
+            EXPECT_EQ("<cfunc>", caller.file);
+            EXPECT_EQ("Kernel", caller.klass);
+            spliced++;
+        }
+    }
+    EXPECT_LT(0, spliced);
+}
+
+// two fibers of the thread take turns, each in a run of its own, the
+// snapshots of each run only have the frames of its fiber, in CPU mode the
+// fibers share the timer of the thread
+TEST_F(ProfilingE2E, fibers) {
+    eval("SolarWindsAPM::CProfiler.set_batch_size(8)");
+    for (const char *mode : {"wall", "cpu"}) {
+        FakeOboe::clear();
+        eval(string("SolarWindsAPM::CProfiler.set_mode(:") + mode + ")");
+        eval("$e2e_fibers = [true, false].map do |a|\n"
+             "  Fiber.new { SolarWindsAPM::CProfiler.run(Thread.current, 10) { 6.times { e2e_fiber(0.05, a); Fiber.yield } } }\n"
+             "end\n"
+             "7.times { $e2e_fibers.each(&:resume) }");
+        vector<vector<FakeEvent> > runs = streams(wait_for_exit(2));
+        ASSERT_EQ(2u, runs.size()) << mode;
+        EXPECT_EQ(runs[0].front().num("TID"), runs[1].front().num("TID"));
+
+        const char *own[2] = {"e2e_a", "e2e_b"};
+        for (int i = 0; i < 2; i++) {
+            check_stream(runs[i]);
+            long omitted = 0, own_frames = 0, other_threads = 0;
+            for (const Snapshot &snap : snapshots(runs[i], &omitted)) {
+                for (long id : snap.new_ids) {
+                    EXPECT_NE(own[1 - i], dict_names[id]) << mode << " run " << i;
+                    if (dict_names[id] == own[i]) own_frames++;
+                    if (id == FRAME_ID_OTHER_THREAD) other_threads++;
+                }
+            }
+            EXPECT_LT(0, own_frames) << mode << " run " << i;
+            // while the other fiber runs, the CPU timer only samples the running one
+            if (string(mode) == "wall") {
+                EXPECT_LT(0, other_threads) << "run " << i;
+            }
+        }
+        EXPECT_EQ(0, stat("[:threads].count { |t| t[:running] }"));
+    }
+}
+
+// the hooks of the profiler are only on during a run
+TEST_F(ProfilingE2E, hooks_off_between_runs) {
+    const char *enabled = "ObjectSpace.each_object(TracePoint).count(&:enabled?)";
+    long before = NUM2LONG(eval(enabled));
+    eval("$e2e_enabled = nil\n"
+         "SolarWindsAPM::CProfiler.run(Thread.current, 10) { $e2e_enabled = " + string(enabled) + " }");
+    wait_for_exit();
+    EXPECT_EQ(0, before);  // nothing else in here uses them
+    EXPECT_LT(0, NUM2LONG(eval("$e2e_enabled")));
+    EXPECT_EQ(0, NUM2LONG(eval(enabled)));
+}
+
+// the thread ends while a fiber of it is in the middle of its run, the
+// run ends with the thread, the hooks go off again
+TEST_F(ProfilingE2E, thread_exit_in_fiber_run) {
+    const char *enabled = "ObjectSpace.each_object(TracePoint).count(&:enabled?)";
+    eval("Thread.new { Fiber.new { SolarWindsAPM::CProfiler.run(Thread.current, 10) { Fiber.yield } }.resume }.join");
+    for (int i = 0; i < 100 && NUM2LONG(eval(enabled)) > 0; i++) eval("sleep 0.01");
+    EXPECT_EQ(0, NUM2LONG(eval(enabled)));
+    EXPECT_EQ(0, stat("[:threads].count { |t| t[:running] }"));
+}
+
+// profiling is off in oboe
+TEST_F(ProfilingE2E, interval_0) {
+    FakeOboe::set_interval(0);
+    eval("e2e_run(0.05)");
+    FakeOboe::set_interval(10);
+    usleep(100000);
+    EXPECT_EQ(0u, FakeOboe::num_events());
+}
@@ -0,0 +1,102 @@
+#include "../src/ring_file.h"
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+static std::string ring_path() {
+    return "/tmp/ring_file_test." + std::to_string((long)getpid()) + ".ring";
+}
+
+static std::vector<std::string> read_all(const std::string &path, std::vector<uint64_t> *seqs = NULL) {
+    std::vector<std::string> records;
+    bool ok = RingFile::read(path, [&](uint64_t seq, const char *payload, size_t len) {
+        if (seqs) seqs->push_back(seq);
+        records.push_back(std::string(payload, len));
+    });
+    EXPECT_TRUE(ok);
+    return records;
+}
+
+TEST(RingFile, append_and_read) {
+    std::string path = ring_path();
+    RingFile ring;
+    ASSERT_TRUE(ring.open(path, RingFile::MIN_SIZE));
+    EXPECT_TRUE(ring.is_open());
+    EXPECT_EQ(path, ring.path());
+
+    EXPECT_TRUE(read_all(path).empty());
+
+    ring.append("first", 5);
+    ring.append("", 0);
+    ring.append("third record", 12);
+
+    // readable while it is open
+    std::vector<uint64_t> seqs;
+    std::vector<std::string> records = read_all(path, &seqs);
+    ASSERT_EQ(3u, records.size());
+    EXPECT_EQ("first", records[0].substr(0, 5));
+    EXPECT_EQ("third record", records[2].substr(0, 12));
+    EXPECT_EQ((std::vector<uint64_t>{0, 1, 2}), seqs);
+
+    // and after
+    ring.close();
+    EXPECT_FALSE(ring.is_open());
+    EXPECT_EQ(3u, read_all(path).size());
+    unlink(path.c_str());
+}
+
+TEST(RingFile, keeps_the_newest_records) {
+    std::string path = ring_path();
+    RingFile ring;
+    ASSERT_TRUE(ring.open(path, RingFile::MIN_SIZE));
+
+    // records of different sizes, several times the size of the file
+    uint64_t num = 0;
+    for (int i = 0; i < 5000; i++) {
+        std::string rec = std::to_string(i) + ":" + std::string(i % 97, 'x');
+        ASSERT_TRUE(ring.append(rec.data(), rec.size()));
+        num++;
+
+        if (i % 499 == 0 || i == 4999) {
+            std::vector<uint64_t> seqs;
+            std::vector<std::string> records = read_all(path, &seqs);
+            ASSERT_FALSE(records.empty());
+
+            // consecutive and up to the last one
+            EXPECT_EQ(num - 1, seqs.back());
+            for (size_t j = 1; j < seqs.size(); j++) EXPECT_EQ(seqs[j - 1] + 1, seqs[j]);
+            for (size_t j = 0; j < records.size(); j++) {
+                std::string prefix = std::to_string(seqs[j]) + ":";
+                EXPECT_EQ(prefix, records[j].substr(0, prefix.size()));
+            }
+        }
+    }
+
+    // most of the file is in use
+    std::vector<std::string> records = read_all(path);
+    size_t bytes = 0;
+    for (const std::string &rec : records) bytes += rec.size() + RingFile::RECORD_HEADER_SIZE;
+    EXPECT_GT(bytes, (size_t)RingFile::MIN_SIZE / 2);
+
+    ring.close();
+    unlink(path.c_str());
+}
+
+TEST(RingFile, rejects_records_larger_than_the_file) {
+    std::string path = ring_path();
+    RingFile ring;
+    ASSERT_TRUE(ring.open(path, RingFile::MIN_SIZE));
+
+    std::string large(RingFile::MIN_SIZE, 'x');
+    EXPECT_FALSE(ring.append(large.data(), large.size()));
+    EXPECT_TRUE(ring.append("small", 5));
+    EXPECT_EQ(1u, read_all(path).size());
+
+    ring.close();
+    EXPECT_FALSE(ring.append("closed", 6));
+    unlink(path.c_str());
+}
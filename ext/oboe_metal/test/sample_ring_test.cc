@@ -0,0 +1,104 @@
+#include "../src/sample_ring.h"
+
+#include <deque>
+
+#include "gtest/gtest.h"
+#include "ruby/ruby.h"
+
+static SampleRing ring;
+
+TEST(SampleRing, push_and_pop) {
+    ring.clear();
+    VALUE frames[3] = {(VALUE)11, (VALUE)12, (VALUE)13};
+    SampleRing::Record rec;
+
+    EXPECT_TRUE(ring.empty());
+    EXPECT_FALSE(ring.peek(rec));
+
+    EXPECT_TRUE(ring.push(SampleRing::SAMPLE, 1000, 7, frames, 3));
+    EXPECT_FALSE(ring.empty());
+
+    ASSERT_TRUE(ring.peek(rec));
+    EXPECT_EQ(SampleRing::SAMPLE, rec.kind);
+    EXPECT_EQ(3, rec.num);
+    EXPECT_EQ(1000, rec.ts);
+    EXPECT_EQ(7UL, rec.tick);
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(frames[i], rec.frames[i]);
+
+    ring.pop(rec);
+    EXPECT_TRUE(ring.empty());
+}
+
+TEST(SampleRing, full) {
+    ring.clear();
+    static VALUE frames[2048];
+    SampleRing::Record rec;
+
+    // fill it up, the last push has to fail instead of overwriting
+    int pushed = 0;
+    while (ring.push(SampleRing::SAMPLE, pushed, pushed, frames, 2048)) pushed++;
+    EXPECT_EQ((int)(SampleRing::CAPACITY / (2048 + 3)), pushed);
+
+    // after popping one the next record and its padding would only fit
+    // into the room kept for ENTRY and EXIT, after popping two it fits
+    ASSERT_TRUE(ring.peek(rec));
+    EXPECT_EQ(0, rec.ts);
+    ring.pop(rec);
+    EXPECT_FALSE(ring.push(SampleRing::SAMPLE, pushed, pushed, frames, 2048));
+    ASSERT_TRUE(ring.peek(rec));
+    EXPECT_EQ(1, rec.ts);
+    ring.pop(rec);
+    EXPECT_TRUE(ring.push(SampleRing::SAMPLE, pushed, pushed, frames, 2048));
+}
+
+TEST(SampleRing, wrap_around) {
+    ring.clear();
+    static VALUE frames[2048];
+    for (int i = 0; i < 2048; i++) frames[i] = (VALUE)(i + 100);
+    SampleRing::Record rec;
+    std::deque<int> expected;
+
+    // push records of varying size, so that they have to wrap around
+    // at different positions, and check they come out unchanged and in order
+    for (long i = 0; i < 1000; i++) {
+        int num = (int)((i * 397) % 2048) + 1;
+        while (!ring.push(SampleRing::SAMPLE, i, i, frames, num)) {
+            ASSERT_TRUE(ring.peek(rec));
+            ASSERT_EQ(expected.front(), rec.num);
+            EXPECT_EQ(frames[rec.num - 1], rec.frames[rec.num - 1]);
+            expected.pop_front();
+            ring.pop(rec);
+        }
+        expected.push_back(num);
+    }
+
+    long prev_ts = -1;
+    while (ring.peek(rec)) {
+        EXPECT_EQ(expected.front(), rec.num);
+        EXPECT_LT(prev_ts, rec.ts) << "records out of order";
+        prev_ts = rec.ts;
+        expected.pop_front();
+        ring.pop(rec);
+    }
+    EXPECT_TRUE(expected.empty());
+}
+
+TEST(SampleRing, control_reserve) {
+    ring.clear();
+    static VALUE frames[2048];
+    SampleRing::Record rec;
+
+    // samples stop short of the reserve, ENTRY and EXIT still fit in
+    while (ring.push(SampleRing::SAMPLE, 0, 0, frames, 1)) {}
+    EXPECT_FALSE(ring.push(SampleRing::MISSED, 0, 0, frames, 1));
+    EXPECT_TRUE(ring.push(SampleRing::EXIT, 1, 1, frames, 4));
+    EXPECT_TRUE(ring.push(SampleRing::ENTRY, 2, 2, frames, 16));
+
+    int kinds = 0;
+    while (ring.peek(rec)) {
+        if (rec.kind != SampleRing::SAMPLE) kinds = kinds * 10 + rec.kind;
+        ring.pop(rec);
+    }
+    EXPECT_EQ(SampleRing::EXIT * 10 + SampleRing::ENTRY, kinds);
+}
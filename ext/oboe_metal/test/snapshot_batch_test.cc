@@ -0,0 +1,60 @@
+#include "../src/snapshot_batch.h"
+
+#include "gtest/gtest.h"
+
+TEST(SnapshotBatch, columns) {
+    SnapshotBatch batch;
+    EXPECT_TRUE(batch.empty());
+
+    long ids1[] = {11, 12, 13};
+    long ids2[] = {14};
+    batch.add(1000, ids1, 3, 0, 3);
+    batch.add_omitted(1010);
+    batch.add_omitted(1020);
+    batch.add(1030, ids2, 1, 2, 2);
+    batch.add(1040, NULL, 0, 1, 1);
+
+    EXPECT_FALSE(batch.empty());
+    EXPECT_EQ(3u, batch.size());
+    EXPECT_EQ(1000, batch.first_ts());
+
+    EXPECT_EQ((std::vector<long>{1000, 1030, 1040}), batch.timestamps);
+    EXPECT_EQ((std::vector<long>{0, 2, 1}), batch.exited);
+    EXPECT_EQ((std::vector<long>{3, 2, 1}), batch.counts);
+    EXPECT_EQ((std::vector<long>{3, 1, 0}), batch.new_counts);
+    EXPECT_EQ((std::vector<long>{11, 12, 13, 14}), batch.new_ids);
+    EXPECT_EQ((std::vector<long>{1010, 1020}), batch.omitted);
+}
+
+TEST(SnapshotBatch, lines) {
+    SnapshotBatch batch;
+    long ids1[] = {11, 12};
+    long lines1[] = {5, 20};
+    long ids2[] = {11};
+    long lines2[] = {6};
+
+    batch.add(1000, ids1, 2, 0, 2, lines1);
+    batch.add(1010, ids2, 1, 1, 2, lines2);
+    EXPECT_EQ((std::vector<long>{11, 12, 11}), batch.new_ids);
+    EXPECT_EQ((std::vector<long>{5, 20, 6}), batch.new_lines);
+
+    batch.clear();
+    EXPECT_TRUE(batch.new_lines.empty());
+}
+
+TEST(SnapshotBatch, clear) {
+    SnapshotBatch batch;
+    long ids[] = {1, 2};
+
+    batch.add(1000, ids, 2, 0, 2);
+    batch.clear();
+    EXPECT_TRUE(batch.empty());
+    EXPECT_EQ(0u, batch.size());
+    EXPECT_TRUE(batch.new_ids.empty());
+
+    // an omitted snapshot can start a batch
+    batch.add_omitted(2000);
+    EXPECT_FALSE(batch.empty());
+    EXPECT_EQ(0u, batch.size());
+    EXPECT_EQ(2000, batch.first_ts());
+}
@@ -0,0 +1,64 @@
+#include "../src/string_arena.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+TEST(StringArena, intern) {
+    StringArena arena;
+
+    EXPECT_EQ(StringArena::EMPTY, arena.intern("", 0));
+    EXPECT_STREQ("", arena.str(StringArena::EMPTY));
+
+    StringArena::Ref file = arena.intern(std::string("/app/models/user.rb"));
+    StringArena::Ref method = arena.intern("save", 4);
+    EXPECT_NE(file, method);
+    EXPECT_STREQ("/app/models/user.rb", arena.str(file));
+    EXPECT_STREQ("save", arena.str(method));
+
+    // the same string is stored once
+    size_t size = arena.size();
+    EXPECT_EQ(file, arena.intern(std::string("/app/models/user.rb")));
+    EXPECT_EQ(method, arena.intern("save!", 4));  // only len counts
+    EXPECT_EQ(size, arena.size());
+    EXPECT_EQ(2u, arena.count());
+
+    // prefixes are different strings
+    StringArena::Ref prefix = arena.intern("sav", 3);
+    EXPECT_NE(method, prefix);
+    EXPECT_STREQ("sav", arena.str(prefix));
+}
+
+TEST(StringArena, grows_and_keeps_strings) {
+    StringArena arena;
+    std::vector<StringArena::Ref> refs;
+
+    for (int i = 0; i < 20000; i++)
+        refs.push_back(arena.intern("method_" + std::to_string(i)));
+    EXPECT_EQ(20000u, arena.count());
+
+    for (int i = 0; i < 20000; i++) {
+        EXPECT_EQ("method_" + std::to_string(i), arena.str(refs[i]));
+        EXPECT_EQ(refs[i], arena.intern("method_" + std::to_string(i)));
+    }
+    EXPECT_EQ(20000u, arena.count());
+}
+
+TEST(StringArena, clear_and_swap) {
+    StringArena arena;
+    for (int i = 0; i < 1000; i++)
+        arena.intern("/app/file_" + std::to_string(i) + ".rb");
+
+    StringArena other;
+    StringArena::Ref ref = other.intern(std::string("kept"));
+    arena.swap(other);
+    EXPECT_EQ(1u, arena.count());
+    EXPECT_STREQ("kept", arena.str(ref));
+    EXPECT_EQ(1000u, other.count());
+
+    other.clear();
+    EXPECT_EQ(0u, other.count());
+    EXPECT_EQ(1u, other.size());  // the empty string
+    EXPECT_STREQ("", other.str(StringArena::EMPTY));
+}
@@ -148,6 +148,22 @@ module SolarWindsAPM
 
       @@config[:profiling] = :disabled
       @@config[:profiling_interval] = 5
+      @@config[:profiling_frame_cache_bytes] = 4 * 1024 * 1024
+      @@config[:profiling_mode] = :wall
+      @@config[:profiling_threads_per_tick] = 0
+      @@config[:profiling_overhead_budget] = 0
+      @@config[:profiling_batch_size] = 0
+      @@config[:profiling_batch_ms] = 1000
+      @@config[:profiling_format] = :events
+      @@config[:profiling_ring_dir] = nil
+      @@config[:profiling_ring_bytes] = 16 * 1024 * 1024
+      @@config[:profiling_exit_stats] = false
+      @@config[:profiling_gc_events] = true
+      @@config[:profiling_alloc_interval] = 0
+      @@config[:profiling_gvl_events] = true
+      @@config[:profiling_lines] = false
+      @@config[:profiling_native] = false
+      @@config[:profiling_frame_ids] = false
 
       # Always load the template, it has all the keys and defaults defined,
       # no guarantee of completeness in the user's config file
@@ -245,6 +261,137 @@ module SolarWindsAPM
         # after it is loaded
         SolarWindsAPM::CProfiler.set_interval(value) if defined? SolarWindsAPM::CProfiler
 
+      elsif key == :profiling_frame_cache_bytes
+        # memory budget of the profiler's frame cache, the profiler
+        # raises it to the minimum of 64KB if needed
+        value = 4 * 1024 * 1024 unless value.is_a?(Integer) && value > 0
+        @@config[:profiling_frame_cache_bytes] = value
+        SolarWindsAPM::CProfiler.set_frame_cache_limit(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_mode
+        # :wall samples on a process wide wall clock timer,
+        # :cpu samples each thread on its own CPU clock
+        value = value.to_sym if value.is_a?(String)
+        unless [:wall, :cpu].include?(value)
+          SolarWindsAPM.logger.warn "[solarwinds_apm/config] :profiling_mode must be :wall or :cpu " \
+                                   "(provided: #{value.inspect}), corrected to :wall"
+          value = :wall
+        end
+        @@config[:profiling_mode] = value
+        SolarWindsAPM::CProfiler.set_mode(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_threads_per_tick
+        # in :wall mode sample up to this many of the other profiled threads
+        # on each tick, needs Ruby 3.3+, 0 reports them as "OTHER THREADS",
+        # or "GVL WAIT" and "OFF CPU" with :profiling_gvl_events
+        value = 0 unless value.is_a?(Integer) && value >= 0
+        @@config[:profiling_threads_per_tick] = value
+        SolarWindsAPM::CProfiler.set_threads_per_tick(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_overhead_budget
+        # percent of one core the profiler may use, the interval is adjusted
+        # to stay within it, 0 keeps the configured interval, the smallest
+        # budget is 0.0004 (4 ppm)
+        value = 0 unless value.is_a?(Numeric) && (value == 0 || value >= 0.0004) && value <= 100
+        @@config[:profiling_overhead_budget] = value
+        SolarWindsAPM::CProfiler.set_overhead_budget(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_batch_size
+        # send up to this many snapshots of a thread in one event,
+        # 0 sends one event per snapshot
+        value = 0 unless value.is_a?(Integer) && value >= 0
+        @@config[:profiling_batch_size] = value
+        SolarWindsAPM::CProfiler.set_batch_size(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_batch_ms
+        # longest time in ms a snapshot is held back in a batch
+        # or in the call tree of the :collapsed format
+        value = 1000 unless value.is_a?(Integer) && value > 0
+        @@config[:profiling_batch_ms] = value
+        SolarWindsAPM::CProfiler.set_batch_ms(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_format
+        # :events sends the snapshots as they come,
+        # :pprof sends one pprof profile per profiled span,
+        # :collapsed sends the sample counts per stack at the end of the span
+        # and every :profiling_batch_ms
+        value = value.to_sym if value.is_a?(String)
+        unless [:events, :pprof, :collapsed].include?(value)
+          SolarWindsAPM.logger.warn "[solarwinds_apm/config] :profiling_format must be :events, :pprof or :collapsed " \
+                                   "(provided: #{value.inspect}), corrected to :events"
+          value = :events
+        end
+        @@config[:profiling_format] = value
+        SolarWindsAPM::CProfiler.set_format(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_ring_dir
+        # also write the profiling events into a memory mapped ring file
+        # per process in this directory, nil turns it off
+        # read them with bin/solarwinds_apm_profile_dump
+        value = nil unless value.is_a?(String) && File.directory?(value)
+        @@config[:profiling_ring_dir] = value
+        if defined? SolarWindsAPM::CProfiler
+          SolarWindsAPM::CProfiler.set_ring_file(value, @@config[:profiling_ring_bytes])
+        end
+
+      elsif key == :profiling_ring_bytes
+        # size of the ring file, the oldest events are overwritten
+        value = 16 * 1024 * 1024 unless value.is_a?(Integer) && value >= 64 * 1024
+        @@config[:profiling_ring_bytes] = value
+        if defined?(SolarWindsAPM::CProfiler) && @@config[:profiling_ring_dir]
+          SolarWindsAPM::CProfiler.set_ring_file(@@config[:profiling_ring_dir], value)
+        end
+
+      elsif key == :profiling_exit_stats
+        # add what profiling a span cost (samples, snapshots, time spent)
+        # to its profiling exit event, CProfiler.stats has the totals
+        value = value == true
+        @@config[:profiling_exit_stats] = value
+        SolarWindsAPM::CProfiler.set_exit_stats(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_gc_events
+        # measure the GC pauses of profiled threads, with the stack that
+        # allocated, only false turns it off
+        value = value != false
+        @@config[:profiling_gc_events] = value
+        SolarWindsAPM::CProfiler.set_gc_events(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_alloc_interval
+        # sample on average one in this many allocations of profiled
+        # threads and send the allocations per stack, 0 turns it off
+        value = 0 unless value.is_a?(Integer) && value >= 0
+        @@config[:profiling_alloc_interval] = value
+        SolarWindsAPM::CProfiler.set_alloc_interval(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_gvl_events
+        # measure how long profiled threads wait for the GVL and how long
+        # they are off CPU, needs Ruby 3.2+, only false turns it off
+        value = value != false
+        @@config[:profiling_gvl_events] = value
+        SolarWindsAPM::CProfiler.set_gvl_events(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_lines
+        # add the current line of each frame to the snapshots, the profile
+        # shows where in a method the time goes, only true turns it on
+        value = value == true
+        @@config[:profiling_lines] = value
+        SolarWindsAPM::CProfiler.set_lines(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_native
+        # add the native frames of C extensions below their <cfunc> frame,
+        # Linux on x86_64 and aarch64 only, only true turns it on
+        value = value == true
+        @@config[:profiling_native] = value
+        SolarWindsAPM::CProfiler.set_native(value) if defined? SolarWindsAPM::CProfiler
+
+      elsif key == :profiling_frame_ids
+        # snapshots carry the ids of their new frames, the frames themselves
+        # come once per trace in dictionary events, collectors that expect
+        # NewFrames in the snapshots need false, only true turns it on
+        value = value == true
+        @@config[:profiling_frame_ids] = value
+        SolarWindsAPM::CProfiler.set_frame_ids(value) if defined? SolarWindsAPM::CProfiler
+
       elsif key == :transaction_settings
         if value.is_a?(Hash)
           SolarWindsAPM::TransactionSettings.compile_url_settings(value[:url])
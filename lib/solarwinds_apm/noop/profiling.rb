@@ -14,8 +14,88 @@ module SolarWindsAPM
       # do nothing
     end
 
+    def self.set_mode(_)
+      # do nothing
+    end
+
+    def self.get_mode
+      :wall
+    end
+
+    def self.set_threads_per_tick(_)
+      # do nothing
+    end
+
+    def self.set_overhead_budget(_)
+      # do nothing
+    end
+
+    def self.set_format(_)
+      # do nothing
+    end
+
+    def self.get_format
+      :events
+    end
+
+    def self.set_ring_file(_, _)
+      # do nothing
+    end
+
+    def self.set_batch_size(_)
+      # do nothing
+    end
+
+    def self.set_batch_ms(_)
+      # do nothing
+    end
+
+    def self.sampling_stats
+      {}
+    end
+
+    def self.stats
+      {}
+    end
+
+    def self.set_exit_stats(_)
+      # do nothing
+    end
+
+    def self.set_gc_events(_)
+      # do nothing
+    end
+
+    def self.set_alloc_interval(_)
+      # do nothing
+    end
+
+    def self.set_gvl_events(_)
+      # do nothing
+    end
+
+    def self.set_lines(_)
+      # do nothing
+    end
+
+    def self.set_native(_)
+      # do nothing
+    end
+
+    def self.set_frame_ids(_)
+      # do nothing
+    end
+
     def self.get_tid
       return 0
     end
+
+    def self.set_frame_cache_limit(_)
+      # do nothing
+    end
+
+    def self.frame_cache_stats
+      {}
+    end
   end
 end
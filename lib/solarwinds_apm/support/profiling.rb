@@ -22,4 +22,31 @@ module SolarWindsAPM
       end
     end
   end
+
+  # the config is loaded before the c-extension, hand over the settings
+  if SolarWindsAPM::Config[:profiling_frame_cache_bytes]
+    CProfiler.set_frame_cache_limit(SolarWindsAPM::Config[:profiling_frame_cache_bytes])
+  end
+  CProfiler.set_mode(SolarWindsAPM::Config[:profiling_mode]) if SolarWindsAPM::Config[:profiling_mode]
+  if SolarWindsAPM::Config[:profiling_threads_per_tick]
+    CProfiler.set_threads_per_tick(SolarWindsAPM::Config[:profiling_threads_per_tick])
+  end
+  if SolarWindsAPM::Config[:profiling_overhead_budget]
+    CProfiler.set_overhead_budget(SolarWindsAPM::Config[:profiling_overhead_budget])
+  end
+  CProfiler.set_format(SolarWindsAPM::Config[:profiling_format]) if SolarWindsAPM::Config[:profiling_format]
+  if SolarWindsAPM::Config[:profiling_ring_dir]
+    CProfiler.set_ring_file(SolarWindsAPM::Config[:profiling_ring_dir], SolarWindsAPM::Config[:profiling_ring_bytes])
+  end
+  CProfiler.set_batch_size(SolarWindsAPM::Config[:profiling_batch_size]) if SolarWindsAPM::Config[:profiling_batch_size]
+  CProfiler.set_batch_ms(SolarWindsAPM::Config[:profiling_batch_ms]) if SolarWindsAPM::Config[:profiling_batch_ms]
+  CProfiler.set_exit_stats(SolarWindsAPM::Config[:profiling_exit_stats])
+  CProfiler.set_gc_events(SolarWindsAPM::Config[:profiling_gc_events])
+  if SolarWindsAPM::Config[:profiling_alloc_interval]
+    CProfiler.set_alloc_interval(SolarWindsAPM::Config[:profiling_alloc_interval])
+  end
+  CProfiler.set_gvl_events(SolarWindsAPM::Config[:profiling_gvl_events])
+  CProfiler.set_lines(SolarWindsAPM::Config[:profiling_lines])
+  CProfiler.set_native(SolarWindsAPM::Config[:profiling_native])
+  CProfiler.set_frame_ids(SolarWindsAPM::Config[:profiling_frame_ids])
 end
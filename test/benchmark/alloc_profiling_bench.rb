@@ -0,0 +1,31 @@
+# Copyright (c) 2021 SolarWinds, LLC.
+# All rights reserved.
+
+require 'benchmark/ips'
+require_relative '../minitest_helper'
+
+# cost of the allocation profiler at several sampling intervals,
+# 0 is profiling without allocation samples
+ENV['SW_APM_GEM_VERBOSE'] = 'false'
+
+n = 10_000
+x = 'x'
+
+Benchmark.ips do |bm|
+  bm.config(:time => 10, :warmup => 2)
+
+  [0, 4096, 512, 64, 1].each do |interval|
+    bm.report("alloc_interval #{interval}") do
+      SolarWindsAPM::Config[:profiling_alloc_interval] = interval
+      SolarWindsAPM::SDK.start_trace(:bench) do
+        SolarWindsAPM::Profiling.run do
+          n.times { x * 100 }
+        end
+      end
+    end
+  end
+
+  bm.compare!
+end
+
+SolarWindsAPM::Config[:profiling_alloc_interval] = 0
@@ -1,4 +1,7 @@
 require 'minitest_helper'
+require 'json'
+require 'tmpdir'
+require 'zlib'
 
 describe "Profiling: " do
   class TestMethods
@@ -24,17 +27,37 @@ describe "Profiling: " do
     end
   end
 
+  # the events are logged by the encoder thread, give it time to catch up
+  def profiling_traces
+    sleep 0.1
+    get_all_traces.select { |tr| tr['Spec'] == 'profiling' }
+  end
+
+  # frame id => frame info, from the dictionary events
+  def frame_dictionary(traces)
+    dict = {}
+    traces.select { |tr| tr['Label'] == 'dictionary' }.each do |tr|
+      tr['FrameIds'].each_with_index { |id, i| dict[id] = tr['Frames'][i] }
+    end
+    dict
+  end
+
   before do
     clear_all_traces
     @profiling_config = SolarWindsAPM::Config.profiling
     @profiling_interval_config = SolarWindsAPM::Config.profiling_interval
+    @profiling_mode_config = SolarWindsAPM::Config.profiling_mode
+    @profiling_frame_ids_config = SolarWindsAPM::Config.profiling_frame_ids
 
     SolarWindsAPM::Config[:profiling] = :enabled
+    SolarWindsAPM::Config[:profiling_frame_ids] = true
   end
 
   after do
     SolarWindsAPM::Config[:profiling] = @profiling_config
     SolarWindsAPM::Config[:profiling_interval] = @profiling_interval_config
+    SolarWindsAPM::Config[:profiling_mode] = @profiling_mode_config
+    SolarWindsAPM::Config[:profiling_frame_ids] = @profiling_frame_ids_config
   end
 
   it 'check entry, edges, and exit' do
@@ -49,8 +72,7 @@ describe "Profiling: " do
       assert_equal xtrace_context, SolarWindsAPM::Context.toString
     end
 
-    traces = get_all_traces
-    traces.select! { |tr| tr['Spec'] == "profiling" }
+    traces = profiling_traces
 
     assert_equal 1, traces.select { |tr| tr['Label'] == 'entry' }.size, "no entry found #{traces.pretty_inspect}"
     assert traces.select { |tr| tr['Label'] == 'exit' }.size >= 1
@@ -62,19 +84,367 @@ describe "Profiling: " do
     assert_equal SolarWindsAPM::TraceString.span_id(xtrace_context), entry_trace['SpanRef']
     assert_equal 13, entry_trace['Interval']
     assert_equal 'ruby', entry_trace['Language']
+    assert_equal 'wall', entry_trace['Mode']
     assert_equal tid, entry_trace['TID']
 
-    # check an edge
-    snapshot_trace = traces.find { |tr| tr['Label'] == 'info' }
+    # check an edge, the first event after the entry may be a dictionary
+    snapshot_trace = traces.find { |tr| ['info', 'dictionary'].include?(tr['Label']) }
     assert_equal SolarWindsAPM::TraceString.span_id(xtrace_context), snapshot_trace['ContextOpId']
     assert_equal SolarWindsAPM::TraceString.span_id(entry_trace['X-Trace']), snapshot_trace['Edge']
 
     # check last edge
-    snapshot_trace = traces.select { |tr| tr['Label'] == 'info' }.last
+    snapshot_trace = traces.select { |tr| ['info', 'dictionary'].include?(tr['Label']) }.last
     exit_trace = traces.find { |tr| tr['Label'] == 'exit' }
     assert (exit_trace['SnapshotsOmitted'].size > 0), "no omitted snapshot found"
     assert_equal SolarWindsAPM::TraceString.span_id(snapshot_trace['X-Trace']), exit_trace['Edge']
     assert_equal tid, exit_trace['TID']
+    assert_equal 13, exit_trace['Interval']
+  end
+
+  it 'increases the interval to stay within the overhead budget' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      # far less than what sampling every ms costs
+      SolarWindsAPM::Config[:profiling_overhead_budget] = 0.001
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          50.times { TestMethods.recurse(1500) }
+          TestMethods.sleep_a_bit(0.5)
+        end
+      end
+
+      traces = profiling_traces
+      entry_trace = traces.find { |tr| tr['Label'] == 'entry' }
+      exit_trace = traces.find { |tr| tr['Label'] == 'exit' }
+      assert exit_trace['Interval'] > entry_trace['Interval'],
+             "interval did not increase, #{entry_trace['Interval']} -> #{exit_trace['Interval']}"
+      assert SolarWindsAPM::CProfiler.sampling_stats[:overhead_ppm] > 0
+    ensure
+      SolarWindsAPM::Config[:profiling_overhead_budget] = 0
+    end
+  end
+
+  it 'only samples while the thread is on the CPU in cpu mode' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    SolarWindsAPM::Config[:profiling_mode] = :cpu
+    SolarWindsAPM::SDK.start_trace(:trace) do
+      SolarWindsAPM::Profiling.run do
+        200.times { TestMethods.recurse(1500) }
+        TestMethods.sleep_a_bit(0.5)
+      end
+    end
+
+    traces = profiling_traces
+    entry_trace = traces.find { |tr| tr['Label'] == 'entry' }
+    assert_equal 'cpu', entry_trace['Mode']
+
+    # no samples while sleeping, about 500 in wall clock mode
+    frames = frame_dictionary(traces)
+    samples = traces.select { |tr| tr['Label'] == 'info' }
+    omitted = samples.sum { |tr| tr['SnapshotsOmitted'].size } +
+              traces.find { |tr| tr['Label'] == 'exit' }['SnapshotsOmitted'].size
+    assert samples.size > 0, "no samples in cpu mode"
+    assert (samples.size + omitted) < 400, "samples taken while sleeping"
+    other_threads = samples.select { |tr| tr['NewFrameIds'].any? { |id| frames[id] && frames[id]['M'] == 'OTHER THREADS' } }
+    assert_empty other_threads
+  end
+
+  it 'sends the snapshots in batches' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      SolarWindsAPM::Config[:profiling_batch_size] = 50
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          20.times { TestMethods.recurse(1500) }
+          TestMethods.sleep_a_bit(0.2)
+        end
+      end
+
+      traces = profiling_traces
+      assert_empty traces.select { |tr| tr['Label'] == 'info' }
+      batches = traces.select { |tr| tr['Label'] == 'batch' }
+      assert batches.size > 0, "no batch found"
+
+      frames = frame_dictionary(traces)
+      batches.each do |tr|
+        assert tr['Timestamps'].size <= 50
+        assert_equal tr['Timestamps'].size, tr['FramesExited'].size
+        assert_equal tr['Timestamps'].size, tr['FramesCount'].size
+        assert_equal tr['Timestamps'].size, tr['NewFrameCounts'].size
+        assert_equal tr['NewFrameCounts'].sum, tr['NewFrameIds'].size
+        tr['NewFrameIds'].each { |id| assert frames[id], "frame #{id} not in dictionary" }
+      end
+      # the sleep is in the omitted snapshots
+      assert batches.sum { |tr| tr['SnapshotsOmitted'].size } > 100
+    ensure
+      SolarWindsAPM::Config[:profiling_batch_size] = 0
+    end
+  end
+
+  it 'sends the GC pauses with the stack that allocated' do
+    SolarWindsAPM::SDK.start_trace(:trace) do
+      SolarWindsAPM::Profiling.run do
+        3.times { GC.start; TestMethods.recurse(100) }
+      end
+    end
+
+    gcs = profiling_traces.select { |tr| tr['Label'] == 'gc' }
+    refute_empty gcs
+    gcs.each do |tr|
+      assert_equal tr['Timestamps'].size, tr['MarkNs'].size
+      assert_equal tr['Timestamps'].size, tr['SweepNs'].size
+      assert_equal tr['Timestamps'].size, tr['GcFlags'].size
+      refute_empty tr['FrameIds']
+    end
+    # GC.start is a major GC, marked and swept in one pause (flags 1 | 2 | 4)
+    assert gcs.sum { |tr| tr['GcFlags'].count(7) } >= 3
+  end
+
+  it 'sends the sampled allocations per stack' do
+    SolarWindsAPM::Config[:profiling_alloc_interval] = 64
+    begin
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        x = 'x'
+        SolarWindsAPM::Profiling.run do
+          100_000.times { x * 100 }
+        end
+      end
+
+      allocs = profiling_traces.select { |tr| tr['Label'] == 'alloc' }
+      refute_empty allocs
+      allocs.each do |tr|
+        assert_equal tr['StackFrameCounts'].size, tr['Allocations'].size
+        assert_equal tr['StackFrameCounts'].size, tr['Bytes'].size
+        assert_equal tr['StackFrameCounts'].sum, tr['FrameIds'].size
+        assert_equal 64, tr['SampleInterval']
+      end
+      # weighted, about one allocation per string
+      count = allocs.sum { |tr| tr['Allocations'].sum }
+      assert_in_delta 100_000, count, 20_000
+    ensure
+      SolarWindsAPM::Config[:profiling_alloc_interval] = 0
+    end
+  end
+
+  it 'sends the time waiting for the GVL and off CPU' do
+    skip 'needs Ruby 3.2+' if RUBY_VERSION < '3.2'
+
+    busy = Thread.new { 30.times { TestMethods.recurse(1500) } }
+    SolarWindsAPM::SDK.start_trace(:trace) do
+      SolarWindsAPM::Profiling.run do
+        TestMethods.sleep_a_bit(0.1)
+        30.times { TestMethods.recurse(1500) }
+      end
+    end
+    busy.join
+
+    gvls = profiling_traces.select { |tr| tr['Label'] == 'gvl' }
+    refute_empty gvls
+    gvls.each do |tr|
+      assert_equal tr['States'].size, tr['Timestamps'].size
+      assert_equal tr['States'].size, tr['DurationsUs'].size
+    end
+    # the sleep, state 2
+    assert gvls.any? { |tr| tr['States'].each_index.any? { |i| tr['States'][i] == 2 && tr['DurationsUs'][i] >= 90_000 } }
+    assert gvls.sum { |tr| tr['OffCpuUs'] } >= 100_000
+  end
+
+  it 'sends the line of each new frame' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      SolarWindsAPM::Config[:profiling_lines] = true
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          20.times { TestMethods.recurse(1500) }
+        end
+      end
+
+      traces = profiling_traces
+      frames = frame_dictionary(traces)
+      samples = traces.select { |tr| tr['Label'] == 'info' }
+      refute_empty samples
+      recurse_lines = []
+      samples.each do |tr|
+        assert_equal tr['NewFrameIds'].size, tr['NewFrameLines'].size
+        tr['NewFrameIds'].each_with_index do |id, i|
+          recurse_lines << tr['NewFrameLines'][i] if frames[id] && frames[id]['M'] == 'recurse'
+        end
+      end
+      # in the body of the method, after its def
+      def_line = TestMethods.method(:recurse).source_location[1]
+      refute_empty recurse_lines
+      assert recurse_lines.all? { |line| line > def_line && line <= def_line + 4 }
+    ensure
+      SolarWindsAPM::Config[:profiling_lines] = false
+    end
+  end
+
+  it 'sends the native frames of C extensions' do
+    skip 'no native stacks on this platform' unless SolarWindsAPM::CProfiler.set_native(true)
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      SolarWindsAPM::Config[:profiling_native] = true
+      data = Random.new(1).bytes(1 << 20)
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          20.times { Zlib::Deflate.deflate(data) }
+        end
+      end
+
+      # at least the innermost one, in zlib or its extension
+      frames = frame_dictionary(profiling_traces)
+      assert frames.values.any? { |frame| frame['F'].to_s =~ /libz|zlib/ }
+    ensure
+      SolarWindsAPM::Config[:profiling_native] = false
+    end
+  end
+
+  it 'keeps the runs of fibers apart' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    SolarWindsAPM::SDK.start_trace(:trace) do
+      fibers = [
+        Fiber.new { SolarWindsAPM::Profiling.run { 10.times { TestMethods.recurse(1500); Fiber.yield } } },
+        Fiber.new { SolarWindsAPM::Profiling.run { 10.times { TestMethods.sleep_a_bit(0.01); Fiber.yield } } }
+      ]
+      11.times { fibers.each(&:resume) }
+    end
+
+    # the events of each run follow their own edges
+    traces = profiling_traces
+    frames = frame_dictionary(traces)
+    runs = []
+    run_of = {}
+    traces.each do |tr|
+      run = tr['Label'] == 'entry' ? (runs << []).last : run_of[tr['Edge']]
+      next unless run
+
+      run << tr
+      run_of[SolarWindsAPM::TraceString.span_id(tr['X-Trace'])] = run
+    end
+    assert_equal 2, runs.size
+    assert_equal runs[0].first['TID'], runs[1].first['TID']
+    runs.each { |run| assert_equal 'exit', run.last['Label'] }
+
+    methods = runs.map do |run|
+      run.flat_map { |tr| tr['NewFrameIds'] || [] }.map { |id| frames[id] && frames[id]['M'] }
+    end
+    assert_includes methods[0], 'recurse'
+    refute_includes methods[0], 'sleep_a_bit'
+    assert_includes methods[1], 'sleep_a_bit'
+    refute_includes methods[1], 'recurse'
+  end
+
+  it 'reports its own cost' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      SolarWindsAPM::Config[:profiling_exit_stats] = true
+      ticks = SolarWindsAPM::CProfiler.stats[:ticks]
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          20.times { TestMethods.recurse(1500) }
+        end
+      end
+
+      traces = profiling_traces
+      exit_trace = traces.find { |tr| tr['Label'] == 'exit' }
+      samples = traces.select { |tr| tr['Label'] == 'info' }
+      omitted = samples.sum { |tr| tr['SnapshotsOmitted'].size } + exit_trace['SnapshotsOmitted'].size
+      assert exit_trace['StatsSamples'] > 0
+      assert_equal samples.size + omitted, exit_trace['StatsSnapshots']
+      assert_equal omitted, exit_trace['StatsSnapshotsOmitted']
+      assert exit_trace['StatsLoggingNs'] > 0
+
+      stats = SolarWindsAPM::CProfiler.stats
+      assert stats[:ticks] > ticks
+      assert stats[:job_latency][:count] > 0
+      thread = stats[:threads].find { |t| t[:tid] == exit_trace['TID'] }
+      assert thread[:samples] >= exit_trace['StatsSamples']
+      assert thread[:remove_garbage][:count] > 0
+    ensure
+      SolarWindsAPM::Config[:profiling_exit_stats] = false
+    end
+  end
+
+  it 'sends one pprof profile per run' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      SolarWindsAPM::Config[:profiling_format] = :pprof
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          20.times { TestMethods.recurse(1500) }
+          TestMethods.sleep_a_bit(0.1)
+        end
+      end
+
+      traces = profiling_traces
+      assert_empty traces.select { |tr| tr['Label'] == 'info' }
+      assert_equal 1, traces.select { |tr| tr['Label'] == 'entry' }.size
+      assert_equal 1, traces.select { |tr| tr['Label'] == 'exit' }.size
+
+      profiles = traces.select { |tr| tr['Label'] == 'profile' }
+      assert_equal 1, profiles.size
+      assert_equal 'pprof', profiles[0]['Format']
+      profile = profiles[0]['Profile'].unpack1('m0')
+      # the names are in the string table
+      assert profile.include?('recurse'), "no recurse in the profile"
+      assert profile.include?('TestMethods'), "no TestMethods in the profile"
+    ensure
+      SolarWindsAPM::Config[:profiling_format] = :events
+    end
+  end
+
+  it 'sends the sample counts per stack in collapsed format' do
+    SolarWindsAPM::Config[:profiling_interval] = 1
+    begin
+      SolarWindsAPM::Config[:profiling_format] = :collapsed
+      SolarWindsAPM::SDK.start_trace(:trace) do
+        SolarWindsAPM::Profiling.run do
+          20.times { TestMethods.recurse(1500) }
+        end
+      end
+
+      traces = profiling_traces
+      assert_empty traces.select { |tr| tr['Label'] == 'info' }
+      profiles = traces.select { |tr| tr['Label'] == 'profile' }
+      assert profiles.size >= 1, "no profile found"
+      assert profiles.all? { |tr| tr['Format'] == 'collapsed' }
+
+      # "outer;...;inner count" lines, samples with an empty stack are left out
+      profiles.each do |tr|
+        lines = tr['Profile'].lines
+        assert lines.all? { |line| line =~ /\A\S.* \d+\n\z/ }
+        assert lines.sum { |line| line.rpartition(' ').last.to_i } <= tr['Samples']
+      end
+      lines = profiles.flat_map { |tr| tr['Profile'].lines }
+      assert lines.any? { |line| line.include?('TestMethods#recurse;TestMethods#recurse') }
+    ensure
+      SolarWindsAPM::Config[:profiling_format] = :events
+    end
+  end
+
+  it 'writes the events into a ring file' do
+    Dir.mktmpdir do |dir|
+      begin
+        SolarWindsAPM::Config[:profiling_ring_bytes] = 1024 * 1024
+        SolarWindsAPM::Config[:profiling_ring_dir] = dir
+        SolarWindsAPM::SDK.start_trace(:trace) do
+          SolarWindsAPM::Profiling.run do
+            TestMethods.sleep_a_bit(0.1)
+          end
+        end
+        sleep 0.1
+      ensure
+        SolarWindsAPM::Config[:profiling_ring_dir] = nil
+      end
+
+      file = File.join(dir, "solarwinds_apm_profile.#{Process.pid}.ring")
+      assert File.exist?(file), "no ring file"
+      tool = File.expand_path('../../bin/solarwinds_apm_profile_dump', __dir__)
+      events = `ruby #{tool} #{file} 2>/dev/null`.lines.map { |line| JSON.parse(line) }
+      assert_equal 'entry', events.first['Label']
+      assert_equal 'exit', events.last['Label']
+      assert_equal SolarWindsAPM::CProfiler.get_tid, events.first['TID']
+    end
   end
 
   it 'logs snapshot after stack change' do
@@ -91,13 +461,14 @@ describe "Profiling: " do
       end
     end
 
-    traces = get_all_traces
-    traces.select! { |tr| tr['Spec'] == 'profiling' && tr['Label'] == 'info' }
-    traces.select! { |tr| tr['NewFrames'][0]['M'] == 'recurse' }
+    traces = profiling_traces
+    frames = frame_dictionary(traces)
+    traces.select! { |tr| tr['Label'] == 'info' && tr['NewFrameIds'].size > 0 }
+    traces.select! { |tr| frames[tr['NewFrameIds'][0]]['M'] == 'recurse' }
 
-    assert_equal 'info', traces[0]['Label']                # obviously
-    assert_equal 'recurse', traces[0]['NewFrames'][0]['M'] # obviously
-    assert_equal 'TestMethods', traces[0]['NewFrames'][0]['C']
+    assert_equal 'info', traces[0]['Label']                          # obviously
+    assert_equal 'recurse', frames[traces[0]['NewFrameIds'][0]]['M'] # obviously
+    assert_equal 'TestMethods', frames[traces[0]['NewFrameIds'][0]]['C']
     assert traces[0]['FramesExited'] >= 1
     assert (15 < traces[0]['FramesCount']) # different number in travis
   end
@@ -137,9 +508,9 @@ describe "Profiling: " do
       end
     end
 
-    traces = get_all_traces
-
-    traces.select! { |tr| tr['Spec'] == 'profiling' }
+    traces = profiling_traces
+    # the dictionary is not a snapshot
+    traces.reject! { |tr| tr['Label'] == 'dictionary' }
 
     num = 0
     traces.each do |tr|
@@ -185,8 +556,7 @@ describe "Profiling: " do
       end
     end
     sleep 1
-    traces = get_all_traces
-    traces.select! { |tr| tr['Spec'] == 'profiling' }
+    traces = profiling_traces
 
     # for each thread we want to see an entry and exit trace
     tids.each do |tid|
@@ -195,6 +565,43 @@ describe "Profiling: " do
     end
   end
 
+  it 'samples the other threads in wall clock mode' do
+    skip 'needs Ruby 3.3+' unless SolarWindsAPM::CProfiler.set_threads_per_tick(4) == 4
+
+    begin
+      SolarWindsAPM::Config[:profiling_interval] = 1
+      tids = []
+      SolarWindsAPM::SDK.start_trace("trace_main") do
+        SolarWindsAPM::Profiling.run do
+          threads = 3.times.map do
+            Thread.new do
+              tids << SolarWindsAPM::CProfiler.get_tid
+              SolarWindsAPM::SDK.start_trace("trace_thread") do
+                SolarWindsAPM::Profiling.run do
+                  20.times { TestMethods.recurse(1500) }
+                end
+              end
+            end
+          end
+          threads.each(&:join)
+        end
+      end
+
+      assert SolarWindsAPM::CProfiler.sampling_stats[:other_threads_sampled] > 0
+      traces = profiling_traces
+      frames = frame_dictionary(traces)
+
+      # every thread has real frames, not only OTHER THREADS
+      tids.each do |tid|
+        snapshots = traces.select { |tr| tr['TID'] == tid && tr['Label'] == 'info' }
+        assert snapshots.any? { |tr| tr['NewFrameIds'].any? { |id| frames[id] && frames[id]['M'] == 'recurse' } },
+               "no real frames for thread #{tid}"
+      end
+    ensure
+      SolarWindsAPM::CProfiler.set_threads_per_tick(0)
+    end
+  end
+
   it 'does not shorten sleep' do
     SolarWindsAPM::Config[:profiling_interval] = 1
     SolarWindsAPM::SDK.start_trace(:trace) do
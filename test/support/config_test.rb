@@ -3,6 +3,7 @@
 
 require 'minitest_helper'
 require 'mocha/minitest'
+require 'tmpdir'
 
 describe "SolarWindsAPM::Config" do
   include Minitest::Hooks
@@ -416,4 +417,268 @@ describe "SolarWindsAPM::Config" do
     end
   end
 
+  describe "profiling_mode configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'accepts :cpu and :wall' do
+      SolarWindsAPM::Config['profiling_mode'] = :cpu
+      _(SolarWindsAPM::Config.profiling_mode).must_equal :cpu
+      SolarWindsAPM::Config['profiling_mode'] = 'wall'
+      _(SolarWindsAPM::Config.profiling_mode).must_equal :wall
+    end
+
+    it 'sets the default of :wall for invalid entries' do
+      SolarWindsAPM::Config['profiling_mode'] = :both
+      _(SolarWindsAPM::Config.profiling_mode).must_equal :wall
+    end
+  end
+
+  describe "profiling_format configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'accepts :events, :pprof and :collapsed' do
+      SolarWindsAPM::Config['profiling_format'] = 'pprof'
+      _(SolarWindsAPM::Config.profiling_format).must_equal :pprof
+      SolarWindsAPM::Config['profiling_format'] = :collapsed
+      _(SolarWindsAPM::Config.profiling_format).must_equal :collapsed
+      SolarWindsAPM::Config['profiling_format'] = :events
+      _(SolarWindsAPM::Config.profiling_format).must_equal :events
+    end
+
+    it 'sets the default of :events for invalid entries' do
+      SolarWindsAPM::Config['profiling_format'] = :json
+      _(SolarWindsAPM::Config.profiling_format).must_equal :events
+    end
+  end
+
+  describe "profiling_ring_dir and profiling_ring_bytes configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    after do
+      SolarWindsAPM::Config['profiling_ring_dir'] = nil
+    end
+
+    it 'accepts an existing directory and a size' do
+      SolarWindsAPM::Config['profiling_ring_bytes'] = 1024 * 1024
+      _(SolarWindsAPM::Config.profiling_ring_bytes).must_equal 1024 * 1024
+      SolarWindsAPM::Config['profiling_ring_dir'] = Dir.tmpdir
+      _(SolarWindsAPM::Config.profiling_ring_dir).must_equal Dir.tmpdir
+    end
+
+    it 'sets the defaults for invalid entries' do
+      SolarWindsAPM::Config['profiling_ring_dir'] = '/does/not/exist'
+      _(SolarWindsAPM::Config.profiling_ring_dir).must_be_nil
+      SolarWindsAPM::Config['profiling_ring_bytes'] = 100
+      _(SolarWindsAPM::Config.profiling_ring_bytes).must_equal 16 * 1024 * 1024
+    end
+  end
+
+  describe "profiling_threads_per_tick configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'accepts 0 and positive values' do
+      SolarWindsAPM::Config['profiling_threads_per_tick'] = 8
+      _(SolarWindsAPM::Config.profiling_threads_per_tick).must_equal 8
+      SolarWindsAPM::Config['profiling_threads_per_tick'] = 0
+      _(SolarWindsAPM::Config.profiling_threads_per_tick).must_equal 0
+    end
+
+    it 'sets the default of 0 for invalid entries' do
+      SolarWindsAPM::Config['profiling_threads_per_tick'] = -3
+      _(SolarWindsAPM::Config.profiling_threads_per_tick).must_equal 0
+    end
+  end
+
+  describe "profiling_overhead_budget configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'accepts percentages' do
+      SolarWindsAPM::Config['profiling_overhead_budget'] = 2.5
+      _(SolarWindsAPM::Config.profiling_overhead_budget).must_equal 2.5
+      SolarWindsAPM::Config['profiling_overhead_budget'] = 1
+      _(SolarWindsAPM::Config.profiling_overhead_budget).must_equal 1
+    end
+
+    it 'sets the default of 0 for invalid entries' do
+      SolarWindsAPM::Config['profiling_overhead_budget'] = 101
+      _(SolarWindsAPM::Config.profiling_overhead_budget).must_equal 0
+      SolarWindsAPM::Config['profiling_overhead_budget'] = 'abc'
+      _(SolarWindsAPM::Config.profiling_overhead_budget).must_equal 0
+    end
+
+    it 'sets the default of 0 for budgets too small to adapt to' do
+      SolarWindsAPM::Config['profiling_overhead_budget'] = 0.0001
+      _(SolarWindsAPM::Config.profiling_overhead_budget).must_equal 0
+      SolarWindsAPM::Config['profiling_overhead_budget'] = 0.0004
+      _(SolarWindsAPM::Config.profiling_overhead_budget).must_equal 0.0004
+    end
+  end
+
+  describe "profiling_batch_size and profiling_batch_ms configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'accepts valid values' do
+      SolarWindsAPM::Config['profiling_batch_size'] = 100
+      _(SolarWindsAPM::Config.profiling_batch_size).must_equal 100
+      SolarWindsAPM::Config['profiling_batch_ms'] = 250
+      _(SolarWindsAPM::Config.profiling_batch_ms).must_equal 250
+    end
+
+    it 'sets the defaults for invalid entries' do
+      SolarWindsAPM::Config['profiling_batch_size'] = -1
+      _(SolarWindsAPM::Config.profiling_batch_size).must_equal 0
+      SolarWindsAPM::Config['profiling_batch_ms'] = 0
+      _(SolarWindsAPM::Config.profiling_batch_ms).must_equal 1000
+    end
+  end
+
+  describe "profiling_exit_stats configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is off by default' do
+      _(SolarWindsAPM::Config.profiling_exit_stats).must_equal false
+    end
+
+    it 'only turns on for true' do
+      SolarWindsAPM::Config['profiling_exit_stats'] = true
+      _(SolarWindsAPM::Config.profiling_exit_stats).must_equal true
+      SolarWindsAPM::Config['profiling_exit_stats'] = 'yes'
+      _(SolarWindsAPM::Config.profiling_exit_stats).must_equal false
+    end
+  end
+
+  describe "profiling_gc_events configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is on by default' do
+      _(SolarWindsAPM::Config.profiling_gc_events).must_equal true
+    end
+
+    it 'only turns off for false' do
+      SolarWindsAPM::Config['profiling_gc_events'] = false
+      _(SolarWindsAPM::Config.profiling_gc_events).must_equal false
+      SolarWindsAPM::Config['profiling_gc_events'] = 'no'
+      _(SolarWindsAPM::Config.profiling_gc_events).must_equal true
+    end
+  end
+
+  describe "profiling_alloc_interval configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is off by default' do
+      _(SolarWindsAPM::Config.profiling_alloc_interval).must_equal 0
+    end
+
+    it 'sets 0 for invalid entries' do
+      SolarWindsAPM::Config['profiling_alloc_interval'] = 512
+      _(SolarWindsAPM::Config.profiling_alloc_interval).must_equal 512
+      SolarWindsAPM::Config['profiling_alloc_interval'] = -1
+      _(SolarWindsAPM::Config.profiling_alloc_interval).must_equal 0
+      SolarWindsAPM::Config['profiling_alloc_interval'] = '512'
+      _(SolarWindsAPM::Config.profiling_alloc_interval).must_equal 0
+    end
+  end
+
+  describe "profiling_gvl_events configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is on by default' do
+      _(SolarWindsAPM::Config.profiling_gvl_events).must_equal true
+    end
+
+    it 'only turns off for false' do
+      SolarWindsAPM::Config['profiling_gvl_events'] = false
+      _(SolarWindsAPM::Config.profiling_gvl_events).must_equal false
+      SolarWindsAPM::Config['profiling_gvl_events'] = nil
+      _(SolarWindsAPM::Config.profiling_gvl_events).must_equal true
+    end
+  end
+
+  describe "profiling_lines configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is off by default' do
+      _(SolarWindsAPM::Config.profiling_lines).must_equal false
+    end
+
+    it 'only turns on for true' do
+      SolarWindsAPM::Config['profiling_lines'] = true
+      _(SolarWindsAPM::Config.profiling_lines).must_equal true
+      SolarWindsAPM::Config['profiling_lines'] = 1
+      _(SolarWindsAPM::Config.profiling_lines).must_equal false
+    end
+  end
+
+  describe "profiling_native configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is off by default' do
+      _(SolarWindsAPM::Config.profiling_native).must_equal false
+    end
+
+    it 'only turns on for true' do
+      SolarWindsAPM::Config['profiling_native'] = true
+      _(SolarWindsAPM::Config.profiling_native).must_equal true
+      SolarWindsAPM::Config['profiling_native'] = 'true'
+      _(SolarWindsAPM::Config.profiling_native).must_equal false
+    end
+  end
+
+  describe "profiling_frame_ids configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'is off by default' do
+      _(SolarWindsAPM::Config.profiling_frame_ids).must_equal false
+    end
+
+    it 'only turns on for true' do
+      SolarWindsAPM::Config['profiling_frame_ids'] = true
+      _(SolarWindsAPM::Config.profiling_frame_ids).must_equal true
+      SolarWindsAPM::Config['profiling_frame_ids'] = 'true'
+      _(SolarWindsAPM::Config.profiling_frame_ids).must_equal false
+    end
+  end
+
+  describe "profiling_frame_cache_bytes configuration" do
+    before do
+      SolarWindsAPM::Config.load_config_file
+    end
+
+    it 'accepts a positive value' do
+      SolarWindsAPM::Config['profiling_frame_cache_bytes'] = 1_000_000
+      _(SolarWindsAPM::Config.profiling_frame_cache_bytes).must_equal 1_000_000
+    end
+
+    it 'sets the default of 4MB for invalid entries' do
+      SolarWindsAPM::Config['profiling_frame_cache_bytes'] = -1
+      _(SolarWindsAPM::Config.profiling_frame_cache_bytes).must_equal 4 * 1024 * 1024
+    end
+  end
+
 end